@@ -30,25 +30,163 @@ THE SOFTWARE.
 #include <stdbool.h>
 #include "stm32f4xx_hal.h"
 #include <gs_usb.h>
+#include "config.h"
+
+#define CAN_RX_FIFO_COUNT   2
+#define CAN_TX_MAILBOX_COUNT 3
+#define CAN_IRQ_PRIORITY    5 /* same as the USB OTG interrupt, so both may use the queue_*_i functions
+                                 and the RX and TX handlers may share q_to_host's producer side */
+#define CAN_TX_PRIO_CLASSES 4 /* TX delay statistics are kept per top two standard ID bits */
+
+/* In FIFO split mode, frames matching this 32-bit scale filter go to FIFO 0
+ * and are serviced first, everything else goes to FIFO 1. The default
+ * matches standard IDs below 0x400 and extended IDs below 0x10000000. */
+#define CAN_SPLIT_FILTER_ID   0x00000000
+#define CAN_SPLIT_FILTER_MASK 0x80000000
+
+/* bit rate a channel comes up with before the host configures it */
+#define CAN_BITRATE_DEFAULT 1000000
+
+/* the 28 filter banks live in CAN1 and are split evenly between the channels */
+#define CAN_FILTER_BANKS_TOTAL  28
+#define CAN_FILTER_BANKS        (CAN_FILTER_BANKS_TOTAL / 2)
+
+typedef struct {
+	uint32_t fr1;
+	uint32_t fr2;
+	uint8_t mode; /* enum gs_can_filter_mode */
+	uint8_t fifo;
+} can_filter_t;
+
+typedef struct {
+	uint16_t brp;
+	uint8_t phase_seg1; /* prop_seg + phase_seg1 */
+	uint8_t phase_seg2;
+	uint8_t sjw;
+} can_bittiming_t;
+
+/* decimation state of one ID a slot matched */
+typedef struct {
+	uint32_t can_id;
+	uint32_t count;
+	uint32_t last_us;
+	uint8_t last_dlc;
+	uint8_t last_data[8];
+} can_decimate_id_t;
+
+/* receive decimation slot, see struct gs_device_decimate */
+typedef struct {
+	uint32_t id;
+	uint32_t mask;
+	uint32_t param;
+	uint8_t mode;    /* enum gs_can_decimate_mode */
+	uint8_t ids;     /* entries of seen[] in use */
+	uint8_t next;    /* entry replaced next once all are in use */
+	can_decimate_id_t seen[CAN_DECIMATE_IDS];
+} can_decimate_t;
+
+/* a queued host frame and its arbitration key, lower keys win on the bus */
+typedef struct {
+	uint32_t key;
+	struct gs_host_frame *frame;
+} can_tx_entry_t;
+
+typedef enum {
+	can_tx_ok,
+	can_tx_lost_arbitration,
+	can_tx_error,
+	can_tx_aborted
+} can_tx_result_t;
 
 typedef struct {
 	CAN_TypeDef *instance;
+	IRQn_Type tx_irq;
+	uint8_t channel;
+	uint8_t filter_base;
 	uint16_t brp;
 	uint8_t phase_seg1;
 	uint8_t phase_seg2;
 	uint8_t sjw;
+
+	bool fifo_split;
+	bool host_filters;
+	can_filter_t filters[CAN_FILTER_BANKS];
+
+	can_decimate_t decimate[CAN_DECIMATE_SLOTS];
+	uint8_t decimate_slots; /* highest used slot + 1, 0 skips the lookup */
+
+	/* frame in each TX mailbox, handed back on transmit complete */
+	struct gs_host_frame *volatile tx_frames[CAN_TX_MAILBOX_COUNT];
+	uint32_t tx_keys[CAN_TX_MAILBOX_COUNT];
+	uint8_t tx_abort_pending; /* mailbox mask, aborted to make room for a more urgent frame */
+
+	/* frames waiting for a mailbox, sorted by falling key: the most urgent is last */
+	can_tx_entry_t tx_queue[CAN_TX_QUEUE_SIZE];
+	unsigned tx_queue_len;
+	unsigned tx_queue_high_water;
+
+	volatile uint32_t tx_queued;
+	volatile uint32_t tx_echoed;
+	volatile uint32_t tx_failed;
+	volatile uint32_t bus_errors;
+	volatile uint32_t tx_preempted;
+	volatile uint32_t tx_prio_frames[CAN_TX_PRIO_CLASSES];
+	volatile uint32_t tx_prio_delay_us[CAN_TX_PRIO_CLASSES];
+	volatile uint32_t tx_prio_delay_max_us[CAN_TX_PRIO_CLASSES];
+	volatile uint32_t periodic_frames;
+	volatile uint32_t periodic_missed;
+	volatile uint32_t tx_at_frames;
+	volatile uint32_t tx_at_expired;
+	volatile uint32_t tx_at_late_max_us;
+	volatile uint32_t rx_decimated;
+
+	/* error events, collected by can_error_irq() until the next report */
+	uint8_t err_state;          /* enum gs_can_state */
+	uint8_t err_reported_state;
+	uint8_t err_lec_seen;       /* bit n: LEC code n+1 occurred */
+	bool err_restarted;         /* left bus off */
+	volatile bool err_pending;
+	uint32_t err_interval_us;
+	uint32_t err_report_us;
+	volatile uint32_t err_lec[6];
+	volatile uint32_t bus_off_count;
+
+	volatile bool rx_irq_masked;
+	volatile bool rx_overflow; /* frames were lost, flag the next one for the host */
+	volatile uint32_t rx_pool_empty;
+	volatile uint32_t to_host_dropped;
+	volatile uint32_t rx_fifo_frames[CAN_RX_FIFO_COUNT];
+	volatile uint32_t rx_fifo_overruns[CAN_RX_FIFO_COUNT];
 } can_data_t;
 
-void can_init(can_data_t *hcan, CAN_TypeDef *instance);
+void can_init(can_data_t *hcan, CAN_TypeDef *instance, uint8_t channel);
+void can_set_fifo_split(can_data_t *hcan, bool enable);
+bool can_set_filter(can_data_t *hcan, const struct gs_device_filter *filter);
+void can_clear_filters(can_data_t *hcan);
+bool can_set_decimate(can_data_t *hcan, const struct gs_device_decimate *decimate);
+bool can_decimate(can_data_t *hcan, const struct gs_host_frame *frame);
+uint32_t can_get_clock(void);
+bool can_calc_bittiming(uint32_t fclk, uint32_t bitrate, uint16_t sample_point, can_bittiming_t *bt);
 bool can_set_bittiming(can_data_t *hcan, uint16_t brp, uint8_t phase_seg1, uint8_t phase_seg2, uint8_t sjw);
+bool can_set_bitrate(can_data_t *hcan, uint32_t bitrate, uint16_t sample_point);
 void can_enable(can_data_t *hcan, bool loop_back, bool listen_only, bool one_shot);
 void can_disable(can_data_t *hcan);
 bool can_is_enabled(can_data_t *hcan);
 
 bool can_receive(can_data_t *hcan, struct gs_host_frame *rx_frame);
 bool can_is_rx_pending(can_data_t *hcan);
+bool can_receive_fifo(can_data_t *hcan, uint8_t fifo, struct gs_host_frame *rx_frame);
+bool can_is_rx_pending_fifo(can_data_t *hcan, uint8_t fifo);
+bool can_check_rx_overrun(can_data_t *hcan, uint8_t fifo);
+void can_rx_irq_mask(can_data_t *hcan);
+void can_rx_irq_unmask(can_data_t *hcan);
 
 bool can_send(can_data_t *hcan, struct gs_host_frame *frame);
+void can_tx_schedule(can_data_t *hcan);
+struct gs_host_frame *can_tx_complete(can_data_t *hcan, can_tx_result_t *result);
+bool can_parse_tx_error(can_tx_result_t result, struct gs_host_frame *frame);
 
-uint32_t can_get_error_status(can_data_t *hcan);
-bool can_parse_error_status(uint32_t err, struct gs_host_frame *frame);
+bool can_error_irq(can_data_t *hcan);
+void can_set_error_interval(can_data_t *hcan, uint32_t interval_us);
+bool can_error_report_due(can_data_t *hcan, uint32_t now);
+void can_error_report(can_data_t *hcan, uint32_t now, struct gs_host_frame *frame);
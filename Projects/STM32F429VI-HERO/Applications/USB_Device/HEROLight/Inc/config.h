@@ -0,0 +1,103 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#pragma once
+
+/* Number of gs_host_frame buffers shared by all queues. Size this against
+ * the longest host stall that has to be absorbed: a 1 Mbit/s bus full of
+ * short frames delivers about 18 frames per millisecond. */
+#ifndef CAN_QUEUE_SIZE
+#define CAN_QUEUE_SIZE 256
+#endif
+
+#if (CAN_QUEUE_SIZE & (CAN_QUEUE_SIZE - 1)) != 0
+#error "CAN_QUEUE_SIZE must be a power of two, the host queues are index-masked rings"
+#endif
+
+/* Host frames per channel waiting for a TX mailbox, sorted by CAN ID */
+#ifndef CAN_TX_QUEUE_SIZE
+#define CAN_TX_QUEUE_SIZE 32
+#endif
+
+/* Entries of the on-device periodic transmit table, shared by the channels */
+#ifndef CAN_PERIODIC_SLOTS
+#define CAN_PERIODIC_SLOTS 16
+#endif
+
+/* Host frames held for a GS_CAN_FLAG_TX_AT time, shared by the channels */
+#ifndef CAN_TX_AT_QUEUE_SIZE
+#define CAN_TX_AT_QUEUE_SIZE 64
+#endif
+
+/* Entries of the per channel receive decimation table. Every received
+ * frame is compared against the used ones. */
+#ifndef CAN_DECIMATE_SLOTS
+#define CAN_DECIMATE_SLOTS 16
+#endif
+
+/* IDs each decimation slot keeps apart. A slot matching more than this
+ * forgets the ID it tracks longest, whose next frame is then forwarded. */
+#ifndef CAN_DECIMATE_IDS
+#define CAN_DECIMATE_IDS 8
+#endif
+
+/* Shortest time between two error frames of a channel, so a noisy bus
+ * cannot flood the host. Changed with GS_USB_BREQ_SET_ERROR_INTERVAL. */
+#ifndef CAN_ERROR_REPORT_US
+#define CAN_ERROR_REPORT_US 10000
+#endif
+
+/* Place the frame pool in the 64K core coupled RAM. The USB core must not
+ * reach it by DMA then, and the linker needs a .ccmram output section. */
+#ifndef CAN_POOL_IN_CCMRAM
+#define CAN_POOL_IN_CCMRAM 0
+#endif
+
+/* Let the OTG_HS core move packet data with its internal DMA (USE_USBD_HS
+ * builds only). USB buffers then have to be word aligned and outside the
+ * core coupled RAM. Off until it was tried on hardware and compared against
+ * the FIFO copies with PROFILE_ENABLE; the simulation has no DMA model. */
+#ifndef USB_HS_DMA_ENABLE
+#define USB_HS_DMA_ENABLE 0
+#endif
+
+#if defined(USE_USBD_HS) && USB_HS_DMA_ENABLE && CAN_POOL_IN_CCMRAM
+#error "the OTG_HS DMA cannot reach the core coupled RAM, disable CAN_POOL_IN_CCMRAM"
+#endif
+
+/* Count CPU cycles spent in the main loop stages and interrupt handlers,
+ * see profile.h. Costs a few cycles per zone, nothing when disabled. */
+#ifndef PROFILE_ENABLE
+#define PROFILE_ENABLE 0
+#endif
+
+/* Sleep on WFI until an interrupt posts work for the main loop. With 0 the
+ * loop never sleeps and runs every stage on each pass, which shows what the
+ * sleep costs in receive latency (GS_USB_BREQ_GET_STATS). It is not the
+ * polling loop from before the events, that one moved a host frame per pass. */
+#ifndef MAIN_LOOP_SLEEP
+#define MAIN_LOOP_SLEEP 1
+#endif
@@ -0,0 +1,40 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+/* work items posted by the interrupt handlers for the main loop */
+#define EVENT_FROM_HOST  (1<<0) /* q_from_host got a frame */
+#define EVENT_TO_HOST    (1<<1) /* q_to_host got a frame or the IN endpoint became free */
+#define EVENT_CAN_TX     (1<<2) /* TX mailboxes completed, queue room for host frames */
+#define EVENT_CAN_ERROR  (1<<3) /* bxCAN error status changed */
+#define EVENT_TICK       (1<<4) /* 1 ms system tick */
+#define EVENT_ALL        0x1F
+
+void event_post(uint32_t events);
+uint32_t event_wait(void);
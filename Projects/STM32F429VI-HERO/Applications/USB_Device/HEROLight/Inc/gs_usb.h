@@ -29,6 +29,7 @@ THE SOFTWARE.
 
 #define u32 uint32_t
 #define u8 uint8_t
+#define u64 uint64_t
 
 #define GSUSB_ENDPOINT_IN          0x81
 #define GSUSB_ENDPOINT_OUT         0x02
@@ -43,6 +44,10 @@ THE SOFTWARE.
 
 #define GS_CAN_MODE_PAD_PKTS_TO_MAX_PKT_SIZE    (1<<7)
 
+/* HERO extensions, kept clear of the bits assigned by upstream gs_usb */
+#define GS_CAN_MODE_BATCH_IN                    (1<<16)
+#define GS_CAN_MODE_FIFO_SPLIT                  (1<<17)
+
 #define GS_CAN_FEATURE_LISTEN_ONLY       	(1<<0)
 #define GS_CAN_FEATURE_LOOP_BACK                (1<<1)
 #define GS_CAN_FEATURE_TRIPLE_SAMPLE            (1<<2)
@@ -53,7 +58,29 @@ THE SOFTWARE.
 
 #define GS_CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE (1<<7)
 
+/* HERO extensions, kept clear of the bits assigned by upstream gs_usb */
+#define GS_CAN_FEATURE_BATCH_IN                 (1<<16)
+#define GS_CAN_FEATURE_FIFO_SPLIT               (1<<17)
+#define GS_CAN_FEATURE_SET_BITRATE              (1<<18)
+#define GS_CAN_FEATURE_PROFILE                  (1<<19)
+#define GS_CAN_FEATURE_TIMESYNC                 (1<<20)
+#define GS_CAN_FEATURE_PERIODIC                 (1<<21)
+#define GS_CAN_FEATURE_TX_AT                    (1<<22)
+#define GS_CAN_FEATURE_DECIMATE                 (1<<23)
+#define GS_CAN_FEATURE_IN_WINDOW                (1<<24)
+
+/* set on the first frame received after frames of that channel were lost,
+ * see rx_fifo_overruns and to_host_dropped in struct gs_device_stats */
 #define GS_CAN_FLAG_OVERFLOW 1
+/* HERO extension, echoes only: the frame never made it onto the bus (lost
+ * arbitration or a bus error in one-shot mode, or aborted). Its echo_id is
+ * released like any other, but it was not sent. An error frame with the
+ * cause usually follows the echo; it is left out when the device is short of
+ * buffers, so the flag is what tells a failed frame from a sent one. */
+#define GS_CAN_FLAG_TX_FAILED (1<<6)
+/* HERO extension, host frames only: hold the frame until its timestamp_us
+ * (device time, within +-35 minutes of now). Needs the frame with timestamp. */
+#define GS_CAN_FLAG_TX_AT    (1<<7)
 
 #define CAN_EFF_FLAG 0x80000000U /* EFF/SFF is set in the MSB */
 #define CAN_RTR_FLAG 0x40000000U /* remote transmission request */
@@ -71,6 +98,7 @@ THE SOFTWARE.
 #define CAN_ERR_BUSOFF       0x00000040U /* bus off */
 #define CAN_ERR_BUSERROR     0x00000080U /* bus error (may flood!) */
 #define CAN_ERR_RESTARTED    0x00000100U /* controller restarted */
+#define CAN_ERR_CNT          0x00000200U /* TX error counter / data[6], RX error counter / data[7] */
 
 /* arbitration lost in bit ... / data[0] */
 #define CAN_ERR_LOSTARB_UNSPEC   0x00 /* unspecified */
@@ -146,6 +174,17 @@ enum gs_usb_breq {
 	GS_USB_BREQ_IDENTIFY,
 	GS_USB_BREQ_GET_USER_ID,
 	GS_USB_BREQ_SET_USER_ID,
+
+	/* HERO extensions, kept clear of the requests assigned by upstream gs_usb */
+	GS_USB_BREQ_GET_STATS = 0x30,
+	GS_USB_BREQ_SET_FILTER,
+	GS_USB_BREQ_SET_BITRATE,
+	GS_USB_BREQ_GET_PROFILE,
+	GS_USB_BREQ_GET_TIMESYNC,
+	GS_USB_BREQ_SET_PERIODIC,
+	GS_USB_BREQ_SET_DECIMATE,
+	GS_USB_BREQ_SET_ERROR_INTERVAL, /* wValue = channel, data: u32 microseconds between error frames */
+	GS_USB_BREQ_SET_IN_WINDOW,      /* data: u32 microseconds a batched IN transfer may wait to fill up, 0 = none */
 };
 
 enum gs_can_mode {
@@ -155,6 +194,27 @@ enum gs_can_mode {
 	GS_CAN_MODE_START
 };
 
+enum gs_can_filter_mode {
+	GS_CAN_FILTER_DISABLE = 0,
+	GS_CAN_FILTER_MASK32,
+	GS_CAN_FILTER_LIST32,
+	GS_CAN_FILTER_MASK16,
+	GS_CAN_FILTER_LIST16
+};
+
+/* disabling this bank clears all host filters and restores accept-all */
+#define GS_CAN_FILTER_BANK_ALL 0xFF
+
+enum gs_can_decimate_mode {
+	GS_CAN_DECIMATE_OFF = 0,
+	GS_CAN_DECIMATE_EVERY_NTH,  /* forward the first of every param frames of an ID */
+	GS_CAN_DECIMATE_ON_CHANGE,  /* forward when length or payload differ from the last forwarded frame of the ID */
+	GS_CAN_DECIMATE_INTERVAL    /* forward at most one frame per param microseconds and ID */
+};
+
+/* turning this slot off clears the whole decimation table */
+#define GS_CAN_DECIMATE_SLOT_ALL 0xFF
+
 enum gs_can_state {
 	GS_CAN_STATE_ERROR_ACTIVE = 0,
 	GS_CAN_STATE_ERROR_WARNING,
@@ -164,7 +224,9 @@ enum gs_can_state {
 	GS_CAN_STATE_SLEEPING
 };
 
+#ifndef __packed
 #define __packed __attribute__((packed))
+#endif
 
 /* data types passed between host and device */
 struct gs_host_config {
@@ -216,6 +278,138 @@ struct gs_device_bt_const {
 	u32 brp_inc;
 } __packed;
 
+/* lets the device pick the bit timing, sent with GS_USB_BREQ_SET_BITRATE
+ * (wValue = channel). Applied on the next GS_CAN_MODE_START. */
+struct gs_device_bitrate {
+	u32 bitrate;
+	u32 sample_point;   /* in 1/1000 of the bit time, 0 = CiA recommendation */
+} __packed;
+
+/* per channel counters, read with GS_USB_BREQ_GET_STATS (wValue = channel) */
+struct gs_device_stats {
+	u32 rx_fifo_frames[2];
+	u32 rx_fifo_overruns[2];
+	u32 pool_size;          /* shared by all channels */
+	u32 pool_used_max;      /* high water mark of frames taken from the pool */
+	u32 out_throttle_count; /* times the OUT endpoint was held off for lack of buffers */
+	u32 out_throttle_us;    /* total time it was held off */
+	u32 tx_preempted;       /* mailboxes aborted and requeued for a more urgent frame */
+	u32 tx_prio_frames[4];  /* frames sent per priority class, class 0 = standard IDs 0x000-0x1FF */
+	u32 tx_prio_delay_us[4];     /* summed time from queueing to transmit complete, wraps */
+	u32 tx_prio_delay_max_us[4];
+	u32 rx_frames;          /* taken from both receive FIFOs */
+	u32 tx_queued;          /* host frames accepted for transmission */
+	u32 tx_echoed;          /* transmitted and echoed back to the host */
+	u32 tx_failed;          /* reported back as lost arbitration, bus error or aborted */
+	u32 bus_errors;         /* error frames sent, each sums up an interval */
+	u32 tx_queue_max;       /* high water mark of the channel's TX queue */
+	u32 from_host_max;      /* high water mark of the host -> bus queue, shared */
+	u32 to_host_max;        /* high water mark of the bus -> host queue, shared */
+	u32 out_requests;       /* bulk OUT transfers, shared */
+	u32 out_requests_fail;  /* bulk OUT transfers too short for a frame, shared */
+	u32 rx_latency_hist[16]; /* CAN receive to USB submit: bucket 0 counts < 1 us,
+	                            bucket n [2^(n-1), 2^n) us, the last one everything above */
+	u32 periodic_frames;    /* frames queued by the periodic transmit table */
+	u32 periodic_missed;    /* periodic frames dropped: no buffer, full TX queue or late */
+	u32 tx_at_frames;       /* GS_CAN_FLAG_TX_AT frames released to the TX queue */
+	u32 tx_at_expired;      /* of those, already due when they arrived */
+	u32 tx_at_late_max_us;  /* largest release delay of the others */
+	u32 rx_decimated;       /* received frames held back by the decimation table */
+	u32 err_lec[6];         /* protocol errors: stuff, form, ack, bit recessive, bit dominant, CRC */
+	u32 bus_off;            /* times the channel went bus off */
+	u32 rx_pool_empty;      /* times reception stalled for lack of buffers, frames wait in the FIFOs */
+	u32 to_host_dropped;    /* received frames and error frames dropped: bus -> host queue full */
+	u32 out_dropped;        /* host frames discarded: unknown channel or host -> bus queue full, shared */
+	u32 in_transfers;       /* bulk IN transfers, shared */
+	u32 in_frames;          /* frames carried by them, shared */
+	u32 in_window_expired;  /* batched transfers sent partly filled when the IN window ran out, shared */
+} __packed;
+
+/* cycle counts of one profiling zone, GS_USB_BREQ_GET_PROFILE returns one
+ * per zone in the order of profile_zone_t. wValue != 0 clears them after
+ * reading. Only answered by firmware built with PROFILE_ENABLE. */
+struct gs_device_profile_zone {
+	u32 hits;
+	u32 cycles_min;
+	u32 cycles_max;
+	u32 cycles_avg;
+} __packed;
+
+/* device time latched at the start of a USB frame */
+struct gs_device_sof_sample {
+	u32 frame;              /* USB frame number, 11 bits */
+	u32 reserved;
+	u64 timestamp_us;       /* 64-bit device time; frame timestamps are its low 32 bits */
+} __packed;
+
+/* answer to GS_USB_BREQ_GET_TIMESYNC. The host pairs each sample with its own
+ * time of that USB frame and fits a drift corrected device -> host mapping,
+ * which also extends the 32-bit frame timestamps beyond their 71 minute wrap. */
+#define GS_DEVICE_SOF_SAMPLES 8
+struct gs_device_timesync {
+	u64 now_us;             /* device time when the request was answered */
+	u32 sof_count;          /* SOFs latched since power up, wraps */
+	u32 sample_count;       /* valid entries in samples[] */
+	struct gs_device_sof_sample samples[GS_DEVICE_SOF_SAMPLES]; /* newest first */
+} __packed;
+
+/* one hardware filter bank, sent with GS_USB_BREQ_SET_FILTER (wValue = channel).
+ * IDs and masks use the can_id layout, including CAN_EFF_FLAG and CAN_RTR_FLAG;
+ * a flag set in a mask means the frame type has to match.
+ *   MASK32: id[0] = id, id[1] = mask
+ *   LIST32: id[0], id[1]
+ *   MASK16: id[0] = id, id[1] = mask, id[2] = id, id[3] = mask
+ *   LIST16: id[0] .. id[3]
+ * 16-bit scale filters compare the upper 14 bits of extended IDs only.
+ */
+struct gs_device_filter {
+	u8 bank;
+	u8 mode;
+	u8 fifo;
+	u8 reserved;
+	u32 id[4];
+} __packed;
+
+/* one slot of the periodic transmit table, sent with GS_USB_BREQ_SET_PERIODIC
+ * (wValue = channel). The device queues the frame right away and then every
+ * period_us, until count frames went out (0 = until stopped). period_us 0
+ * stops the slot. Slots are shared by all channels, a channel reset stops
+ * its slots. */
+#define GS_PERIODIC_FLAG_UPDATE_DATA (1<<0) /* only replace the payload of a running slot, keeps its phase and count */
+#define GS_PERIODIC_FLAG_ECHO        (1<<1) /* report the sent frames to the host like received ones */
+#define GS_PERIODIC_MIN_PERIOD_US    100
+
+struct gs_device_periodic {
+	u8 slot;
+	u8 flags;
+	u8 can_dlc;
+	u8 reserved;
+	u32 can_id;
+	u32 period_us;
+	u32 count;
+	u8 data[8];
+} __packed;
+
+/* one slot of the receive decimation table, sent with GS_USB_BREQ_SET_DECIMATE
+ * (wValue = channel). Received frames matching id under mask (can_id layout,
+ * like gs_device_filter) are thinned out before they reach the host; the
+ * first matching slot decides. Setting a slot restarts it.
+ *
+ * Each ID a slot matches is thinned out on its own: a slot over
+ * 0x100-0x10F in INTERVAL mode forwards one frame of each of the sixteen
+ * IDs per interval, and ON_CHANGE compares a frame with the last forwarded
+ * one of the same ID. A slot keeps CAN_DECIMATE_IDS (8) IDs apart; past
+ * that it forgets the one it tracks longest, whose next frame then goes
+ * through as if the slot had just been set. */
+struct gs_device_decimate {
+	u8 slot;
+	u8 mode;                /* enum gs_can_decimate_mode */
+	u8 reserved[2];
+	u32 id;
+	u32 mask;
+	u32 param;
+} __packed;
+
 struct gs_host_frame {
 	u32 echo_id;
 	u32 can_id;
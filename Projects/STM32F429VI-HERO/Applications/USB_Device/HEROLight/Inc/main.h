@@ -52,12 +52,18 @@
 #include "usbd_desc.h"
 #include "usbd_hid.h" 
 #include "stm32f4xx_hero.h"
+#include "can.h"
+#include "usbd_gs_can.h"
 
 /* Exported types ------------------------------------------------------------*/
 /* Exported constants --------------------------------------------------------*/
 /* Exported macro ------------------------------------------------------------*/
 /* Exported functions ------------------------------------------------------- */
 void SystemClock_Config(void);
+void can_rx_irq_handler(can_data_t *hcan, uint8_t fifo);
+void can_tx_irq_handler(can_data_t *hcan);
+void can_tx_drop(can_data_t *hcan, struct gs_host_frame *frame);
+void can_sce_irq_handler(can_data_t *hcan);
 
 #endif /* __MAIN_H */
 
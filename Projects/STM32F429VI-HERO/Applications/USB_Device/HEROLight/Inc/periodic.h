@@ -0,0 +1,45 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "can.h"
+#include "queue.h"
+
+/* echo_id of periodic frames the host did not ask to see. can_tx_irq_handler()
+ * puts them back into the pool instead of echoing them. */
+#define PERIODIC_ECHO_ID 0xFFFFFFFE
+/* echo_id of periodic frames the host asked to see, GS_PERIODIC_FLAG_ECHO.
+ * They reach the host as received frames with echo_id 0xFFFFFFFF, but
+ * stay out of the receive latency histogram. */
+#define PERIODIC_RX_ECHO_ID 0xFFFFFFFD
+
+void periodic_init(queue_t *q_frame_pool);
+bool periodic_set(can_data_t *hcan, const struct gs_device_periodic *periodic);
+void periodic_stop(can_data_t *hcan);
+void periodic_irq_handler(void);
@@ -0,0 +1,69 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include "config.h"
+
+/* Cycle counted code zones, see PROFILE_ENABLE in config.h.
+ * Read with GS_USB_BREQ_GET_PROFILE, one struct gs_device_profile_zone each. */
+typedef enum {
+	PROFILE_LOOP,           /* one main loop iteration, without the sleep */
+	PROFILE_LOOP_BLINK,
+	PROFILE_LOOP_FROM_HOST, /* host frames into the TX queues */
+	PROFILE_LOOP_TO_HOST,   /* send_to_host() */
+	PROFILE_LOOP_CHANNELS,  /* buffer refill and error status polling */
+	PROFILE_LOOP_LED,
+	PROFILE_USB_IRQ,
+	PROFILE_CAN_RX_IRQ,
+	PROFILE_CAN_TX_IRQ,
+	PROFILE_CAN_SCE_IRQ,
+	PROFILE_TIMER_IRQ,
+	PROFILE_ZONE_COUNT
+} profile_zone_t;
+
+#if PROFILE_ENABLE
+
+#include "stm32f4xx.h"
+
+/* BEGIN and END have to be used in the same block */
+#define PROFILE_BEGIN(zone) uint32_t profile_t0_##zone = DWT->CYCCNT
+#define PROFILE_END(zone)   profile_record(zone, DWT->CYCCNT - profile_t0_##zone)
+
+void profile_init(void);
+void profile_record(profile_zone_t zone, uint32_t cycles);
+void profile_get(profile_zone_t zone, uint32_t *hits, uint32_t *min, uint32_t *max, uint32_t *avg);
+void profile_reset(void);
+
+#else
+
+#define PROFILE_BEGIN(zone)
+#define PROFILE_END(zone)
+
+#define profile_init()
+
+#endif
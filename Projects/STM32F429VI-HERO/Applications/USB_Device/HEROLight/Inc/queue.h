@@ -33,10 +33,13 @@ typedef struct {
 	unsigned max_elements;
 	unsigned first;
 	unsigned size;
+	unsigned high_water;
+	unsigned low_water;
 	void **buf;
 } queue_t;
 
 queue_t *queue_create(unsigned max_elements);
+void queue_init(queue_t *q, void **buf, unsigned max_elements);
 void queue_free(queue_t *q);
 
 unsigned queue_size(queue_t *q);
@@ -44,9 +47,38 @@ bool queue_is_empty(queue_t *q);
 bool queue_push_back(queue_t *q, void *el);
 bool queue_push_front(queue_t *q, void *el);
 void *queue_pop_front(queue_t *q);
+unsigned queue_high_water(queue_t *q);
+unsigned queue_low_water(queue_t *q);
 
 unsigned queue_size_i(queue_t *q);
 bool queue_is_empty_i(queue_t *q);
 bool queue_push_back_i(queue_t *q, void *el);
 bool queue_push_front_i(queue_t *q, void *el);
 void *queue_pop_front_i(queue_t *q);
+
+/* Lock-free ring for one producer and one consumer context. The producer
+ * only writes head, the consumer only writes tail, so neither side has to
+ * mask interrupts. Capacity must be a power of two.
+ * A context may be several interrupt handlers as long as none of them can
+ * preempt another, that is they share one NVIC priority. Thread code pushing
+ * to the same side has to mask those interrupts meanwhile, like
+ * enqueue_to_host() does for q_to_host. */
+typedef struct {
+	volatile unsigned head;
+	volatile unsigned tail;
+	unsigned mask;
+	unsigned high_water;
+	void **buf;
+} ring_t;
+
+void ring_init(ring_t *r, void **buf, unsigned max_elements);
+unsigned ring_size(ring_t *r);
+bool ring_is_empty(ring_t *r);
+unsigned ring_high_water(ring_t *r);
+
+/* producer side */
+bool ring_push(ring_t *r, void *el);
+
+/* consumer side */
+void *ring_peek(ring_t *r);
+void *ring_pop(ring_t *r);
@@ -51,6 +51,15 @@ void OTG_FS_IRQHandler(void);
 void OTG_HS_IRQHandler(void);
 void OTG_FS_WKUP_IRQHandler(void);
 void OTG_HS_WKUP_IRQHandler(void);
+void CAN1_TX_IRQHandler(void);
+void CAN1_RX0_IRQHandler(void);
+void CAN1_RX1_IRQHandler(void);
+void CAN2_TX_IRQHandler(void);
+void CAN2_RX0_IRQHandler(void);
+void CAN2_RX1_IRQHandler(void);
+void CAN1_SCE_IRQHandler(void);
+void CAN2_SCE_IRQHandler(void);
+void TIM2_IRQHandler(void);
 void EXTI15_10_IRQHandler(void);
 
 #ifdef __cplusplus
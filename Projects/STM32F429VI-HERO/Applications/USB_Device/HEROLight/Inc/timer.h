@@ -27,6 +27,20 @@ THE SOFTWARE.
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_IRQ_PRIORITY  5 /* same as CAN and USB */
+
+/* TIM2 compare channels, each raises TIM2_IRQHandler at a timer_get() time */
+#define TIMER_CC_PERIODIC   1
+#define TIMER_CC_TX_AT      2
+#define TIMER_CC_IN_WINDOW  3
 
 void timer_init(void);
 uint32_t timer_get(void);
+uint64_t timer_get64(void);
+void timer_irq_handler(void);
+
+void timer_compare_arm(unsigned cc, uint32_t at_us);
+void timer_compare_disarm(unsigned cc);
+bool timer_compare_clear(unsigned cc);
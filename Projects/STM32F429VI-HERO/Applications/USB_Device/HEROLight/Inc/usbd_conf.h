@@ -95,6 +95,8 @@
 #endif
 
 /* Exported functions ------------------------------------------------------- */
+struct _USBD_HandleTypeDef;
+uint32_t USBD_LL_GetFrameNumber(struct _USBD_HandleTypeDef *pdev);
 
 #endif /* __USBD_CONF_H */
 
@@ -38,23 +38,29 @@ THE SOFTWARE.
 
 #define CAN_DATA_MAX_PACKET_SIZE   32  /* Endpoint IN & OUT Packet size */
 #define CAN_CMD_PACKET_SIZE        64  /* Control Endpoint Packet size */
+#define CAN_IN_BATCH_BYTES        512  /* Bulk IN transfer budget: 16 padded frames, 21 with and 25 without timestamps */
+#define CAN_LATENCY_BUCKETS        16  /* log2 buckets of the receive latency histogram */
 #define USB_CAN_CONFIG_DESC_SIZ    50
-#define NUM_CAN_CHANNEL             1
+#define NUM_CAN_CHANNEL             2
 #define USBD_GS_CAN_VENDOR_CODE  0x20
 #define DFU_INTERFACE_NUM           1
 #define DFU_INTERFACE_STR_INDEX  0xE0
 
 extern USBD_ClassTypeDef USBD_GS_CAN;
 
-uint8_t USBD_GS_CAN_Init(USBD_HandleTypeDef *pdev, queue_t *q_frame_pool, queue_t *q_from_host, led_data_t *leds);
+uint8_t USBD_GS_CAN_Init(USBD_HandleTypeDef *pdev, queue_t *q_frame_pool, ring_t *q_from_host, ring_t *q_to_host, led_data_t *leds);
 void USBD_GS_CAN_SetChannel(USBD_HandleTypeDef *pdev, uint8_t channel, can_data_t* handle);
 bool USBD_GS_CAN_TxReady(USBD_HandleTypeDef *pdev);
 uint8_t USBD_GS_CAN_PrepareReceive(USBD_HandleTypeDef *pdev);
+void USBD_GS_CAN_ResumeReceive(USBD_HandleTypeDef *pdev);
 bool USBD_GS_CAN_CustomDeviceRequest(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 bool USBD_GS_CAN_CustomInterfaceRequest(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 
 bool USBD_GS_CAN_DfuDetachRequested(USBD_HandleTypeDef *pdev);
 uint8_t USBD_GS_CAN_SendFrame(USBD_HandleTypeDef *pdev, struct gs_host_frame *frame);
+uint8_t USBD_GS_CAN_SendFrameBatch(USBD_HandleTypeDef *pdev, ring_t *q_to_host);
 uint8_t USBD_GS_CAN_Transmit(USBD_HandleTypeDef *pdev, uint8_t *buf, uint16_t len);
 uint8_t USBD_GS_CAN_GetProtocolVersion(USBD_HandleTypeDef *pdev);
 uint8_t USBD_GS_CAN_GetPadPacketsToMaxPacketSize(USBD_HandleTypeDef *pdev);
+bool USBD_GS_CAN_GetBatchIn(USBD_HandleTypeDef *pdev);
+void USBD_GS_CAN_InWindowIrqHandler(void);
@@ -0,0 +1,109 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "stm32f4xx.h"
+
+/* Host build core: runs the unmodified firmware in one thread. Peripheral
+ * registers live at their real addresses; pages with side effects are
+ * protected, and each access to them traps into the owning model. The
+ * models schedule sim_event_t callbacks on a device clock, interrupts are
+ * dispatched only at sync points: __enable_irq(), HAL_NVIC_SetPendingIRQ()
+ * and __WFI(). */
+
+#define SIM_NEVER UINT64_MAX
+
+typedef enum {
+	SIM_TIME_VIRTUAL, /* device time stands still while firmware code runs */
+	SIM_TIME_SCALED,  /* it advances with the firmware's host CPU time, times a factor */
+	SIM_TIME_REAL     /* it follows the host clock, for talking to the outside */
+} sim_time_mode_t;
+
+typedef struct sim_event sim_event_t;
+struct sim_event {
+	uint64_t at;                  /* device time in ns, SIM_NEVER while idle */
+	void (*run)(sim_event_t *ev); /* runs outside of firmware context */
+	const char *name;
+	void *ctx;
+	sim_event_t *next;
+};
+
+/* one page aligned register block */
+typedef struct sim_region sim_region_t;
+struct sim_region {
+	uintptr_t base;
+	size_t size;
+	int prot;                      /* accesses that do not trap, PROT_* */
+	volatile uint8_t *shadow;      /* the same memory, always writable, for the models */
+	void (*read)(sim_region_t *r, uint32_t offset);                /* before a trapped read */
+	void (*write)(sim_region_t *r, uint32_t offset, uint32_t old); /* after a trapped write */
+	void *ctx;
+};
+
+#define SIM_REG(region, offset) (*(volatile uint32_t *)((region)->shadow + (offset)))
+
+typedef struct {
+	uint64_t traps;
+	uint64_t irqs;
+	uint64_t wfi;
+	uint64_t events;
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+int firmware_main(void);
+
+void sim_init(sim_time_mode_t mode, double cpu_scale);
+void sim_map(sim_region_t *r);
+void sim_protect(sim_region_t *r, int prot);
+
+uint64_t sim_now(void);
+uint64_t sim_cpu_ns(void);
+uint64_t sim_host_ns(void);
+void sim_enter(void);
+void sim_leave(void);
+
+void sim_event_add(sim_event_t *ev, const char *name, void (*run)(sim_event_t *ev), void *ctx);
+void sim_event_at(sim_event_t *ev, uint64_t at);
+
+/* waits for outside input until the given device time, SIM_TIME_REAL only */
+void sim_set_idle(void (*idle)(uint64_t until));
+
+void sim_irq_level(IRQn_Type irq, bool level);
+void sim_irq_pend(IRQn_Type irq);
+void sim_irq_hold(IRQn_Type irq, bool hold);
+
+/* sim_periph.c */
+void sim_periph_init(void);
+void sim_periph_time_mode(sim_time_mode_t mode);
+void sim_periph_time_changed(void);
+uint64_t sim_timer_to_ns(uint32_t timer_us);
+uint32_t sim_timer_now(void);
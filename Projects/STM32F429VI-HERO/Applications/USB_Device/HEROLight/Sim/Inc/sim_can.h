@@ -0,0 +1,91 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sim.h"
+
+/* a frame as it is seen on the wire, can_id in the gs_usb/SocketCAN layout */
+typedef struct {
+	uint32_t can_id;
+	uint8_t dlc;
+	uint8_t data[8];
+} sim_can_msg_t;
+
+typedef enum {
+	SIM_CAN_OK,
+	SIM_CAN_LOST,   /* lost the arbitration, may try again */
+	SIM_CAN_ERROR   /* an error frame or no acknowledge */
+} sim_can_result_t;
+
+typedef struct sim_can_bus sim_can_bus_t;
+typedef struct sim_can_node sim_can_node_t;
+
+struct sim_can_node {
+	const char *name;
+	/* the frame the node wants to send when the bus goes idle, if any */
+	bool (*pending)(sim_can_node_t *n, sim_can_msg_t *msg);
+	/* outcome for every node pending() returned true for */
+	void (*done)(sim_can_node_t *n, sim_can_result_t result);
+	void (*received)(sim_can_node_t *n, const sim_can_msg_t *msg);
+	/* protocol error seen by the node, LEC code */
+	void (*error)(sim_can_node_t *n, bool transmitter, unsigned lec);
+	/* whether the node acknowledges the frame of tx, which may be itself */
+	bool (*acks)(sim_can_node_t *n, sim_can_node_t *tx);
+	void *ctx;
+	sim_can_bus_t *bus;
+	sim_can_node_t *next;
+};
+
+struct sim_can_bus {
+	const char *name;
+	uint64_t bit_ps;
+	uint32_t error_ppm;    /* frames destroyed by an error frame, per million */
+	uint32_t seed;
+	sim_can_node_t *nodes;
+	sim_event_t event;
+	bool busy;
+	sim_can_node_t *tx;
+	sim_can_msg_t msg;
+	sim_can_result_t result;
+	uint64_t frame_start;
+	uint64_t frames;
+	uint64_t errors;
+	uint64_t busy_ns;
+};
+
+void sim_can_bus_init(sim_can_bus_t *bus, const char *name, uint32_t bitrate);
+void sim_can_attach(sim_can_bus_t *bus, sim_can_node_t *node);
+void sim_can_detach(sim_can_node_t *node);
+void sim_can_kick(sim_can_bus_t *bus);
+unsigned sim_can_frame_bits(const sim_can_msg_t *msg);
+uint32_t sim_can_key(uint32_t can_id);
+
+/* maps the bxCAN pair and puts CAN1 and CAN2 on the given buses, which may be the same */
+void sim_can_init(sim_can_bus_t *bus1, sim_can_bus_t *bus2);
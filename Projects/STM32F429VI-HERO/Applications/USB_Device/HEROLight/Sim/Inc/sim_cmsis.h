@@ -0,0 +1,71 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+/* Forced in front of every file of the host build (gcc -include). Stands in
+ * for cmsis_gcc.h, whose inline assembly is ARM only: the core intrinsics
+ * map onto the simulated NVIC in sim.c. */
+
+#pragma once
+
+#define __CMSIS_GCC_H
+
+#include <stdint.h>
+
+int sim_disable_irq(void);
+void sim_enable_irq(void);
+void sim_wfi(void);
+
+/* the Keil intrinsic util.c relies on, returns whether PRIMASK was set */
+static inline int __disable_irq(void) { return sim_disable_irq(); }
+static inline void __enable_irq(void) { sim_enable_irq(); }
+static inline uint32_t __get_PRIMASK(void) { int was = sim_disable_irq(); if (!was) sim_enable_irq(); return was; }
+static inline void __set_PRIMASK(uint32_t mask) { if (mask) sim_disable_irq(); else sim_enable_irq(); }
+
+static inline void __WFI(void) { sim_wfi(); }
+static inline void __WFE(void) { sim_wfi(); }
+static inline void __SEV(void) { }
+static inline void __NOP(void) { }
+static inline void __ISB(void) { __sync_synchronize(); }
+static inline void __DSB(void) { __sync_synchronize(); }
+static inline void __DMB(void) { __sync_synchronize(); }
+
+/* interrupts only run at the sync points of sim.c, never between these two */
+static inline uint32_t __LDREXW(volatile uint32_t *addr) { return *addr; }
+static inline uint32_t __STREXW(uint32_t value, volatile uint32_t *addr) { *addr = value; return 0; }
+static inline void __CLREX(void) { }
+
+static inline uint32_t __CLZ(uint32_t value) { return value ? (uint32_t)__builtin_clz(value) : 32; }
+static inline uint32_t __REV(uint32_t value) { return __builtin_bswap32(value); }
+static inline uint32_t __REV16(uint32_t value) { return ((value & 0xFF00FF00) >> 8) | ((value & 0x00FF00FF) << 8); }
+static inline uint32_t __RBIT(uint32_t value)
+{
+	uint32_t r = 0;
+	for (unsigned i=0; i<32; i++) {
+		r = (r << 1) | ((value >> i) & 1);
+	}
+	return r;
+}
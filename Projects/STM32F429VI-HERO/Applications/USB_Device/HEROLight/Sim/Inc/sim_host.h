@@ -0,0 +1,76 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "gs_usb.h"
+
+/* A gs_usb host driver model on top of sim_usb.c: enumerates the device,
+ * starts the channels and keeps echo slots the way the Linux driver does. */
+
+#define SIM_HOST_CHANNELS   2
+#define SIM_HOST_ECHO_SLOTS 10 /* GS_MAX_TX_URBS of the Linux driver */
+#define SIM_HOST_ECHO_SLOTS_MAX 1024 /* for a host that keeps more frames in flight */
+
+typedef struct {
+	unsigned channels;
+	uint32_t bitrate;
+	uint32_t mode_flags;   /* GS_CAN_MODE_*, the same for all channels */
+	unsigned echo_slots;
+	uint32_t in_window_us; /* GS_USB_BREQ_SET_IN_WINDOW, sent when not 0 */
+} sim_host_config_t;
+
+typedef struct {
+	void (*ready)(void *ctx);                                                  /* all channels started */
+	void (*rx)(void *ctx, const struct gs_host_frame *frame);                 /* received and error frames */
+	void (*echo)(void *ctx, const struct gs_host_frame *frame, void *tx_ctx); /* a sent frame is done */
+	void (*tx_failed)(void *ctx, unsigned channel, void *tx_ctx);             /* that echo had GS_CAN_FLAG_TX_FAILED */
+	void *ctx;
+} sim_host_ops_t;
+
+typedef struct {
+	uint64_t in_transfers;
+	uint64_t in_frames;
+	uint64_t out_frames;
+	uint64_t unknown_echoes;
+} sim_host_stats_t;
+
+extern sim_host_stats_t sim_host_stats;
+
+void sim_host_init(const sim_host_config_t *cfg, const sim_host_ops_t *ops);
+
+/* false while all echo slots of the channel are taken */
+bool sim_host_send(const struct gs_host_frame *frame, unsigned len, void *tx_ctx);
+unsigned sim_host_free_slots(unsigned channel);
+
+/* a vendor request to the gs_usb interface, done gets the bytes transferred
+ * or SIM_USB_STALL and the answer of an IN request */
+typedef void (*sim_host_done_t)(void *ctx, int status, const void *data);
+bool sim_host_request(bool in, uint8_t bRequest, uint16_t wValue, const void *data, uint16_t len,
+                      sim_host_done_t done, void *ctx);
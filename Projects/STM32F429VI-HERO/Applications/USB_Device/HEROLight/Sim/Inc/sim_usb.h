@@ -0,0 +1,69 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sim.h"
+
+/* Full speed USB between the firmware's PCD handle and a host model. The
+ * HAL PCD layer is replaced, usbd_conf.c and the device library above it
+ * run unchanged. One transaction is on the bus at a time, SOFs every 1 ms. */
+
+#define SIM_USB_STALL  (-1)
+
+typedef struct {
+	void (*connect)(void *ctx);                                          /* the device pulled up D+ */
+	void (*in_complete)(void *ctx, const uint8_t *data, unsigned len);  /* a bulk IN transfer ended */
+	void (*out_complete)(void *ctx, void *urb);                          /* a bulk OUT transfer was taken */
+	void *ctx;
+} sim_usb_host_t;
+
+typedef struct {
+	uint64_t transactions;
+	uint64_t naks;
+	uint64_t sofs;
+	uint64_t busy_ns;
+	uint64_t in_bytes;
+	uint64_t out_bytes;
+} sim_usb_stats_t;
+
+extern sim_usb_stats_t sim_usb_stats;
+
+void sim_usb_init(const sim_usb_host_t *host);
+void sim_usb_reset(void);
+
+/* status is the number of bytes transferred, or SIM_USB_STALL */
+typedef void (*sim_usb_control_done_t)(void *ctx, int status);
+bool sim_usb_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                     void *data, uint16_t wLength, sim_usb_control_done_t done, void *ctx);
+
+/* bulk endpoints the host polls once configured */
+void sim_usb_bulk(uint8_t in_ep, uint8_t out_ep, uint16_t mps);
+bool sim_usb_out_submit(const void *data, unsigned len, void *urb);
+unsigned sim_usb_out_queued(void);
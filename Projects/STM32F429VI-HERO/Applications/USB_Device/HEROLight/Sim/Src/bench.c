@@ -0,0 +1,647 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+/* Throughput and latency benchmark of the firmware data path: a peer node on
+ * each simulated CAN bus sends numbered frames towards the host, the host
+ * model sends numbered frames towards the bus, everything is timed in device
+ * time and checked for order and loss at the end of the run. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "sim.h"
+#include "sim_can.h"
+#include "sim_usb.h"
+#include "sim_host.h"
+#include "profile.h"
+
+#define CHANNELS     2
+#define DEVICE_ID    0x100 /* + channel, wins against the peer, the host is held back by its echo slots anyway */
+#define PEER_ID      0x200 /* + bus */
+#define SEQ_RING     4096
+#define DRAIN_NS     20000000ULL
+
+typedef struct {
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t min;
+} latency_t;
+
+typedef struct {
+	sim_can_node_t node;
+	sim_can_bus_t *bus;
+	unsigned index;
+	sim_event_t event;
+	uint64_t period_ns;   /* 0: as fast as the bus allows */
+	uint64_t next_at;
+	bool running;
+	bool offered;
+	uint32_t seq;         /* next frame to send */
+	uint64_t eof_ns[SEQ_RING];
+	uint64_t sent;
+	uint64_t lost_arbitration;
+	uint64_t bus_errors;
+	uint64_t device_frames; /* frames of the device seen on this bus */
+} peer_t;
+
+typedef struct {
+	/* bus -> host */
+	uint32_t rx_next[CHANNELS];   /* next sequence number expected from the peer */
+	uint64_t rx_frames[CHANNELS];
+	uint64_t rx_missing[CHANNELS];
+	uint64_t rx_reordered[CHANNELS];
+	uint64_t rx_overflow_flags;
+	uint64_t error_frames;
+	/* host -> bus */
+	sim_event_t tx_event[CHANNELS];
+	uint32_t tx_seq[CHANNELS];
+	uint32_t echo_next[CHANNELS];
+	uint64_t tx_queued_ns[CHANNELS][SEQ_RING];
+	uint64_t tx_eof_ns[CHANNELS][SEQ_RING];
+	uint64_t tx_blocked[CHANNELS];
+	uint64_t tx_failed[CHANNELS];
+	uint64_t echoes[CHANNELS];
+	uint64_t echo_reordered[CHANNELS];
+	uint64_t start_ns;
+	uint64_t stop_ns;
+	uint64_t start_cpu_ns;
+	uint64_t stop_cpu_ns;
+	uint64_t start_host_ns;
+	uint64_t stop_host_ns;
+	uint64_t busy_ns[CHANNELS];
+	bool running;
+} bench_t;
+
+static struct {
+	double duration_s;
+	uint32_t bitrate;
+	double rx_rate;       /* frames/s per bus, 0 for a fully loaded bus */
+	double tx_rate;       /* frames/s per channel from the host, 0 for none */
+	unsigned channels;
+	bool batch;
+	bool timestamps;
+	bool pad;
+	bool split;
+	bool one_shot;
+	unsigned echo_slots;
+	uint32_t error_ppm;
+	bool one_bus;
+	double scale;         /* SIM_TIME_SCALED factor, 0 for SIM_TIME_VIRTUAL */
+	uint32_t seed;
+	unsigned dlc;
+	bool extended;
+	uint32_t in_window_us;
+} opt = {
+	.duration_s = 1.0,
+	.bitrate = 1000000,
+	.rx_rate = 0,
+	.tx_rate = 0,
+	.channels = 2,
+	.batch = true,
+	.timestamps = true,
+	.seed = 1,
+	.dlc = 8,
+	.echo_slots = SIM_HOST_ECHO_SLOTS,
+};
+
+static sim_can_bus_t buses[CHANNELS];
+static peer_t peers[CHANNELS];
+static bench_t bench;
+static sim_event_t stop_event;
+
+/* latency stages */
+static latency_t lat_bus_to_isr;   /* end of frame on the bus -> receive timestamp */
+static latency_t lat_isr_to_host;  /* receive timestamp -> end of the IN transfer */
+static latency_t lat_rx_total;     /* end of frame on the bus -> host */
+static latency_t lat_host_to_bus;  /* OUT transfer queued -> end of frame on the bus */
+static latency_t lat_bus_to_echo;  /* end of frame on the bus -> echo at the host */
+
+static void latency_add(latency_t *l, uint64_t ns)
+{
+	if ((l->n == 0) || (ns < l->min)) {
+		l->min = ns;
+	}
+	if (ns > l->max) {
+		l->max = ns;
+	}
+	l->sum += ns;
+	l->n++;
+}
+
+static void latency_print(const char *name, const latency_t *l)
+{
+	if (l->n == 0) {
+		printf("  %-22s -\n", name);
+		return;
+	}
+	printf("  %-22s min %8.1f  avg %8.1f  max %8.1f us  (%llu)\n", name,
+	       l->min / 1000.0, (double)l->sum / l->n / 1000.0, l->max / 1000.0, (unsigned long long)l->n);
+}
+
+static uint32_t seq_get(const uint8_t *data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void seq_put(uint8_t *data, uint32_t seq)
+{
+	data[0] = seq;
+	data[1] = seq >> 8;
+	data[2] = seq >> 16;
+	data[3] = seq >> 24;
+}
+
+static uint32_t frame_id(uint32_t base)
+{
+	return opt.extended ? ((base << 18) | CAN_EFF_FLAG) : base;
+}
+
+static unsigned frame_source(uint32_t can_id)
+{
+	return (can_id & CAN_EFF_FLAG) ? ((can_id & 0x1FFFFFFF) >> 18) : (can_id & 0x7FF);
+}
+
+/* ---- the peer node, one per bus ---- */
+
+static bool peer_pending(sim_can_node_t *n, sim_can_msg_t *msg)
+{
+	peer_t *p = n->ctx;
+
+	if (!p->running || (sim_now() < p->next_at)) {
+		return false;
+	}
+	msg->can_id = frame_id(PEER_ID + p->index);
+	msg->dlc = opt.dlc;
+	memset(msg->data, 0xA5, sizeof(msg->data));
+	seq_put(msg->data, p->seq);
+	p->offered = true;
+	return true;
+}
+
+static void peer_done(sim_can_node_t *n, sim_can_result_t result)
+{
+	peer_t *p = n->ctx;
+
+	p->offered = false;
+	switch (result) {
+		case SIM_CAN_OK:
+			p->eof_ns[p->seq % SEQ_RING] = sim_now();
+			p->seq++;
+			p->sent++;
+			if (p->period_ns > 0) {
+				p->next_at += p->period_ns;
+				if (p->next_at > sim_now()) {
+					sim_event_at(&p->event, p->next_at);
+				}
+			}
+			break;
+		case SIM_CAN_LOST:
+			p->lost_arbitration++;
+			break;
+		case SIM_CAN_ERROR:
+			p->bus_errors++;
+			break;
+	}
+}
+
+static void peer_received(sim_can_node_t *n, const sim_can_msg_t *msg)
+{
+	peer_t *p = n->ctx;
+	unsigned source = frame_source(msg->can_id);
+
+	if ((source < DEVICE_ID) || (source >= DEVICE_ID + CHANNELS) || (msg->dlc < 4)) {
+		return;
+	}
+	unsigned ch = source - DEVICE_ID;
+	uint32_t seq = seq_get(msg->data);
+	bench.tx_eof_ns[ch][seq % SEQ_RING] = sim_now();
+	latency_add(&lat_host_to_bus, sim_now() - bench.tx_queued_ns[ch][seq % SEQ_RING]);
+	p->device_frames++;
+}
+
+static void peer_error(sim_can_node_t *n, bool transmitter, unsigned lec)
+{
+	(void)n;
+	(void)transmitter;
+	(void)lec;
+}
+
+static bool peer_acks(sim_can_node_t *n, sim_can_node_t *tx)
+{
+	return n != tx;
+}
+
+static void peer_on_event(sim_event_t *ev)
+{
+	peer_t *p = ev->ctx;
+	sim_can_kick(p->bus);
+}
+
+static void peer_init(peer_t *p, unsigned index, sim_can_bus_t *bus)
+{
+	static const char *names[CHANNELS] = { "peer0", "peer1" };
+
+	p->index = index;
+	p->bus = bus;
+	p->node.name = names[index];
+	p->node.pending = peer_pending;
+	p->node.done = peer_done;
+	p->node.received = peer_received;
+	p->node.error = peer_error;
+	p->node.acks = peer_acks;
+	p->node.ctx = p;
+	p->period_ns = (opt.rx_rate > 0) ? (uint64_t)(1e9 / opt.rx_rate) : 0;
+	sim_event_add(&p->event, names[index], peer_on_event, p);
+	sim_can_attach(bus, &p->node);
+}
+
+static void peer_start(peer_t *p)
+{
+	p->running = true;
+	p->next_at = sim_now();
+	sim_can_kick(p->bus);
+}
+
+/* ---- the host side ---- */
+
+static void host_tx_next(unsigned ch)
+{
+	struct gs_host_frame frame;
+	uint32_t seq = bench.tx_seq[ch];
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = frame_id(DEVICE_ID + ch);
+	frame.can_dlc = opt.dlc;
+	frame.channel = ch;
+	memset(frame.data, 0x5A, sizeof(frame.data));
+	seq_put(frame.data, seq);
+
+	if (!sim_host_send(&frame, sizeof(frame) - 4, (void *)(uintptr_t)seq)) {
+		bench.tx_blocked[ch]++;
+		return;
+	}
+	bench.tx_queued_ns[ch][seq % SEQ_RING] = sim_now();
+	bench.tx_seq[ch]++;
+}
+
+static void host_on_tx_event(sim_event_t *ev)
+{
+	unsigned ch = (uintptr_t)ev->ctx;
+
+	if (!bench.running) {
+		return;
+	}
+	host_tx_next(ch);
+	sim_event_at(ev, sim_now() + (uint64_t)(1e9 / opt.tx_rate));
+}
+
+static void host_on_ready(void *ctx)
+{
+	(void)ctx;
+
+	bench.running = true;
+	bench.start_ns = sim_now();
+	bench.start_cpu_ns = sim_cpu_ns();
+	bench.start_host_ns = sim_host_ns();
+	for (unsigned i=0; i<CHANNELS; i++) {
+		bench.busy_ns[i] = buses[i].busy_ns;
+	}
+	for (unsigned i=0; i<(opt.one_bus ? 1 : opt.channels); i++) {
+		peer_start(&peers[i]);
+	}
+	for (unsigned ch=0; ch<opt.channels; ch++) {
+		if (opt.tx_rate > 0) {
+			sim_event_at(&bench.tx_event[ch], sim_now());
+		}
+	}
+	sim_event_at(&stop_event, sim_now() + (uint64_t)(opt.duration_s * 1e9));
+}
+
+static void host_on_rx(void *ctx, const struct gs_host_frame *frame)
+{
+	uint64_t now = sim_now();
+	(void)ctx;
+
+	if (frame->flags & GS_CAN_FLAG_OVERFLOW) {
+		bench.rx_overflow_flags++;
+	}
+	if (frame->can_id & CAN_ERR_FLAG) {
+		bench.error_frames++;
+		return;
+	}
+
+	unsigned source = frame_source(frame->can_id);
+	unsigned ch = frame->channel;
+	if ((source < PEER_ID) || (source >= PEER_ID + CHANNELS) || (ch >= CHANNELS)) {
+		return; // the other channel's frames on a shared bus
+	}
+
+	peer_t *p = &peers[source - PEER_ID];
+	uint32_t seq = seq_get(frame->data);
+	uint64_t eof = p->eof_ns[seq % SEQ_RING];
+
+	bench.rx_frames[ch]++;
+	if (seq == bench.rx_next[ch]) {
+		bench.rx_next[ch]++;
+	} else if ((int32_t)(seq - bench.rx_next[ch]) > 0) {
+		bench.rx_missing[ch] += seq - bench.rx_next[ch];
+		bench.rx_next[ch] = seq + 1;
+	} else {
+		bench.rx_reordered[ch]++;
+	}
+
+	latency_add(&lat_rx_total, now - eof);
+	if (opt.timestamps) {
+		uint64_t isr = sim_timer_to_ns(frame->timestamp_us);
+		latency_add(&lat_bus_to_isr, (isr > eof) ? isr - eof : 0);
+		latency_add(&lat_isr_to_host, (now > isr) ? now - isr : 0);
+	}
+}
+
+static void host_on_echo(void *ctx, const struct gs_host_frame *frame, void *tx_ctx)
+{
+	unsigned ch = frame->channel;
+	uint32_t seq = (uintptr_t)tx_ctx;
+	(void)ctx;
+
+	bench.echoes[ch]++;
+	if (seq != bench.echo_next[ch]) {
+		bench.echo_reordered[ch]++;
+	}
+	bench.echo_next[ch] = seq + 1;
+	if (bench.tx_eof_ns[ch][seq % SEQ_RING] != 0) {
+		latency_add(&lat_bus_to_echo, sim_now() - bench.tx_eof_ns[ch][seq % SEQ_RING]);
+	}
+}
+
+static void host_on_tx_failed(void *ctx, unsigned channel, void *tx_ctx)
+{
+	(void)ctx;
+	(void)tx_ctx;
+	bench.tx_failed[channel]++;
+}
+
+/* ---- the end of the run ---- */
+
+static struct gs_device_stats device_stats[CHANNELS];
+static struct gs_device_profile_zone device_profile[PROFILE_ZONE_COUNT];
+
+static const char *zone_names[PROFILE_ZONE_COUNT] = {
+	"loop", "loop blink", "loop from host", "loop to host", "loop channels", "loop led",
+	"usb irq", "can rx irq", "can tx irq", "can sce irq", "timer irq",
+};
+
+static void report(void)
+{
+	double seconds = (bench.stop_ns - bench.start_ns) / 1e9;
+	uint64_t rx = 0, tx = 0, missing = 0, reordered = 0, sent = 0;
+
+	for (unsigned ch=0; ch<opt.channels; ch++) {
+		rx += bench.rx_frames[ch];
+		missing += bench.rx_missing[ch];
+		reordered += bench.rx_reordered[ch] + bench.echo_reordered[ch];
+		tx += bench.echoes[ch];
+	}
+	for (unsigned i=0; i<CHANNELS; i++) {
+		sent += peers[i].sent;
+	}
+	uint64_t cpu_ns = bench.stop_cpu_ns - bench.start_cpu_ns;
+
+	printf("%.3f s device time, %.3f s host time, %u bit/s, %u channel(s)%s\n",
+	       seconds, (bench.stop_host_ns - bench.start_host_ns) / 1e9, opt.bitrate, opt.channels, opt.one_bus ? " on one bus" : "");
+	printf("bus -> host   %llu of %llu frames, %.0f frames/s, %llu missing, %llu overflow flags, %llu error frames\n",
+	       (unsigned long long)rx, (unsigned long long)(opt.one_bus ? sent * opt.channels : sent), rx / seconds,
+	       (unsigned long long)missing, (unsigned long long)bench.rx_overflow_flags, (unsigned long long)bench.error_frames);
+	if (opt.tx_rate > 0) {
+		uint64_t queued = 0, blocked = 0, failed = 0;
+		for (unsigned ch=0; ch<opt.channels; ch++) {
+			queued += bench.tx_seq[ch];
+			blocked += bench.tx_blocked[ch];
+			failed += bench.tx_failed[ch];
+		}
+		printf("host -> bus   %llu of %llu frames echoed, %.0f frames/s, %llu of them failed, %llu held back for echo slots\n",
+		       (unsigned long long)tx, (unsigned long long)queued, (tx - failed) / seconds,
+		       (unsigned long long)failed, (unsigned long long)blocked);
+	}
+	printf("order         %llu frames out of order\n", (unsigned long long)reordered);
+	for (unsigned i=0; i<(opt.one_bus ? 1 : opt.channels); i++) {
+		printf("%s          %.1f %% load, %llu errors, %llu lost arbitration\n", buses[i].name,
+		       100.0 * bench.busy_ns[i] / (bench.stop_ns - bench.start_ns), (unsigned long long)buses[i].errors,
+		       (unsigned long long)peers[i].lost_arbitration);
+	}
+	printf("usb           %llu transactions, %llu NAKs, %.1f %% busy, %llu bytes in, %llu bytes out, %llu IN transfers\n",
+	       (unsigned long long)sim_usb_stats.transactions, (unsigned long long)sim_usb_stats.naks,
+	       100.0 * sim_usb_stats.busy_ns / sim_now(), (unsigned long long)sim_usb_stats.in_bytes,
+	       (unsigned long long)sim_usb_stats.out_bytes, (unsigned long long)sim_host_stats.in_transfers);
+	printf("firmware      %.0f ns host CPU per frame, %llu traps, %llu interrupts, %llu WFI\n",
+	       (rx + tx) ? (double)cpu_ns / (rx + tx) : 0.0, (unsigned long long)sim_stats.traps,
+	       (unsigned long long)sim_stats.irqs, (unsigned long long)sim_stats.wfi);
+
+	printf("latency\n");
+	latency_print("bus -> rx timestamp", &lat_bus_to_isr);
+	latency_print("rx timestamp -> host", &lat_isr_to_host);
+	latency_print("bus -> host", &lat_rx_total);
+	latency_print("host -> bus", &lat_host_to_bus);
+	latency_print("bus -> echo", &lat_bus_to_echo);
+
+	printf("device\n");
+	for (unsigned ch=0; ch<opt.channels; ch++) {
+		struct gs_device_stats *st = &device_stats[ch];
+		printf("  ch%u  rx %u, tx queued %u, echoed %u, failed %u, fifo overruns %u/%u, bus errors %u\n", ch,
+		       st->rx_frames, st->tx_queued, st->tx_echoed, st->tx_failed,
+		       st->rx_fifo_overruns[0], st->rx_fifo_overruns[1], st->bus_errors);
+	}
+	printf("  pool %u, used max %u, rx pool empty %u, to host max %u, to host dropped %u\n",
+	       device_stats[0].pool_size, device_stats[0].pool_used_max, device_stats[0].rx_pool_empty,
+	       device_stats[0].to_host_max, device_stats[0].to_host_dropped);
+	printf("  from host max %u, out dropped %u, out throttled %u (%u us)\n",
+	       device_stats[0].from_host_max, device_stats[0].out_dropped,
+	       device_stats[0].out_throttle_count, device_stats[0].out_throttle_us);
+	printf("  IN transfers %u, %.2f frames each, %u sent when the IN window ran out\n",
+	       device_stats[0].in_transfers,
+	       device_stats[0].in_transfers ? (double)device_stats[0].in_frames / device_stats[0].in_transfers : 0.0,
+	       device_stats[0].in_window_expired);
+	printf("profile (cycles at 168 MHz, scaled from host CPU time)\n");
+	for (unsigned i=0; i<PROFILE_ZONE_COUNT; i++) {
+		if (device_profile[i].hits > 0) {
+			printf("  %-16s %10u hits  min %8u  avg %8u  max %8u\n", zone_names[i], device_profile[i].hits,
+			       device_profile[i].cycles_min, device_profile[i].cycles_avg, device_profile[i].cycles_max);
+		}
+	}
+	fflush(stdout);
+}
+
+static void on_profile(void *ctx, int status, const void *data)
+{
+	(void)ctx;
+	if (status > 0) {
+		memcpy(device_profile, data, sizeof(device_profile));
+	}
+	report();
+	exit(((bench.rx_reordered[0] + bench.rx_reordered[1] + bench.echo_reordered[0] + bench.echo_reordered[1]) > 0) ? 1 : 0);
+}
+
+static void on_stats(void *ctx, int status, const void *data)
+{
+	unsigned ch = (uintptr_t)ctx;
+
+	if (status > 0) {
+		memcpy(&device_stats[ch], data, sizeof(device_stats[ch]));
+	}
+	if (++ch < opt.channels) {
+		if (sim_host_request(true, GS_USB_BREQ_GET_STATS, ch, NULL, sizeof(device_stats[ch]), on_stats, (void *)(uintptr_t)ch)) {
+			return;
+		}
+	}
+	if (!sim_host_request(true, GS_USB_BREQ_GET_PROFILE, 0, NULL, sizeof(device_profile), on_profile, NULL)) {
+		on_profile(NULL, SIM_USB_STALL, NULL);
+	}
+}
+
+static void on_stop(sim_event_t *ev)
+{
+	if (bench.running) {
+		// stop the sources, give the data path time to drain
+		bench.running = false;
+		bench.stop_ns = sim_now();
+		bench.stop_cpu_ns = sim_cpu_ns();
+		bench.stop_host_ns = sim_host_ns();
+		for (unsigned i=0; i<CHANNELS; i++) {
+			bench.busy_ns[i] = buses[i].busy_ns - bench.busy_ns[i];
+		}
+		for (unsigned i=0; i<CHANNELS; i++) {
+			peers[i].running = false;
+		}
+		sim_event_at(ev, sim_now() + DRAIN_NS);
+		return;
+	}
+	if (!sim_host_request(true, GS_USB_BREQ_GET_STATS, 0, NULL, sizeof(device_stats[0]), on_stats, (void *)0)) {
+		on_stats((void *)0, SIM_USB_STALL, NULL);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -t seconds   device time to run (1)\n"
+		"  -b bitrate   CAN bitrate (1000000)\n"
+		"  -r rate      frames/s sent by the peer on each bus, 0 loads the bus fully (0)\n"
+		"  -x rate      frames/s sent by the host on each channel (0)\n"
+		"  -q slots     echo slots of the host per channel, more than the pool fills it (10)\n"
+		"  -c channels  1 or 2 (2)\n"
+		"  -l           both channels on one bus\n"
+		"  -d dlc       data length, 4 to 8 (8)\n"
+		"  -E           extended identifiers\n"
+		"  -B           no GS_CAN_MODE_BATCH_IN\n"
+		"  -T           no GS_CAN_MODE_HW_TIMESTAMP\n"
+		"  -P           GS_CAN_MODE_PAD_PKTS_TO_MAX_PKT_SIZE\n"
+		"  -s           GS_CAN_MODE_FIFO_SPLIT\n"
+		"  -o           GS_CAN_MODE_ONE_SHOT, frames that fail are not retried\n"
+		"  -w us        GS_USB_BREQ_SET_IN_WINDOW, batched IN transfers wait this long to fill up\n"
+		"  -e ppm       frames destroyed by bus errors, per million\n"
+		"  -k factor    device time is firmware CPU time times factor, instead of free\n"
+		"  -S seed      seed of the error injection (1)\n",
+		name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "t:b:r:x:q:c:ld:EBTPsow:e:k:S:h")) != -1) {
+		switch (c) {
+			case 't': opt.duration_s = atof(optarg); break;
+			case 'b': opt.bitrate = strtoul(optarg, NULL, 0); break;
+			case 'r': opt.rx_rate = atof(optarg); break;
+			case 'x': opt.tx_rate = atof(optarg); break;
+			case 'q': opt.echo_slots = strtoul(optarg, NULL, 0); break;
+			case 'c': opt.channels = strtoul(optarg, NULL, 0); break;
+			case 'l': opt.one_bus = true; break;
+			case 'd': opt.dlc = strtoul(optarg, NULL, 0); break;
+			case 'E': opt.extended = true; break;
+			case 'B': opt.batch = false; break;
+			case 'T': opt.timestamps = false; break;
+			case 'P': opt.pad = true; break;
+			case 's': opt.split = true; break;
+			case 'o': opt.one_shot = true; break;
+			case 'w': opt.in_window_us = strtoul(optarg, NULL, 0); break;
+			case 'e': opt.error_ppm = strtoul(optarg, NULL, 0); break;
+			case 'k': opt.scale = atof(optarg); break;
+			case 'S': opt.seed = strtoul(optarg, NULL, 0); break;
+			default: usage(argv[0]);
+		}
+	}
+	if ((opt.channels < 1) || (opt.channels > CHANNELS) || (opt.dlc < 4) || (opt.dlc > 8) || (opt.duration_s <= 0)
+	 || (opt.echo_slots < 1) || (opt.echo_slots > SIM_HOST_ECHO_SLOTS_MAX)) {
+		usage(argv[0]);
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	sim_init((opt.scale > 0) ? SIM_TIME_SCALED : SIM_TIME_VIRTUAL, opt.scale);
+
+	sim_can_bus_init(&buses[0], "can0", opt.bitrate);
+	sim_can_bus_init(&buses[1], "can1", opt.bitrate);
+	for (unsigned i=0; i<CHANNELS; i++) {
+		buses[i].error_ppm = opt.error_ppm;
+		buses[i].seed = opt.seed + i;
+	}
+	sim_can_init(&buses[0], opt.one_bus ? &buses[0] : &buses[1]);
+	for (unsigned i=0; i<(opt.one_bus ? 1 : CHANNELS); i++) {
+		peer_init(&peers[i], i, &buses[i]);
+	}
+	for (unsigned ch=0; ch<CHANNELS; ch++) {
+		sim_event_add(&bench.tx_event[ch], "host tx", host_on_tx_event, (void *)(uintptr_t)ch);
+	}
+	sim_event_add(&stop_event, "stop", on_stop, NULL);
+
+	sim_host_config_t cfg = {
+		.channels = opt.channels,
+		.bitrate = opt.bitrate,
+		.mode_flags = (opt.batch ? GS_CAN_MODE_BATCH_IN : 0)
+		            | (opt.timestamps ? GS_CAN_MODE_HW_TIMESTAMP : 0)
+		            | (opt.pad ? GS_CAN_MODE_PAD_PKTS_TO_MAX_PKT_SIZE : 0)
+		            | (opt.split ? GS_CAN_MODE_FIFO_SPLIT : 0)
+		            | (opt.one_shot ? GS_CAN_MODE_ONE_SHOT : 0),
+		.echo_slots = opt.echo_slots,
+		.in_window_us = opt.in_window_us,
+	};
+	sim_host_ops_t ops = {
+		.ready = host_on_ready,
+		.rx = host_on_rx,
+		.echo = host_on_echo,
+		.tx_failed = host_on_tx_failed,
+	};
+	sim_host_init(&cfg, &ops);
+
+	return firmware_main();
+}
@@ -0,0 +1,558 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+/* Runs the firmware against SocketCAN: every simulated CAN bus has a node that
+ * stands for a Linux CAN interface, usually vcan. Frames read from the
+ * interface go onto the bus, through the device to the host model, which sends
+ * them straight back out to the device; what the device transmits is written
+ * to the interface again. With one interface the frames return to it, with two
+ * they cross over:
+ *
+ *   cangen vcan0 -g 1 -I i     # or anything else
+ *   candump vcan1
+ *   ./build/vcan_bridge vcan0 vcan1
+ *
+ * Device time is host time here, the USB and CAN buses run at their modelled
+ * speed. The bridge reports loss, ordering and the latency from reading a
+ * frame to writing it back once a second and on exit. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "sim.h"
+#include "sim_can.h"
+#include "sim_usb.h"
+#include "sim_host.h"
+
+#define PORTS         2
+#define PORT_QUEUE    1024 /* frames read from the interface, waiting for the bus */
+#define PORT_TRACK    8192 /* frames on their way through the device */
+#define TRACK_SEARCH  64   /* how far ahead a returning frame is looked for */
+#define HOST_BACKLOG  1024 /* frames the host model waits to send for lack of echo slots */
+
+typedef struct {
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+} latency_t;
+
+typedef struct {
+	sim_can_msg_t msg;
+	uint64_t read_ns;
+} track_t;
+
+typedef struct {
+	const char *ifname;
+	int fd;
+	sim_can_bus_t bus;
+	sim_can_node_t node;
+	unsigned out;                /* the port frames read here are written to */
+
+	sim_can_msg_t queue[PORT_QUEUE];
+	unsigned queue_head, queue_count;
+
+	track_t track[PORT_TRACK];   /* frames read here, in order */
+	unsigned track_head, track_count;
+
+	uint64_t read;
+	uint64_t read_dropped;       /* the bus did not keep up */
+	uint64_t written;
+	uint64_t write_failed;
+	uint64_t lost;               /* skipped over by a later frame */
+	uint64_t unexpected;         /* written, but not in flight: reordered or duplicated */
+	latency_t latency;           /* read from the interface -> written back */
+	latency_t interval;
+} port_t;
+
+static struct {
+	unsigned ports;
+	uint32_t bitrate;
+	uint32_t mode_flags;
+	double duration_s;
+	bool quiet;
+	uint32_t in_window_us;
+} opt = {
+	.bitrate = 1000000,
+	.mode_flags = GS_CAN_MODE_BATCH_IN | GS_CAN_MODE_HW_TIMESTAMP,
+};
+
+static port_t ports[PORTS];
+static struct gs_host_frame backlog[PORTS][HOST_BACKLOG];
+static unsigned backlog_head[PORTS], backlog_count[PORTS];
+static uint64_t backlog_dropped[PORTS];
+static uint64_t host_overflow_flags, host_error_frames, host_tx_failed;
+static latency_t echo_latency; /* host model sends -> echo */
+static sim_event_t report_event, stop_event;
+static volatile sig_atomic_t stop_requested;
+static bool stopping;
+static struct gs_device_stats device_stats[PORTS];
+
+static void latency_add(latency_t *l, uint64_t ns)
+{
+	l->n++;
+	l->sum += ns;
+	if (ns > l->max) {
+		l->max = ns;
+	}
+}
+
+/* ---- SocketCAN ---- */
+
+static int socketcan_open(const char *ifname)
+{
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+
+	if (fd < 0) {
+		perror("socket(PF_CAN)");
+		exit(1);
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+		fprintf(stderr, "%s: %s\n", ifname, strerror(errno));
+		exit(1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "bind %s: %s\n", ifname, strerror(errno));
+		exit(1);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static void port_read(port_t *p)
+{
+	struct can_frame frame;
+
+	while (read(p->fd, &frame, sizeof(frame)) == sizeof(frame)) {
+		if (frame.can_id & CAN_ERR_FLAG) {
+			continue;
+		}
+		p->read++;
+		if (p->queue_count == PORT_QUEUE) {
+			p->read_dropped++;
+			continue;
+		}
+		sim_can_msg_t *msg = &p->queue[(p->queue_head + p->queue_count++) % PORT_QUEUE];
+		memset(msg, 0, sizeof(*msg));
+		msg->can_id = frame.can_id;
+		msg->dlc = (frame.can_dlc > 8) ? 8 : frame.can_dlc;
+		memcpy(msg->data, frame.data, msg->dlc);
+
+		if (p->track_count == PORT_TRACK) {
+			p->track_head = (p->track_head + 1) % PORT_TRACK;
+			p->track_count--;
+			p->lost++; // never came back
+		}
+		track_t *t = &p->track[(p->track_head + p->track_count++) % PORT_TRACK];
+		t->msg = *msg;
+		t->read_ns = sim_now();
+	}
+	if (p->queue_count > 0) {
+		sim_can_kick(&p->bus);
+	}
+}
+
+static bool msg_equal(const sim_can_msg_t *a, const sim_can_msg_t *b)
+{
+	return (a->can_id == b->can_id) && (a->dlc == b->dlc)
+	    && ((a->can_id & CAN_RTR_FLAG) || !memcmp(a->data, b->data, a->dlc));
+}
+
+/* a frame went out on port p, find it among those read on the port it came from */
+static void port_track(port_t *p, const sim_can_msg_t *msg)
+{
+	for (unsigned src=0; src<opt.ports; src++) {
+		port_t *s = &ports[src];
+		if (s->out != (unsigned)(p - ports)) {
+			continue;
+		}
+		for (unsigned i=0; (i < s->track_count) && (i < TRACK_SEARCH); i++) {
+			track_t *t = &s->track[(s->track_head + i) % PORT_TRACK];
+			if (msg_equal(&t->msg, msg)) {
+				uint64_t ns = sim_now() - t->read_ns;
+				latency_add(&s->latency, ns);
+				latency_add(&s->interval, ns);
+				s->lost += i;
+				s->track_head = (s->track_head + i + 1) % PORT_TRACK;
+				s->track_count -= i + 1;
+				return;
+			}
+		}
+		s->unexpected++;
+	}
+}
+
+/* ---- the bus node standing for the interface ---- */
+
+static bool port_pending(sim_can_node_t *n, sim_can_msg_t *msg)
+{
+	port_t *p = n->ctx;
+	if (p->queue_count == 0) {
+		return false;
+	}
+	*msg = p->queue[p->queue_head];
+	return true;
+}
+
+static void port_done(sim_can_node_t *n, sim_can_result_t result)
+{
+	port_t *p = n->ctx;
+	if (result == SIM_CAN_OK) {
+		p->queue_head = (p->queue_head + 1) % PORT_QUEUE;
+		p->queue_count--;
+	}
+}
+
+static void port_received(sim_can_node_t *n, const sim_can_msg_t *msg)
+{
+	port_t *p = n->ctx;
+	struct can_frame frame;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.can_id = msg->can_id;
+	frame.can_dlc = msg->dlc;
+	memcpy(frame.data, msg->data, msg->dlc);
+	if (write(p->fd, &frame, sizeof(frame)) != sizeof(frame)) {
+		p->write_failed++; // the interface's queue is full, as with a real adapter
+	} else {
+		p->written++;
+	}
+	port_track(p, msg);
+}
+
+static void port_error(sim_can_node_t *n, bool transmitter, unsigned lec)
+{
+	(void)n;
+	(void)transmitter;
+	(void)lec;
+}
+
+static bool port_acks(sim_can_node_t *n, sim_can_node_t *tx)
+{
+	return n != tx;
+}
+
+static void port_init(port_t *p, unsigned index, const char *ifname)
+{
+	static const char *names[PORTS] = { "can0", "can1" };
+
+	p->ifname = ifname;
+	p->fd = (ifname != NULL) ? socketcan_open(ifname) : -1;
+	p->out = index;
+	sim_can_bus_init(&p->bus, names[index], opt.bitrate);
+	p->node.name = ifname;
+	p->node.pending = port_pending;
+	p->node.done = port_done;
+	p->node.received = port_received;
+	p->node.error = port_error;
+	p->node.acks = port_acks;
+	p->node.ctx = p;
+	if (ifname != NULL) {
+		sim_can_attach(&p->bus, &p->node);
+	}
+}
+
+/* ---- the host model sends everything it receives back out ---- */
+
+static void host_pump(unsigned ch)
+{
+	while (backlog_count[ch] > 0) {
+		struct gs_host_frame *frame = &backlog[ch][backlog_head[ch]];
+		// the send time rides along as the frame's context, 64 bit hosts only
+		if (!sim_host_send(frame, sizeof(*frame) - 4, (void *)(uintptr_t)sim_now())) {
+			return;
+		}
+		backlog_head[ch] = (backlog_head[ch] + 1) % HOST_BACKLOG;
+		backlog_count[ch]--;
+	}
+}
+
+static void host_on_ready(void *ctx)
+{
+	(void)ctx;
+	printf("bridge running:");
+	for (unsigned i=0; i<opt.ports; i++) {
+		printf(" %s -> %s", ports[i].ifname, ports[ports[i].out].ifname);
+	}
+	printf("\n");
+	sim_event_at(&report_event, sim_now() + 1000000000ULL);
+	if (opt.duration_s > 0) {
+		sim_event_at(&stop_event, sim_now() + (uint64_t)(opt.duration_s * 1e9));
+	}
+}
+
+static void host_on_rx(void *ctx, const struct gs_host_frame *frame)
+{
+	(void)ctx;
+
+	if (frame->flags & GS_CAN_FLAG_OVERFLOW) {
+		host_overflow_flags++;
+	}
+	if (frame->can_id & CAN_ERR_FLAG) {
+		host_error_frames++;
+		return;
+	}
+	if ((frame->channel >= opt.ports) || stopping) {
+		return;
+	}
+
+	unsigned ch = ports[frame->channel].out;
+	if (backlog_count[ch] == HOST_BACKLOG) {
+		backlog_dropped[ch]++;
+		return;
+	}
+	struct gs_host_frame *out = &backlog[ch][(backlog_head[ch] + backlog_count[ch]++) % HOST_BACKLOG];
+	*out = *frame;
+	out->channel = ch;
+	out->flags = 0;
+	host_pump(ch);
+}
+
+static void host_on_echo(void *ctx, const struct gs_host_frame *frame, void *tx_ctx)
+{
+	(void)ctx;
+	latency_add(&echo_latency, sim_now() - (uintptr_t)tx_ctx);
+	host_pump(frame->channel);
+}
+
+static void host_on_tx_failed(void *ctx, unsigned channel, void *tx_ctx)
+{
+	(void)ctx;
+	(void)channel;
+	(void)tx_ctx;
+	host_tx_failed++;
+}
+
+/* ---- reporting ---- */
+
+static void report_interval(sim_event_t *ev)
+{
+	if (!opt.quiet) {
+		for (unsigned i=0; i<opt.ports; i++) {
+			port_t *p = &ports[i];
+			printf("%s: read %llu, written %llu, in flight %u, lost %llu, latency avg %.1f max %.1f us\n",
+			       p->ifname, (unsigned long long)p->read, (unsigned long long)ports[p->out].written, p->track_count,
+			       (unsigned long long)p->lost, p->interval.n ? (double)p->interval.sum / p->interval.n / 1000.0 : 0.0,
+			       p->interval.max / 1000.0);
+			memset(&p->interval, 0, sizeof(p->interval));
+		}
+	}
+	sim_event_at(ev, sim_now() + 1000000000ULL);
+}
+
+static void report(void)
+{
+	printf("\n");
+	for (unsigned i=0; i<opt.ports; i++) {
+		port_t *p = &ports[i];
+		port_t *o = &ports[p->out];
+		printf("%s -> %s\n", p->ifname, o->ifname);
+		printf("  read %llu, dropped before the bus %llu, written %llu, write failed %llu\n",
+		       (unsigned long long)p->read, (unsigned long long)p->read_dropped,
+		       (unsigned long long)o->written, (unsigned long long)o->write_failed);
+		printf("  lost %llu, out of order or unknown %llu, still in flight %u\n",
+		       (unsigned long long)p->lost, (unsigned long long)o->unexpected, p->track_count);
+		if (p->latency.n > 0) {
+			printf("  latency avg %.1f us, max %.1f us\n",
+			       (double)p->latency.sum / p->latency.n / 1000.0, p->latency.max / 1000.0);
+		}
+		printf("  host backlog dropped %llu, bus load %.1f %%\n", (unsigned long long)backlog_dropped[p->out],
+		       100.0 * p->bus.busy_ns / sim_now());
+	}
+	printf("host: %llu overflow flags, %llu error frames, %llu failed transmissions, echo latency avg %.1f us max %.1f us\n",
+	       (unsigned long long)host_overflow_flags, (unsigned long long)host_error_frames,
+	       (unsigned long long)host_tx_failed,
+	       echo_latency.n ? (double)echo_latency.sum / echo_latency.n / 1000.0 : 0.0, echo_latency.max / 1000.0);
+	for (unsigned ch=0; ch<opt.ports; ch++) {
+		struct gs_device_stats *st = &device_stats[ch];
+		printf("device ch%u: rx %u, tx queued %u, echoed %u, failed %u, fifo overruns %u/%u\n", ch,
+		       st->rx_frames, st->tx_queued, st->tx_echoed, st->tx_failed,
+		       st->rx_fifo_overruns[0], st->rx_fifo_overruns[1]);
+	}
+	printf("device: pool used max %u of %u, to host dropped %u, out dropped %u, out throttled %u\n",
+	       device_stats[0].pool_used_max, device_stats[0].pool_size, device_stats[0].to_host_dropped,
+	       device_stats[0].out_dropped, device_stats[0].out_throttle_count);
+	printf("sim: %llu traps, %llu interrupts\n", (unsigned long long)sim_stats.traps, (unsigned long long)sim_stats.irqs);
+	fflush(stdout);
+}
+
+static void on_stats(void *ctx, int status, const void *data)
+{
+	unsigned ch = (uintptr_t)ctx;
+
+	if (status > 0) {
+		memcpy(&device_stats[ch], data, sizeof(device_stats[ch]));
+	}
+	if (++ch < opt.ports) {
+		if (sim_host_request(true, GS_USB_BREQ_GET_STATS, ch, NULL, sizeof(device_stats[ch]), on_stats, (void *)(uintptr_t)ch)) {
+			return;
+		}
+	}
+	report();
+	exit(0);
+}
+
+static void stop(void)
+{
+	if (stopping) {
+		return;
+	}
+	stopping = true; // nothing more is read, what is queued still goes out
+	if (!sim_host_request(true, GS_USB_BREQ_GET_STATS, 0, NULL, sizeof(device_stats[0]), on_stats, (void *)0)) {
+		on_stats((void *)0, SIM_USB_STALL, NULL);
+	}
+}
+
+static void on_stop(sim_event_t *ev)
+{
+	(void)ev;
+	stop();
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	if (stop_requested) {
+		_exit(1);
+	}
+	stop_requested = 1;
+}
+
+/* waits for the interfaces while the firmware sleeps, until the next event is due */
+static void bridge_idle(uint64_t until)
+{
+	struct pollfd fds[PORTS];
+	uint64_t now = sim_now();
+	uint64_t wait = (until == SIM_NEVER) ? 100000000ULL : ((until > now) ? until - now : 0);
+	struct timespec ts = { .tv_sec = wait / 1000000000ULL, .tv_nsec = wait % 1000000000ULL };
+
+	for (unsigned i=0; i<opt.ports; i++) {
+		fds[i].fd = ports[i].fd;
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+	if ((wait > 0) && !stop_requested) {
+		ppoll(fds, opt.ports, &ts, NULL);
+	}
+	if (stop_requested) {
+		stop();
+	}
+	if (!stopping) {
+		for (unsigned i=0; i<opt.ports; i++) {
+			port_read(&ports[i]);
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] ifname [ifname]\n"
+		"  frames read from the first interface are written to the second, and the\n"
+		"  other way round; with one interface they are written back to it\n"
+		"  -b bitrate   CAN bitrate of the simulated buses (1000000)\n"
+		"  -t seconds   stop after this long, otherwise on ^C\n"
+		"  -B           no GS_CAN_MODE_BATCH_IN\n"
+		"  -T           no GS_CAN_MODE_HW_TIMESTAMP\n"
+		"  -w us        GS_USB_BREQ_SET_IN_WINDOW, batched IN transfers wait this long to fill up\n"
+		"  -q           no report once a second\n",
+		name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "b:t:BTw:qh")) != -1) {
+		switch (c) {
+			case 'b': opt.bitrate = strtoul(optarg, NULL, 0); break;
+			case 't': opt.duration_s = atof(optarg); break;
+			case 'B': opt.mode_flags &= ~GS_CAN_MODE_BATCH_IN; break;
+			case 'T': opt.mode_flags &= ~GS_CAN_MODE_HW_TIMESTAMP; break;
+			case 'w': opt.in_window_us = strtoul(optarg, NULL, 0); break;
+			case 'q': opt.quiet = true; break;
+			default: usage(argv[0]);
+		}
+	}
+	opt.ports = argc - optind;
+	if ((opt.ports < 1) || (opt.ports > PORTS)) {
+		usage(argv[0]);
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	sim_init(SIM_TIME_REAL, 0);
+	sim_set_idle(bridge_idle);
+
+	for (unsigned i=0; i<PORTS; i++) {
+		port_init(&ports[i], i, (i < opt.ports) ? argv[optind + i] : NULL);
+	}
+	if (opt.ports == 2) {
+		ports[0].out = 1;
+		ports[1].out = 0;
+	}
+	sim_can_init(&ports[0].bus, &ports[1].bus);
+	sim_event_add(&report_event, "report", report_interval, NULL);
+	sim_event_add(&stop_event, "stop", on_stop, NULL);
+
+	sim_host_config_t cfg = {
+		.channels = opt.ports,
+		.bitrate = opt.bitrate,
+		.mode_flags = opt.mode_flags,
+		.echo_slots = SIM_HOST_ECHO_SLOTS,
+		.in_window_us = opt.in_window_us,
+	};
+	sim_host_ops_t ops = {
+		.ready = host_on_ready,
+		.rx = host_on_rx,
+		.echo = host_on_echo,
+		.tx_failed = host_on_tx_failed,
+	};
+	sim_host_init(&cfg, &ops);
+
+	return firmware_main();
+}
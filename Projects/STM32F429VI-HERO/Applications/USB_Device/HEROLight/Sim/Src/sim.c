@@ -0,0 +1,568 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#include "sim.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "stm32f4xx_it.h"
+
+#define SIM_PAGE        4096
+#define SIM_REGIONS     16
+#define SIM_TRAP_FLAG   0x100 /* EFLAGS.TF, single steps the trapped instruction */
+#define NVIC_LINES      (16 + DMA2D_IRQn + 1)
+#define NVIC_THREAD     0x100 /* execution priority outside of any handler */
+
+sim_stats_t sim_stats;
+
+/* ---- host time and what of it the firmware used ---- */
+
+static uint64_t host_t0;
+static uint64_t overhead_ns;    /* host time spent in the simulation itself */
+static unsigned sim_depth;
+static uint64_t enter_ns;
+static uint64_t trap_cost_ns;   /* kernel share of one trap, not seen by the handlers */
+
+uint64_t sim_host_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sim_enter(void)
+{
+	if (sim_depth++ == 0) {
+		enter_ns = sim_host_ns();
+	}
+}
+
+void sim_leave(void)
+{
+	if (--sim_depth == 0) {
+		overhead_ns += sim_host_ns() - enter_ns;
+	}
+}
+
+/* host time spent in firmware code, stands still while the simulation runs */
+uint64_t sim_cpu_ns(void)
+{
+	static uint64_t last;
+	uint64_t t = (sim_depth > 0) ? enter_ns : sim_host_ns();
+	int64_t cpu = (int64_t)(t - host_t0 - overhead_ns);
+
+	// trap_cost_ns is an average, a cheap trap must not turn time back
+	if (cpu > (int64_t)last) {
+		last = cpu;
+	}
+	return last;
+}
+
+/* runs firmware code from inside the simulation */
+static void sim_call_firmware(void (*fn)(void))
+{
+	unsigned depth = sim_depth;
+	overhead_ns += sim_host_ns() - enter_ns;
+	sim_depth = 0;
+	fn();
+	sim_depth = depth;
+	enter_ns = sim_host_ns();
+}
+
+/* ---- device time and events ---- */
+
+static sim_time_mode_t time_mode;
+static double cpu_scale;
+static uint64_t base_ns;        /* device time at the last sync */
+static uint64_t base_cpu_ns;    /* sim_cpu_ns() at that point, SIM_TIME_SCALED */
+static uint64_t event_now = SIM_NEVER;
+static sim_event_t *events;
+static void (*idle_hook)(uint64_t until);
+static bool trace;              /* SIM_TRACE set in the environment */
+
+uint64_t sim_now(void)
+{
+	if (event_now != SIM_NEVER) {
+		return event_now; // an event runs at its own time, even if it is late
+	}
+	switch (time_mode) {
+		case SIM_TIME_SCALED:
+			return base_ns + (uint64_t)((double)(sim_cpu_ns() - base_cpu_ns) * cpu_scale);
+		case SIM_TIME_REAL:
+			return sim_host_ns() - host_t0;
+		default:
+			return base_ns;
+	}
+}
+
+void sim_event_add(sim_event_t *ev, const char *name, void (*run)(sim_event_t *ev), void *ctx)
+{
+	ev->at = SIM_NEVER;
+	ev->run = run;
+	ev->name = name;
+	ev->ctx = ctx;
+	ev->next = events;
+	events = ev;
+}
+
+void sim_event_at(sim_event_t *ev, uint64_t at)
+{
+	ev->at = at;
+}
+
+static sim_event_t *sim_next_event(void)
+{
+	sim_event_t *next = NULL;
+	for (sim_event_t *ev = events; ev != NULL; ev = ev->next) {
+		if ((ev->at != SIM_NEVER) && ((next == NULL) || (ev->at < next->at))) {
+			next = ev;
+		}
+	}
+	return next;
+}
+
+/* runs everything that is due, in time order */
+static void sim_run_due(void)
+{
+	uint64_t now = sim_now();
+	sim_event_t *ev;
+
+	while (((ev = sim_next_event()) != NULL) && (ev->at <= now)) {
+		event_now = ev->at;
+		ev->at = SIM_NEVER;
+		sim_stats.events++;
+		if (trace) {
+			fprintf(stderr, "%12.3f us  %s\n", event_now / 1000.0, ev->name);
+		}
+		ev->run(ev);
+	}
+	event_now = SIM_NEVER;
+	sim_periph_time_changed();
+}
+
+void sim_set_idle(void (*idle)(uint64_t until))
+{
+	idle_hook = idle;
+}
+
+/* ---- NVIC ---- */
+
+typedef struct {
+	uint8_t prio;
+	bool enabled;
+	bool pending;
+	bool level;    /* a peripheral holds its request line high */
+	bool held;     /* kept from being taken, sim_irq_hold() */
+} nvic_line_t;
+
+static nvic_line_t nvic[NVIC_LINES];
+static int primask;
+static unsigned exec_prio = NVIC_THREAD;
+
+#define VECTOR(irq, handler) [16 + (irq)] = handler
+
+static void (*const vectors[NVIC_LINES])(void) = {
+	VECTOR(SysTick_IRQn,   SysTick_Handler),
+	VECTOR(CAN1_TX_IRQn,   CAN1_TX_IRQHandler),
+	VECTOR(CAN1_RX0_IRQn,  CAN1_RX0_IRQHandler),
+	VECTOR(CAN1_RX1_IRQn,  CAN1_RX1_IRQHandler),
+	VECTOR(CAN1_SCE_IRQn,  CAN1_SCE_IRQHandler),
+	VECTOR(TIM2_IRQn,      TIM2_IRQHandler),
+	VECTOR(CAN2_TX_IRQn,   CAN2_TX_IRQHandler),
+	VECTOR(CAN2_RX0_IRQn,  CAN2_RX0_IRQHandler),
+	VECTOR(CAN2_RX1_IRQn,  CAN2_RX1_IRQHandler),
+	VECTOR(CAN2_SCE_IRQn,  CAN2_SCE_IRQHandler),
+	VECTOR(OTG_FS_IRQn,    OTG_FS_IRQHandler),
+	VECTOR(OTG_HS_IRQn,    OTG_HS_IRQHandler),
+};
+
+static nvic_line_t *nvic_line(IRQn_Type irq)
+{
+	if (((int)irq < -16) || ((int)irq >= NVIC_LINES - 16)) {
+		fprintf(stderr, "sim: no such interrupt %d\n", (int)irq);
+		exit(2);
+	}
+	return &nvic[16 + irq];
+}
+
+static int sim_highest_pending(void)
+{
+	int best = -1;
+	for (int i=0; i<NVIC_LINES; i++) {
+		nvic_line_t *l = &nvic[i];
+		if (l->pending && l->enabled && !l->held && (l->prio < exec_prio)
+		 && ((best < 0) || (l->prio < nvic[best].prio))) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* takes every pending interrupt that beats the current execution priority */
+static void sim_dispatch(void)
+{
+	int i;
+
+	while ((primask == 0) && ((i = sim_highest_pending()) >= 0)) {
+		nvic_line_t *l = &nvic[i];
+		unsigned saved = exec_prio;
+
+		if (vectors[i] == NULL) {
+			fprintf(stderr, "sim: interrupt %d has no handler\n", i - 16);
+			exit(2);
+		}
+		l->pending = false;
+		exec_prio = l->prio;
+		sim_stats.irqs++;
+		sim_call_firmware(vectors[i]);
+		exec_prio = saved;
+		if (l->level) {
+			l->pending = true; // still requested, taken again
+		}
+	}
+}
+
+static void sim_sync(void)
+{
+	sim_enter();
+	sim_dispatch();
+	sim_leave();
+}
+
+void sim_irq_level(IRQn_Type irq, bool level)
+{
+	nvic_line_t *l = nvic_line(irq);
+	l->level = level;
+	if (level) {
+		l->pending = true;
+	}
+}
+
+void sim_irq_pend(IRQn_Type irq)
+{
+	nvic_line_t *l = nvic_line(irq);
+	l->pending = true;
+}
+
+/* stands for firmware that keeps an interrupt waiting, e.g. a long
+ * critical section; the request stays pending until released */
+void sim_irq_hold(IRQn_Type irq, bool hold)
+{
+	nvic_line(irq)->held = hold;
+}
+
+int sim_disable_irq(void)
+{
+	int was_masked = primask;
+	primask = 1;
+	return was_masked;
+}
+
+void sim_enable_irq(void)
+{
+	primask = 0;
+	sim_enter();
+	if (time_mode != SIM_TIME_VIRTUAL) {
+		sim_run_due(); // device time moved on while the firmware ran
+	}
+	sim_dispatch();
+	sim_leave();
+}
+
+/* sleeps until an interrupt is pending, PRIMASK does not matter for that */
+void sim_wfi(void)
+{
+	sim_enter();
+	sim_stats.wfi++;
+	sim_run_due();
+	while (sim_highest_pending() < 0) {
+		sim_event_t *ev = sim_next_event();
+		uint64_t at = (ev != NULL) ? ev->at : SIM_NEVER;
+
+		if (time_mode == SIM_TIME_REAL) {
+			if (idle_hook != NULL) {
+				idle_hook(at);
+			} else if (ev == NULL) {
+				fprintf(stderr, "sim: firmware sleeps and nothing is left to happen\n");
+				exit(2);
+			} else {
+				uint64_t now = sim_now();
+				if (at > now) {
+					struct timespec ts = { .tv_sec = (at - now) / 1000000000, .tv_nsec = (at - now) % 1000000000 };
+					nanosleep(&ts, NULL);
+				}
+			}
+		} else {
+			if (ev == NULL) {
+				fprintf(stderr, "sim: firmware sleeps and nothing is left to happen\n");
+				exit(2);
+			}
+			uint64_t now = sim_now();
+			base_ns = (at > now) ? at : now;
+			base_cpu_ns = sim_cpu_ns();
+		}
+		sim_run_due();
+	}
+	sim_leave();
+}
+
+void HAL_NVIC_SetPriorityGrouping(uint32_t PriorityGroup)
+{
+	(void)PriorityGroup; // group 4 assumed: preemption priority only
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+	(void)SubPriority;
+	nvic_line(IRQn)->prio = PreemptPriority & 0x0F;
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+	nvic_line(IRQn)->enabled = true;
+	sim_sync();
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+	nvic_line(IRQn)->enabled = false;
+}
+
+void HAL_NVIC_SetPendingIRQ(IRQn_Type IRQn)
+{
+	nvic_line(IRQn)->pending = true;
+	sim_sync();
+}
+
+void HAL_NVIC_ClearPendingIRQ(IRQn_Type IRQn)
+{
+	nvic_line(IRQn)->pending = false;
+}
+
+uint32_t HAL_NVIC_GetPendingIRQ(IRQn_Type IRQn)
+{
+	return nvic_line(IRQn)->pending;
+}
+
+/* ---- register pages ---- */
+
+static sim_region_t *regions[SIM_REGIONS];
+static unsigned region_count;
+
+static struct {
+	bool active;
+	bool outer;      /* trapped from firmware code, accounted as overhead */
+	bool write;
+	sim_region_t *region;
+	uintptr_t page;
+	uint32_t offset;
+	uint32_t old;
+} trap;
+
+static sim_region_t *sim_find_region(uintptr_t addr)
+{
+	for (unsigned i=0; i<region_count; i++) {
+		sim_region_t *r = regions[i];
+		if ((addr >= r->base) && (addr < r->base + r->size)) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+void sim_map(sim_region_t *r)
+{
+	int fd = memfd_create("sim", 0);
+	void *p;
+
+	if ((fd < 0) || (ftruncate(fd, r->size) != 0)) {
+		perror("sim: memfd");
+		exit(2);
+	}
+	p = mmap((void *)r->base, r->size, r->prot, MAP_SHARED | (r->base ? MAP_FIXED_NOREPLACE : 0), fd, 0);
+	if ((p == MAP_FAILED) || (r->base && (p != (void *)r->base))) {
+		fprintf(stderr, "sim: cannot map registers at 0x%08lx: %s\n", (unsigned long)r->base, strerror(errno));
+		exit(2);
+	}
+	r->base = (uintptr_t)p;
+	r->shadow = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (r->shadow == MAP_FAILED) {
+		perror("sim: mmap");
+		exit(2);
+	}
+	close(fd);
+
+	if (region_count == SIM_REGIONS) {
+		fprintf(stderr, "sim: too many register regions\n");
+		exit(2);
+	}
+	regions[region_count++] = r;
+}
+
+void sim_protect(sim_region_t *r, int prot)
+{
+	r->prot = prot;
+	mprotect((void *)r->base, r->size, prot);
+}
+
+/* A protected register was accessed: let the model update it for a read,
+ * remember the old value for a write, then single step the instruction with
+ * the page opened up. A read-modify-write faults twice. */
+static void sim_on_segv(int sig, siginfo_t *si, void *context)
+{
+	ucontext_t *uc = context;
+	uintptr_t addr = (uintptr_t)si->si_addr;
+	sim_region_t *r = sim_find_region(addr);
+	(void)sig;
+
+	if (r == NULL) {
+		signal(SIGSEGV, SIG_DFL); // a real crash, let it happen again without us
+		return;
+	}
+
+	if (!trap.active) {
+		trap.active = true;
+		trap.outer = (sim_depth == 0);
+		if (trap.outer) {
+			sim_enter();
+		}
+		sim_stats.traps++;
+	}
+	trap.region = r;
+	trap.page = addr & ~(uintptr_t)(SIM_PAGE - 1);
+	trap.offset = (addr - r->base) & ~3u;
+
+	if (uc->uc_mcontext.gregs[REG_ERR] & 2) {
+		trap.write = true;
+		trap.old = SIM_REG(r, trap.offset);
+		mprotect((void *)trap.page, SIM_PAGE, PROT_READ | PROT_WRITE);
+	} else {
+		if (r->read != NULL) {
+			r->read(r, trap.offset);
+		}
+		mprotect((void *)trap.page, SIM_PAGE, PROT_READ);
+	}
+	uc->uc_mcontext.gregs[REG_EFL] |= SIM_TRAP_FLAG;
+}
+
+static void sim_on_trap(int sig, siginfo_t *si, void *context)
+{
+	ucontext_t *uc = context;
+	(void)sig;
+	(void)si;
+
+	uc->uc_mcontext.gregs[REG_EFL] &= ~SIM_TRAP_FLAG;
+	if (!trap.active) {
+		return;
+	}
+
+	sim_region_t *r = trap.region;
+	mprotect((void *)trap.page, SIM_PAGE, r->prot);
+	trap.active = false;
+	if (trap.write && (r->write != NULL)) {
+		r->write(r, trap.offset, trap.old);
+	}
+	trap.write = false;
+	if (trap.outer) {
+		sim_leave();
+		overhead_ns += trap_cost_ns;
+	}
+}
+
+/* measures what a trap costs beyond the handlers, so the firmware CPU time
+ * can be corrected for it */
+static void sim_calibrate(void)
+{
+	static sim_region_t cal = { .size = SIM_PAGE, .prot = PROT_READ };
+	const unsigned n = 2000;
+	volatile uint32_t *reg;
+	uint64_t t0, t1, t2, in_handler;
+
+	sim_map(&cal);
+	reg = (volatile uint32_t *)cal.base;
+
+	t0 = sim_host_ns();
+	for (unsigned i=0; i<n; i++) {
+		cal.shadow[0] = i; // the same loop without trapping
+	}
+	t1 = sim_host_ns();
+	in_handler = *(volatile uint64_t *)&overhead_ns; // the handlers change it behind the compiler's back
+	for (unsigned i=0; i<n; i++) {
+		*reg = i;
+	}
+	t2 = sim_host_ns();
+	in_handler = *(volatile uint64_t *)&overhead_ns - in_handler;
+
+	uint64_t extra = (t2 - t1) - (t1 - t0) - in_handler;
+	trap_cost_ns = extra / n;
+
+	region_count--;
+	munmap((void *)cal.base, cal.size);
+	munmap((void *)cal.shadow, cal.size);
+	overhead_ns = 0;
+	sim_stats.traps = 0;
+}
+
+void sim_init(sim_time_mode_t mode, double scale)
+{
+	struct sigaction sa;
+
+#if !MAIN_LOOP_SLEEP
+	if (mode == SIM_TIME_VIRTUAL) {
+		fprintf(stderr, "sim: the firmware never sleeps with MAIN_LOOP_SLEEP=0, virtual time would stand still, use -k\n");
+		exit(2);
+	}
+#endif
+	host_t0 = sim_host_ns();
+	time_mode = mode;
+	cpu_scale = scale;
+	trace = getenv("SIM_TRACE") != NULL;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = sim_on_segv;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = sim_on_trap;
+	sigaction(SIGTRAP, &sa, NULL);
+
+	for (int i=0; i<16; i++) {
+		nvic[i].enabled = true; // system exceptions cannot be disabled
+	}
+
+	sim_calibrate();
+	sim_periph_init();
+	sim_periph_time_mode(mode);
+	host_t0 = sim_host_ns();
+	overhead_ns = 0;
+}
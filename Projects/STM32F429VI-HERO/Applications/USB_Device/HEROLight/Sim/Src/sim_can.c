@@ -0,0 +1,944 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#include "sim_can.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "gs_usb.h"
+
+/* ---- the wire ---- */
+
+#define CAN_ERROR_FRAME_BITS  17 /* error flag, delimiter and intermission */
+#define CAN_ACK_TAIL_BITS     10 /* ACK delimiter, EOF, taken by the error frame instead */
+
+static uint32_t bus_random(sim_can_bus_t *bus)
+{
+	bus->seed ^= bus->seed << 13;
+	bus->seed ^= bus->seed >> 17;
+	bus->seed ^= bus->seed << 5;
+	return bus->seed;
+}
+
+/* orders frames the way the arbitration does, like can_tx_key() in can.c */
+uint32_t sim_can_key(uint32_t can_id)
+{
+	uint32_t rtr = (can_id & CAN_RTR_FLAG) ? 1 : 0;
+
+	if (can_id & CAN_EFF_FLAG) {
+		uint32_t id = can_id & 0x1FFFFFFF;
+		return ((id >> 18) << 21) | (3 << 19) | ((id & 0x3FFFF) << 1) | rtr;
+	}
+	return ((can_id & 0x7FF) << 21) | (rtr << 20);
+}
+
+typedef struct {
+	uint8_t bits[160];
+	unsigned len;
+	uint16_t crc;
+} bitstream_t;
+
+static void bits_put(bitstream_t *s, uint32_t value, unsigned count, bool crc)
+{
+	while (count-- > 0) {
+		uint8_t bit = (value >> count) & 1;
+		s->bits[s->len++] = bit;
+		if (crc) {
+			bool next = bit ^ ((s->crc >> 14) & 1);
+			s->crc = (s->crc << 1) & 0x7FFF;
+			if (next) {
+				s->crc ^= 0x4599;
+			}
+		}
+	}
+}
+
+/* bits a data or remote frame takes including stuff bits and intermission */
+unsigned sim_can_frame_bits(const sim_can_msg_t *msg)
+{
+	bitstream_t s = { .len = 0 };
+	bool rtr = (msg->can_id & CAN_RTR_FLAG) != 0;
+	unsigned dlc = msg->dlc & 0x0F;
+	unsigned stuff = 0, run = 0;
+	uint8_t last = 2;
+
+	bits_put(&s, 0, 1, true); // SOF
+	if (msg->can_id & CAN_EFF_FLAG) {
+		uint32_t id = msg->can_id & 0x1FFFFFFF;
+		bits_put(&s, id >> 18, 11, true);
+		bits_put(&s, 3, 2, true); // SRR, IDE
+		bits_put(&s, id & 0x3FFFF, 18, true);
+	} else {
+		bits_put(&s, msg->can_id & 0x7FF, 11, true);
+	}
+	bits_put(&s, rtr, 1, true);
+	bits_put(&s, 0, 2, true); // IDE or r1, r0
+	bits_put(&s, dlc, 4, true);
+	if (!rtr) {
+		for (unsigned i=0; i<((dlc > 8) ? 8 : dlc); i++) {
+			bits_put(&s, msg->data[i], 8, true);
+		}
+	}
+	bits_put(&s, s.crc, 15, false);
+
+	for (unsigned i=0; i<s.len; i++) {
+		if (s.bits[i] == last) {
+			run++;
+		} else {
+			last = s.bits[i];
+			run = 1;
+		}
+		if (run == 5) {
+			stuff++;
+			last = !last; // the stuff bit starts the next run
+			run = 1;
+		}
+	}
+
+	return s.len + stuff + 1 + 2 + 7 + 3; // CRC delimiter, ACK, EOF, intermission
+}
+
+static void bus_on_event(sim_event_t *ev);
+
+void sim_can_bus_init(sim_can_bus_t *bus, const char *name, uint32_t bitrate)
+{
+	memset(bus, 0, sizeof(*bus));
+	bus->name = name;
+	bus->bit_ps = 1000000000000ull / bitrate;
+	bus->seed = 0x2545F491;
+	sim_event_add(&bus->event, name, bus_on_event, bus);
+}
+
+void sim_can_attach(sim_can_bus_t *bus, sim_can_node_t *node)
+{
+	node->bus = bus;
+	node->next = bus->nodes;
+	bus->nodes = node;
+	sim_can_kick(bus);
+}
+
+void sim_can_detach(sim_can_node_t *node)
+{
+	sim_can_bus_t *bus = node->bus;
+	if (bus == NULL) {
+		return;
+	}
+	for (sim_can_node_t **p = &bus->nodes; *p != NULL; p = &(*p)->next) {
+		if (*p == node) {
+			*p = node->next;
+			break;
+		}
+	}
+	if (bus->tx == node) {
+		bus->tx = NULL; // its frame ends as if it was sent by nobody
+	}
+	node->bus = NULL;
+	node->next = NULL;
+}
+
+/* a node has a new frame, arbitration starts once the bus is idle */
+void sim_can_kick(sim_can_bus_t *bus)
+{
+	if (!bus->busy && (bus->event.at == SIM_NEVER)) {
+		sim_event_at(&bus->event, sim_now());
+	}
+}
+
+static uint64_t bus_bits_ns(sim_can_bus_t *bus, unsigned bits)
+{
+	return (bits * bus->bit_ps + 999) / 1000;
+}
+
+static void bus_arbitrate(sim_can_bus_t *bus)
+{
+	sim_can_node_t *winner = NULL;
+	sim_can_msg_t msg, best;
+	sim_can_node_t *contenders[8];
+	unsigned count = 0;
+	unsigned bits;
+	bool acked = false;
+
+	for (sim_can_node_t *n = bus->nodes; n != NULL; n = n->next) {
+		if ((count < 8) && n->pending(n, &msg)) {
+			contenders[count++] = n;
+			if ((winner == NULL) || (sim_can_key(msg.can_id) < sim_can_key(best.can_id))) {
+				winner = n;
+				best = msg;
+			}
+		}
+	}
+	if (winner == NULL) {
+		return;
+	}
+	for (unsigned i=0; i<count; i++) {
+		if (contenders[i] != winner) {
+			contenders[i]->done(contenders[i], SIM_CAN_LOST);
+		}
+	}
+
+	for (sim_can_node_t *n = bus->nodes; n != NULL; n = n->next) {
+		acked |= n->acks(n, winner);
+	}
+
+	bus->busy = true;
+	bus->tx = winner;
+	bus->msg = best;
+	bus->frame_start = sim_now();
+	bits = sim_can_frame_bits(&best);
+	if ((bus->error_ppm > 0) && ((bus_random(bus) % 1000000) < bus->error_ppm)) {
+		bus->result = SIM_CAN_ERROR;
+		bits = bits/2 + CAN_ERROR_FRAME_BITS; // destroyed somewhere in the middle
+	} else if (!acked) {
+		bus->result = SIM_CAN_ERROR;
+		bits = bits - CAN_ACK_TAIL_BITS + CAN_ERROR_FRAME_BITS;
+	} else {
+		bus->result = SIM_CAN_OK;
+	}
+	sim_event_at(&bus->event, bus->frame_start + bus_bits_ns(bus, bits));
+}
+
+static void bus_finish(sim_can_bus_t *bus)
+{
+	sim_can_node_t *tx = bus->tx;
+	bool acked = bus->result == SIM_CAN_OK;
+
+	bus->busy = false;
+	bus->busy_ns += sim_now() - bus->frame_start;
+	bus->tx = NULL;
+
+	if (acked) {
+		bus->frames++;
+		for (sim_can_node_t *n = bus->nodes; n != NULL; n = n->next) {
+			if (n != tx) {
+				n->received(n, &bus->msg);
+			}
+		}
+	} else {
+		bus->errors++;
+		bool ack_error = (sim_now() - bus->frame_start) > bus_bits_ns(bus, sim_can_frame_bits(&bus->msg) / 2 + CAN_ERROR_FRAME_BITS);
+		for (sim_can_node_t *n = bus->nodes; n != NULL; n = n->next) {
+			if (n == tx) {
+				n->error(n, true, ack_error ? 3 : 5); // ACK error, bit dominant error
+			} else if (!ack_error) {
+				n->error(n, false, 1); // stuff error
+			}
+		}
+	}
+	if (tx != NULL) {
+		tx->done(tx, bus->result);
+	}
+	sim_can_kick(bus);
+}
+
+static void bus_on_event(sim_event_t *ev)
+{
+	sim_can_bus_t *bus = ev->ctx;
+
+	if (bus->busy) {
+		bus_finish(bus);
+	} else {
+		bus_arbitrate(bus);
+	}
+}
+
+/* ---- bxCAN ---- */
+
+#define CAN_PAGE        0x40006000
+#define CAN_REG(ctl, r)  SIM_REG(&can_region, (ctl)->offset + offsetof(CAN_TypeDef, r))
+#define CAN1_REG(r)      SIM_REG(&can_region, CAN1_BASE - CAN_PAGE + offsetof(CAN_TypeDef, r))
+#define CAN_MB          offsetof(CAN_TypeDef, sTxMailBox)
+#define CAN_MB_END      (CAN_MB + sizeof(((CAN_TypeDef *)0)->sTxMailBox))
+#define CAN_FIFO        offsetof(CAN_TypeDef, sFIFOMailBox)
+#define CAN_FIFO_END    (CAN_FIFO + sizeof(((CAN_TypeDef *)0)->sFIFOMailBox))
+#define CAN_FILTER      offsetof(CAN_TypeDef, sFilterRegister)
+#define CAN_FILTER_END  (CAN_FILTER + sizeof(((CAN_TypeDef *)0)->sFilterRegister))
+#define CAN_FIFO_DEPTH  3
+#define CAN_BANKS       28
+#define CAN_RECOVERY_BITS (128 * 11)
+
+typedef struct {
+	uint32_t rir;
+	uint32_t rdtr;
+	uint32_t rdlr;
+	uint32_t rdhr;
+} can_fifo_entry_t;
+
+typedef struct {
+	sim_can_node_t node;
+	const char *name;
+	uint32_t offset;        /* of the register block in the page */
+	IRQn_Type tx_irq, rx0_irq, rx1_irq, sce_irq;
+	sim_can_bus_t *bus;     /* the one it is wired to */
+	sim_can_bus_t loop_bus; /* stands in for it in loop back mode */
+	can_fifo_entry_t fifo[2][CAN_FIFO_DEPTH];
+	unsigned fifo_len[2];
+	uint32_t mb_order[3];   /* request order for TXFP */
+	uint32_t order;
+	int active_mb;          /* the mailbox on the bus, -1 if none */
+	bool abort_active;      /* abort requested for it */
+	unsigned tec;
+	unsigned rec;
+	uint32_t esr_flags;
+	sim_event_t recovery;
+} can_ctl_t;
+
+static sim_region_t can_region;
+static can_ctl_t ctls[2];
+
+static bool can_in_init(can_ctl_t *ctl)
+{
+	return (CAN_REG(ctl, MSR) & (CAN_MSR_INAK | CAN_MSR_SLAK)) != 0;
+}
+
+static bool can_on_bus(can_ctl_t *ctl)
+{
+	return !can_in_init(ctl) && !(CAN_REG(ctl, ESR) & CAN_ESR_BOFF);
+}
+
+static bool can_mb_pending(can_ctl_t *ctl, unsigned mb)
+{
+	return (CAN_REG(ctl, TSR) & (CAN_TSR_TME0 << mb)) == 0;
+}
+
+static uint32_t can_mb_id(can_ctl_t *ctl, unsigned mb)
+{
+	uint32_t tir = CAN_REG(ctl, sTxMailBox[mb].TIR);
+	uint32_t can_id = (tir & CAN_TI0R_IDE) ? (CAN_EFF_FLAG | (tir >> 3)) : (tir >> 21);
+	if (tir & CAN_TI0R_RTR) {
+		can_id |= CAN_RTR_FLAG;
+	}
+	return can_id;
+}
+
+/* TME, CODE and LOW follow the mailbox states */
+static void can_update_tsr(can_ctl_t *ctl)
+{
+	uint32_t tsr = CAN_REG(ctl, TSR) & 0x00FFFFFF;
+	int code = -1, low = -1;
+
+	for (unsigned mb=0; mb<3; mb++) {
+		if (CAN_REG(ctl, TSR) & (CAN_TSR_TME0 << mb)) {
+			tsr |= CAN_TSR_TME0 << mb;
+			if (code < 0) {
+				code = mb;
+			}
+		} else if ((low < 0) || (sim_can_key(can_mb_id(ctl, mb)) < sim_can_key(can_mb_id(ctl, low)))) {
+			low = mb;
+		}
+	}
+	if (code >= 0) {
+		tsr |= (uint32_t)code << CAN_TSR_CODE_Pos;
+	}
+	if (low >= 0) {
+		tsr |= CAN_TSR_LOW0 << low;
+	}
+	CAN_REG(ctl, TSR) = tsr;
+}
+
+static void can_update_esr(can_ctl_t *ctl)
+{
+	uint32_t esr = CAN_REG(ctl, ESR) & CAN_ESR_LEC;
+	uint32_t ier = CAN_REG(ctl, IER);
+	uint32_t rising;
+
+	esr |= (uint32_t)((ctl->tec > 255) ? 255 : ctl->tec) << CAN_ESR_TEC_Pos;
+	esr |= (uint32_t)((ctl->rec > 255) ? 255 : ctl->rec) << CAN_ESR_REC_Pos;
+	if ((ctl->tec >= 96) || (ctl->rec >= 96)) {
+		esr |= CAN_ESR_EWGF;
+	}
+	if ((ctl->tec > 127) || (ctl->rec > 127)) {
+		esr |= CAN_ESR_EPVF;
+	}
+	if (ctl->tec > 255) {
+		esr |= CAN_ESR_BOFF;
+	}
+	rising = esr & ~ctl->esr_flags & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+	ctl->esr_flags = esr & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+
+	if ( ((rising & CAN_ESR_EWGF) && (ier & CAN_IER_EWGIE))
+	  || ((rising & CAN_ESR_EPVF) && (ier & CAN_IER_EPVIE))
+	  || ((rising & CAN_ESR_BOFF) && (ier & CAN_IER_BOFIE))) {
+		CAN_REG(ctl, MSR) |= CAN_MSR_ERRI;
+	}
+	CAN_REG(ctl, ESR) = esr;
+}
+
+static void can_update_irq(can_ctl_t *ctl)
+{
+	uint32_t ier = CAN_REG(ctl, IER);
+	uint32_t tsr = CAN_REG(ctl, TSR);
+	uint32_t rf0r = CAN_REG(ctl, RF0R);
+	uint32_t rf1r = CAN_REG(ctl, RF1R);
+
+	sim_irq_level(ctl->tx_irq, (ier & CAN_IER_TMEIE) && (tsr & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2)));
+	sim_irq_level(ctl->rx0_irq, ((ier & CAN_IER_FMPIE0) && (rf0r & CAN_RF0R_FMP0))
+	                         || ((ier & CAN_IER_FFIE0) && (rf0r & CAN_RF0R_FULL0))
+	                         || ((ier & CAN_IER_FOVIE0) && (rf0r & CAN_RF0R_FOVR0)));
+	sim_irq_level(ctl->rx1_irq, ((ier & CAN_IER_FMPIE1) && (rf1r & CAN_RF1R_FMP1))
+	                         || ((ier & CAN_IER_FFIE1) && (rf1r & CAN_RF1R_FULL1))
+	                         || ((ier & CAN_IER_FOVIE1) && (rf1r & CAN_RF1R_FOVR1)));
+	sim_irq_level(ctl->sce_irq, (ier & CAN_IER_ERRIE) && (CAN_REG(ctl, MSR) & CAN_MSR_ERRI));
+}
+
+static void can_set_lec(can_ctl_t *ctl, unsigned lec)
+{
+	CAN_REG(ctl, ESR) = (CAN_REG(ctl, ESR) & ~CAN_ESR_LEC) | (lec << CAN_ESR_LEC_Pos);
+	if ((lec != 0) && (CAN_REG(ctl, IER) & CAN_IER_LECIE)) {
+		CAN_REG(ctl, MSR) |= CAN_MSR_ERRI;
+	}
+}
+
+/* RFxR and the FIFO output registers show the oldest entry */
+static void can_update_fifo(can_ctl_t *ctl, unsigned f)
+{
+	volatile uint32_t *rfr = (f == 0) ? &CAN_REG(ctl, RF0R) : &CAN_REG(ctl, RF1R);
+	can_fifo_entry_t *head = &ctl->fifo[f][0];
+
+	*rfr = (*rfr & (CAN_RF0R_FULL0 | CAN_RF0R_FOVR0)) | ctl->fifo_len[f];
+	if (ctl->fifo_len[f] > 0) {
+		CAN_REG(ctl, sFIFOMailBox[f].RIR) = head->rir;
+		CAN_REG(ctl, sFIFOMailBox[f].RDTR) = head->rdtr;
+		CAN_REG(ctl, sFIFOMailBox[f].RDLR) = head->rdlr;
+		CAN_REG(ctl, sFIFOMailBox[f].RDHR) = head->rdhr;
+	}
+}
+
+static void can_update(can_ctl_t *ctl)
+{
+	can_update_tsr(ctl);
+	can_update_esr(ctl);
+	can_update_fifo(ctl, 0);
+	can_update_fifo(ctl, 1);
+	can_update_irq(ctl);
+}
+
+/* first filter bank and one past the last one of a controller */
+static void can_banks(can_ctl_t *ctl, unsigned *first, unsigned *end)
+{
+	unsigned can2sb = (CAN1_REG(FMR) & CAN_FMR_CAN2SB) >> CAN_FMR_CAN2SB_Pos;
+	bool is_can2 = ctl == &ctls[1];
+
+	*first = is_can2 ? can2sb : 0;
+	*end = is_can2 ? CAN_BANKS : can2sb;
+}
+
+/* filter numbers a bank takes up in the FMI count of its FIFO */
+static unsigned can_bank_filters(unsigned bank)
+{
+	bool scale32 = (CAN1_REG(FS1R) >> bank) & 1;
+	bool list = (CAN1_REG(FM1R) >> bank) & 1;
+	return scale32 ? (list ? 2 : 1) : (list ? 4 : 2);
+}
+
+/* Runs the filter banks over a frame. Matches by priority: 32-bit scale
+ * before 16-bit, identifier list before mask, then the lower bank.
+ * Returns the FIFO, or -1 if no filter takes it. */
+static int can_filter(can_ctl_t *ctl, uint32_t rir, unsigned *fmi)
+{
+	uint32_t r32 = rir & ~1u;
+	uint32_t r16 = ((rir >> 21) << 5) | ((rir & CAN_RI0R_RTR) ? 0x10 : 0)
+	             | ((rir & CAN_RI0R_IDE) ? 0x08 : 0) | ((rir >> 18) & 0x07);
+	unsigned first, end;
+	int best_bank = -1;
+	unsigned best_elem = 0, best_rank = 0;
+
+	can_banks(ctl, &first, &end);
+	for (unsigned b=first; b<end; b++) {
+		if (!((CAN1_REG(FA1R) >> b) & 1)) {
+			continue;
+		}
+		bool scale32 = (CAN1_REG(FS1R) >> b) & 1;
+		bool list = (CAN1_REG(FM1R) >> b) & 1;
+		uint32_t fr1 = CAN1_REG(sFilterRegister[b].FR1);
+		uint32_t fr2 = CAN1_REG(sFilterRegister[b].FR2);
+		unsigned rank = (scale32 ? 0 : 2) + (list ? 0 : 1);
+		int elem = -1;
+
+		if (scale32 && list) {
+			elem = (r32 == (fr1 & ~1u)) ? 0 : (r32 == (fr2 & ~1u)) ? 1 : -1;
+		} else if (scale32) {
+			elem = (((r32 ^ fr1) & fr2 & ~1u) == 0) ? 0 : -1;
+		} else if (list) {
+			uint16_t ids[4] = { fr1, fr1 >> 16, fr2, fr2 >> 16 };
+			for (unsigned i=0; (i<4) && (elem<0); i++) {
+				elem = (r16 == ids[i]) ? (int)i : -1;
+			}
+		} else {
+			if ((((r16 ^ fr1) & (fr1 >> 16)) & 0xFFFF) == 0) {
+				elem = 0;
+			} else if ((((r16 ^ fr2) & (fr2 >> 16)) & 0xFFFF) == 0) {
+				elem = 1;
+			}
+		}
+
+		if ((elem >= 0) && ((best_bank < 0) || (rank < best_rank))) {
+			best_bank = b;
+			best_elem = elem;
+			best_rank = rank;
+		}
+	}
+	if (best_bank < 0) {
+		return -1;
+	}
+
+	int fifo = (CAN1_REG(FFA1R) >> best_bank) & 1;
+	*fmi = best_elem;
+	for (unsigned b=first; b<(unsigned)best_bank; b++) {
+		if ((int)((CAN1_REG(FFA1R) >> b) & 1) == fifo) {
+			*fmi += can_bank_filters(b);
+		}
+	}
+	return fifo;
+}
+
+static void can_store(can_ctl_t *ctl, const sim_can_msg_t *msg)
+{
+	can_fifo_entry_t e;
+	unsigned fmi = 0;
+	int f;
+
+	if (msg->can_id & CAN_EFF_FLAG) {
+		e.rir = ((msg->can_id & 0x1FFFFFFF) << 3) | CAN_RI0R_IDE;
+	} else {
+		e.rir = (msg->can_id & 0x7FF) << 21;
+	}
+	if (msg->can_id & CAN_RTR_FLAG) {
+		e.rir |= CAN_RI0R_RTR;
+	}
+	e.rdlr = msg->data[0] | (msg->data[1] << 8) | (msg->data[2] << 16) | ((uint32_t)msg->data[3] << 24);
+	e.rdhr = msg->data[4] | (msg->data[5] << 8) | (msg->data[6] << 16) | ((uint32_t)msg->data[7] << 24);
+
+	if (CAN1_REG(FMR) & CAN_FMR_FINIT) {
+		return; // no reception while the filters are set up
+	}
+	f = can_filter(ctl, e.rir, &fmi);
+	if (f < 0) {
+		return;
+	}
+	e.rdtr = (msg->dlc & 0x0F) | (fmi << CAN_RDT0R_FMI_Pos);
+
+	volatile uint32_t *rfr = (f == 0) ? &CAN_REG(ctl, RF0R) : &CAN_REG(ctl, RF1R);
+	if (ctl->fifo_len[f] == CAN_FIFO_DEPTH) {
+		*rfr |= CAN_RF0R_FOVR0;
+		if (!(CAN_REG(ctl, MCR) & CAN_MCR_RFLM)) {
+			ctl->fifo[f][CAN_FIFO_DEPTH-1] = e; // the newest is overwritten
+		}
+	} else {
+		ctl->fifo[f][ctl->fifo_len[f]++] = e;
+		if (ctl->fifo_len[f] == CAN_FIFO_DEPTH) {
+			*rfr |= CAN_RF0R_FULL0;
+		}
+	}
+}
+
+static void can_mb_complete(can_ctl_t *ctl, unsigned mb, uint32_t status)
+{
+	uint32_t tsr = CAN_REG(ctl, TSR) & ~((CAN_TSR_TXOK0 | CAN_TSR_ALST0 | CAN_TSR_TERR0 | CAN_TSR_ABRQ0) << (8*mb));
+	CAN_REG(ctl, TSR) = tsr | ((CAN_TSR_RQCP0 | status) << (8*mb)) | (CAN_TSR_TME0 << mb);
+	CAN_REG(ctl, sTxMailBox[mb].TIR) &= ~CAN_TI0R_TXRQ;
+}
+
+static void can_reset(can_ctl_t *ctl)
+{
+	CAN_REG(ctl, MCR) = 0x00010002;
+	CAN_REG(ctl, MSR) = 0x00000C02;
+	CAN_REG(ctl, TSR) = 0x1C000000;
+	CAN_REG(ctl, RF0R) = 0;
+	CAN_REG(ctl, RF1R) = 0;
+	CAN_REG(ctl, IER) = 0;
+	CAN_REG(ctl, ESR) = 0;
+	CAN_REG(ctl, BTR) = 0x01230000;
+	ctl->fifo_len[0] = 0;
+	ctl->fifo_len[1] = 0;
+	ctl->active_mb = -1;
+	ctl->abort_active = false;
+	ctl->tec = 0;
+	ctl->rec = 0;
+	ctl->esr_flags = 0;
+	sim_event_at(&ctl->recovery, SIM_NEVER);
+	can_update(ctl);
+}
+
+/* Loop back mode talks to itself only. The bit rate is the bus's, the
+ * bit timing register is only checked against it. */
+static void can_connect(can_ctl_t *ctl)
+{
+	uint32_t btr = CAN_REG(ctl, BTR);
+	sim_can_bus_t *bus = (btr & CAN_BTR_LBKM) ? &ctl->loop_bus : ctl->bus;
+	uint32_t tq = ((btr & CAN_BTR_BRP) + 1);
+	uint32_t bit_tq = 1 + ((btr & CAN_BTR_TS1) >> CAN_BTR_TS1_Pos) + 1 + ((btr & CAN_BTR_TS2) >> CAN_BTR_TS2_Pos) + 1;
+	uint64_t bit_ps = 1000000000000ull * tq * bit_tq / HAL_RCC_GetPCLK1Freq();
+	static bool warned;
+
+	if (!warned && (bit_ps != ctl->bus->bit_ps)) {
+		fprintf(stderr, "sim: %s bit time %lu ps does not match the bus, %lu ps\n",
+			ctl->name, (unsigned long)bit_ps, (unsigned long)ctl->bus->bit_ps);
+		warned = true;
+	}
+	ctl->loop_bus.bit_ps = ctl->bus->bit_ps;
+
+	if (ctl->node.bus != bus) {
+		if ((ctl->node.bus != NULL) && (ctl->node.bus->tx == &ctl->node)) {
+			return; // leaves after the frame on the bus, see can_node_done()
+		}
+		sim_can_detach(&ctl->node);
+		sim_can_attach(bus, &ctl->node);
+	}
+}
+
+static void can_on_recovery(sim_event_t *ev)
+{
+	can_ctl_t *ctl = ev->ctx;
+	ctl->tec = 0;
+	ctl->rec = 0;
+	can_update(ctl);
+	if (ctl->node.bus != NULL) {
+		sim_can_kick(ctl->node.bus);
+	}
+}
+
+static void can_count_error(can_ctl_t *ctl, bool transmitter, unsigned lec)
+{
+	bool passive = (ctl->tec > 127) || (ctl->rec > 127);
+
+	if (transmitter) {
+		if (!((lec == 3) && passive)) {
+			ctl->tec += 8; // an ACK error does not count against an error passive node
+		}
+	} else if (ctl->rec < 255) {
+		ctl->rec++;
+	}
+	can_set_lec(ctl, lec);
+
+	if ((ctl->tec > 255) && (ctl->recovery.at == SIM_NEVER) && (CAN_REG(ctl, MCR) & CAN_MCR_ABOM)) {
+		sim_event_at(&ctl->recovery, sim_now() + CAN_RECOVERY_BITS * ctl->bus->bit_ps / 1000);
+	}
+}
+
+static int can_pick_mailbox(can_ctl_t *ctl)
+{
+	bool by_order = (CAN_REG(ctl, MCR) & CAN_MCR_TXFP) != 0;
+	int pick = -1;
+
+	for (unsigned mb=0; mb<3; mb++) {
+		if (!can_mb_pending(ctl, mb)) {
+			continue;
+		}
+		if ( (pick < 0)
+		  || (by_order && (ctl->mb_order[mb] < ctl->mb_order[pick]))
+		  || (!by_order && (sim_can_key(can_mb_id(ctl, mb)) < sim_can_key(can_mb_id(ctl, pick))))) {
+			pick = mb;
+		}
+	}
+	return pick;
+}
+
+static bool can_node_pending(sim_can_node_t *n, sim_can_msg_t *msg)
+{
+	can_ctl_t *ctl = n->ctx;
+	int mb;
+
+	if (!can_on_bus(ctl) || ((CAN_REG(ctl, BTR) & (CAN_BTR_SILM | CAN_BTR_LBKM)) == CAN_BTR_SILM)) {
+		return false; // silent mode cannot start a frame
+	}
+	mb = can_pick_mailbox(ctl);
+	if (mb < 0) {
+		return false;
+	}
+	uint32_t tdlr = CAN_REG(ctl, sTxMailBox[mb].TDLR);
+	uint32_t tdhr = CAN_REG(ctl, sTxMailBox[mb].TDHR);
+	msg->can_id = can_mb_id(ctl, mb);
+	msg->dlc = CAN_REG(ctl, sTxMailBox[mb].TDTR) & CAN_TDT0R_DLC;
+	for (unsigned i=0; i<4; i++) {
+		msg->data[i] = tdlr >> (8*i);
+		msg->data[4+i] = tdhr >> (8*i);
+	}
+	ctl->active_mb = mb;
+	return true;
+}
+
+static void can_node_done(sim_can_node_t *n, sim_can_result_t result)
+{
+	can_ctl_t *ctl = n->ctx;
+	int mb = ctl->active_mb;
+	bool one_shot = (CAN_REG(ctl, MCR) & CAN_MCR_NART) != 0;
+
+	ctl->active_mb = -1;
+	if (mb >= 0) {
+		switch (result) {
+			case SIM_CAN_OK:
+				can_mb_complete(ctl, mb, CAN_TSR_TXOK0);
+				if (ctl->tec > 0) {
+					ctl->tec--;
+				}
+				can_set_lec(ctl, 0);
+				if (n->bus == &ctl->loop_bus) {
+					sim_can_msg_t msg;
+					msg.can_id = can_mb_id(ctl, mb);
+					msg.dlc = CAN_REG(ctl, sTxMailBox[mb].TDTR) & CAN_TDT0R_DLC;
+					for (unsigned i=0; i<4; i++) {
+						msg.data[i] = CAN_REG(ctl, sTxMailBox[mb].TDLR) >> (8*i);
+						msg.data[4+i] = CAN_REG(ctl, sTxMailBox[mb].TDHR) >> (8*i);
+					}
+					can_store(ctl, &msg);
+				}
+				break;
+			case SIM_CAN_LOST:
+				CAN_REG(ctl, TSR) |= CAN_TSR_ALST0 << (8*mb);
+				if (one_shot || ctl->abort_active) {
+					can_mb_complete(ctl, mb, one_shot ? CAN_TSR_ALST0 : 0);
+				}
+				break;
+			default:
+				CAN_REG(ctl, TSR) |= CAN_TSR_TERR0 << (8*mb);
+				if (one_shot || ctl->abort_active) {
+					can_mb_complete(ctl, mb, one_shot ? CAN_TSR_TERR0 : 0);
+				}
+				break;
+		}
+		ctl->abort_active = false;
+	}
+	can_update(ctl);
+	if (!can_in_init(ctl)) {
+		can_connect(ctl); // a mode change waited for the frame to end
+	}
+}
+
+static void can_node_received(sim_can_node_t *n, const sim_can_msg_t *msg)
+{
+	can_ctl_t *ctl = n->ctx;
+
+	if (!can_on_bus(ctl)) {
+		return;
+	}
+	if (ctl->rec > 127) {
+		ctl->rec = 120;
+	} else if (ctl->rec > 0) {
+		ctl->rec--;
+	}
+	can_set_lec(ctl, 0);
+	can_store(ctl, msg);
+	can_update(ctl);
+}
+
+static void can_node_error(sim_can_node_t *n, bool transmitter, unsigned lec)
+{
+	can_ctl_t *ctl = n->ctx;
+
+	if (!can_on_bus(ctl)) {
+		return;
+	}
+	can_count_error(ctl, transmitter, lec);
+	can_update(ctl);
+}
+
+static bool can_node_acks(sim_can_node_t *n, sim_can_node_t *tx)
+{
+	can_ctl_t *ctl = n->ctx;
+
+	if (n == tx) {
+		return (CAN_REG(ctl, BTR) & CAN_BTR_LBKM) != 0; // loop back mode ignores the ACK slot
+	}
+	return can_on_bus(ctl) && !(CAN_REG(ctl, BTR) & CAN_BTR_SILM);
+}
+
+static can_ctl_t *can_ctl_at(uint32_t offset)
+{
+	if ((offset >= CAN1_BASE - CAN_PAGE) && (offset < CAN2_BASE - CAN_PAGE)) {
+		return &ctls[0];
+	} else if ((offset >= CAN2_BASE - CAN_PAGE) && (offset < CAN2_BASE - CAN_PAGE + 0x400)) {
+		return &ctls[1];
+	}
+	return NULL;
+}
+
+static void can_write_mcr(can_ctl_t *ctl, uint32_t val, uint32_t old)
+{
+	if (val & CAN_MCR_RESET) {
+		can_reset(ctl);
+		return;
+	}
+	if (val & CAN_MCR_INRQ) {
+		CAN_REG(ctl, MSR) = (CAN_REG(ctl, MSR) & ~CAN_MSR_SLAK) | CAN_MSR_INAK;
+	} else if (val & CAN_MCR_SLEEP) {
+		CAN_REG(ctl, MSR) = (CAN_REG(ctl, MSR) & ~CAN_MSR_INAK) | CAN_MSR_SLAK;
+	} else {
+		CAN_REG(ctl, MSR) &= ~(CAN_MSR_INAK | CAN_MSR_SLAK);
+		if ((old & CAN_MCR_INRQ) && (ctl->tec > 255) && (ctl->recovery.at == SIM_NEVER)) {
+			// bus off recovery requested by software
+			sim_event_at(&ctl->recovery, sim_now() + CAN_RECOVERY_BITS * ctl->bus->bit_ps / 1000);
+		}
+		can_connect(ctl);
+	}
+}
+
+static void can_write_tsr(can_ctl_t *ctl, uint32_t val, uint32_t old)
+{
+	CAN_REG(ctl, TSR) = old;
+	for (unsigned mb=0; mb<3; mb++) {
+		uint32_t bits = val >> (8*mb);
+		if (bits & CAN_TSR_RQCP0) {
+			CAN_REG(ctl, TSR) &= ~((CAN_TSR_RQCP0 | CAN_TSR_TXOK0 | CAN_TSR_ALST0 | CAN_TSR_TERR0) << (8*mb));
+		}
+		if ((bits & CAN_TSR_ABRQ0) && can_mb_pending(ctl, mb)) {
+			if (ctl->active_mb == (int)mb) {
+				ctl->abort_active = true; // only if this attempt fails
+				CAN_REG(ctl, TSR) |= CAN_TSR_ABRQ0 << (8*mb);
+			} else {
+				can_mb_complete(ctl, mb, 0);
+			}
+		}
+	}
+}
+
+static void can_write_rfr(can_ctl_t *ctl, unsigned f, uint32_t val, uint32_t old)
+{
+	volatile uint32_t *rfr = (f == 0) ? &CAN_REG(ctl, RF0R) : &CAN_REG(ctl, RF1R);
+
+	*rfr = old & ~(val & (CAN_RF0R_FULL0 | CAN_RF0R_FOVR0));
+	if ((val & CAN_RF0R_RFOM0) && (ctl->fifo_len[f] > 0)) {
+		ctl->fifo_len[f]--;
+		memmove(&ctl->fifo[f][0], &ctl->fifo[f][1], ctl->fifo_len[f] * sizeof(can_fifo_entry_t));
+		*rfr &= ~CAN_RF0R_FULL0;
+	}
+}
+
+static void can_write_filter(uint32_t offset, uint32_t val, uint32_t old)
+{
+	volatile uint32_t *reg = &SIM_REG(&can_region, offset);
+	uint32_t reg_off = offset - (CAN1_BASE - CAN_PAGE);
+	bool finit = (CAN1_REG(FMR) & CAN_FMR_FINIT) != 0;
+
+	if (reg_off == offsetof(CAN_TypeDef, FMR)) {
+		*reg = (val & (CAN_FMR_FINIT | CAN_FMR_CAN2SB)) | 0x2A1C0000;
+	} else if ( (reg_off == offsetof(CAN_TypeDef, FM1R))
+	         || (reg_off == offsetof(CAN_TypeDef, FS1R))
+	         || (reg_off == offsetof(CAN_TypeDef, FFA1R))) {
+		*reg = finit ? (val & 0x0FFFFFFF) : old;
+	} else if (reg_off == offsetof(CAN_TypeDef, FA1R)) {
+		*reg = val & 0x0FFFFFFF;
+	} else if ((reg_off >= CAN_FILTER) && (reg_off < CAN_FILTER_END)) {
+		unsigned bank = (reg_off - CAN_FILTER) / 8;
+		if (!finit && ((CAN1_REG(FA1R) >> bank) & 1)) {
+			*reg = old; // active banks are locked outside of filter init mode
+		}
+	} else {
+		*reg = old;
+	}
+}
+
+static void can_on_write(sim_region_t *r, uint32_t offset, uint32_t old)
+{
+	can_ctl_t *ctl = can_ctl_at(offset);
+	uint32_t val = SIM_REG(r, offset);
+	uint32_t reg;
+
+	if (ctl == NULL) {
+		SIM_REG(r, offset) = old;
+		return;
+	}
+	reg = offset - ctl->offset;
+
+	if (reg == offsetof(CAN_TypeDef, MCR)) {
+		can_write_mcr(ctl, val, old);
+	} else if (reg == offsetof(CAN_TypeDef, MSR)) {
+		SIM_REG(r, offset) = old & ~(val & (CAN_MSR_ERRI | CAN_MSR_WKUI | CAN_MSR_SLAKI));
+	} else if (reg == offsetof(CAN_TypeDef, TSR)) {
+		can_write_tsr(ctl, val, old);
+	} else if (reg == offsetof(CAN_TypeDef, RF0R)) {
+		can_write_rfr(ctl, 0, val, old);
+	} else if (reg == offsetof(CAN_TypeDef, RF1R)) {
+		can_write_rfr(ctl, 1, val, old);
+	} else if (reg == offsetof(CAN_TypeDef, ESR)) {
+		SIM_REG(r, offset) = (old & ~CAN_ESR_LEC) | (val & CAN_ESR_LEC);
+	} else if (reg == offsetof(CAN_TypeDef, BTR)) {
+		if (!(CAN_REG(ctl, MSR) & CAN_MSR_INAK)) {
+			SIM_REG(r, offset) = old; // only in initialization mode
+		}
+	} else if ((reg >= CAN_MB) && (reg < CAN_MB_END)) {
+		unsigned mb = (reg - CAN_MB) / sizeof(CAN_TxMailBox_TypeDef);
+		if (can_mb_pending(ctl, mb)) {
+			SIM_REG(r, offset) = old; // write protected while pending
+		} else if ((reg == CAN_MB + mb * sizeof(CAN_TxMailBox_TypeDef)) && (val & CAN_TI0R_TXRQ)) {
+			CAN_REG(ctl, TSR) &= ~(CAN_TSR_TME0 << mb);
+			ctl->mb_order[mb] = ctl->order++;
+		}
+	} else if ((reg >= CAN_FIFO) && (reg < CAN_FIFO_END)) {
+		SIM_REG(r, offset) = old; // read only
+	} else if (reg >= offsetof(CAN_TypeDef, FMR)) {
+		if (ctl == &ctls[0]) {
+			can_write_filter(offset, val, old);
+		} else {
+			SIM_REG(r, offset) = old; // CAN2 has no filter registers of its own
+		}
+	}
+
+	for (unsigned i=0; i<2; i++) {
+		can_update(&ctls[i]);
+		if (ctls[i].node.bus != NULL) {
+			sim_can_kick(ctls[i].node.bus);
+		}
+	}
+}
+
+static void can_ctl_init(can_ctl_t *ctl, const char *name, CAN_TypeDef *instance, sim_can_bus_t *bus,
+                         IRQn_Type tx, IRQn_Type rx0, IRQn_Type rx1, IRQn_Type sce)
+{
+	ctl->name = name;
+	ctl->offset = (uintptr_t)instance - CAN_PAGE;
+	ctl->bus = bus;
+	ctl->tx_irq = tx;
+	ctl->rx0_irq = rx0;
+	ctl->rx1_irq = rx1;
+	ctl->sce_irq = sce;
+	sim_can_bus_init(&ctl->loop_bus, name, 1000000);
+
+	ctl->node.name = name;
+	ctl->node.pending = can_node_pending;
+	ctl->node.done = can_node_done;
+	ctl->node.received = can_node_received;
+	ctl->node.error = can_node_error;
+	ctl->node.acks = can_node_acks;
+	ctl->node.ctx = ctl;
+	sim_event_add(&ctl->recovery, name, can_on_recovery, ctl);
+	can_reset(ctl);
+}
+
+void sim_can_init(sim_can_bus_t *bus1, sim_can_bus_t *bus2)
+{
+	can_region.base = CAN_PAGE;
+	can_region.size = 0x1000;
+	can_region.prot = PROT_READ;
+	can_region.write = can_on_write;
+	sim_map(&can_region);
+
+	CAN1_REG(FMR) = 0x2A1C0E01;
+	can_ctl_init(&ctls[0], "CAN1", CAN1, bus1, CAN1_TX_IRQn, CAN1_RX0_IRQn, CAN1_RX1_IRQn, CAN1_SCE_IRQn);
+	can_ctl_init(&ctls[1], "CAN2", CAN2, bus2, CAN2_TX_IRQn, CAN2_RX0_IRQn, CAN2_RX1_IRQn, CAN2_SCE_IRQn);
+}
@@ -0,0 +1,262 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#include "sim_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_usb.h"
+
+#define HOST_REQUESTS    16
+#define HOST_REQUEST_MAX 512
+
+#define USB_DIR_IN            0x80
+#define USB_TYPE_VENDOR       0x40
+#define USB_RECIP_INTERFACE   0x01
+#define USB_GET_DESCRIPTOR    6
+#define USB_SET_ADDRESS       5
+#define USB_SET_CONFIGURATION 9
+
+sim_host_stats_t sim_host_stats;
+
+typedef struct {
+	bool used;
+	bool in;
+	uint8_t data[HOST_REQUEST_MAX];
+	sim_host_done_t done;
+	void *ctx;
+} host_request_t;
+
+typedef struct {
+	bool used;
+	void *tx_ctx;
+} host_slot_t;
+
+static sim_host_config_t config;
+static sim_host_ops_t ops;
+static host_request_t requests[HOST_REQUESTS];
+static host_slot_t slots[SIM_HOST_CHANNELS][SIM_HOST_ECHO_SLOTS_MAX];
+static unsigned setup_pending;
+
+static void host_request_done(void *ctx, int status)
+{
+	host_request_t *r = ctx;
+	r->used = false;
+	if (r->done != NULL) {
+		r->done(r->ctx, status, r->data);
+	}
+}
+
+static bool host_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                         const void *data, uint16_t len, sim_host_done_t done, void *ctx)
+{
+	host_request_t *r = NULL;
+
+	for (unsigned i=0; i<HOST_REQUESTS; i++) {
+		if (!requests[i].used) {
+			r = &requests[i];
+			break;
+		}
+	}
+	if ((r == NULL) || (len > HOST_REQUEST_MAX)) {
+		return false;
+	}
+	r->used = true;
+	r->in = (bmRequestType & USB_DIR_IN) != 0;
+	r->done = done;
+	r->ctx = ctx;
+	memset(r->data, 0, sizeof(r->data));
+	if (!r->in && (data != NULL)) {
+		memcpy(r->data, data, len);
+	}
+	if (!sim_usb_control(bmRequestType, bRequest, wValue, wIndex, r->data, len, host_request_done, r)) {
+		r->used = false;
+		return false;
+	}
+	return true;
+}
+
+bool sim_host_request(bool in, uint8_t bRequest, uint16_t wValue, const void *data, uint16_t len,
+                      sim_host_done_t done, void *ctx)
+{
+	uint8_t type = USB_TYPE_VENDOR | USB_RECIP_INTERFACE | (in ? USB_DIR_IN : 0);
+	return host_control(type, bRequest, wValue, 0, data, len, done, ctx);
+}
+
+/* each step of bringing the device up has to succeed */
+static void host_setup_done(void *ctx, int status, const void *data)
+{
+	const char *what = ctx;
+	(void)data;
+
+	if (status == SIM_USB_STALL) {
+		fprintf(stderr, "host: %s was stalled\n", what);
+		exit(1);
+	}
+	if (--setup_pending == 0) {
+		sim_usb_bulk(GSUSB_ENDPOINT_IN, GSUSB_ENDPOINT_OUT, 32);
+		if (ops.ready != NULL) {
+			ops.ready(ops.ctx);
+		}
+	}
+}
+
+static void host_setup(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                       const void *data, uint16_t len, const char *what)
+{
+	if (!host_control(bmRequestType, bRequest, wValue, wIndex, data, len, host_setup_done, (void *)what)) {
+		fprintf(stderr, "host: no room for %s\n", what);
+		exit(1);
+	}
+	setup_pending++;
+}
+
+/* enumeration, then what gs_usb_probe() and gs_can_open() send */
+static void host_on_connect(void *ctx)
+{
+	uint8_t vendor_out = USB_TYPE_VENDOR | USB_RECIP_INTERFACE;
+	uint8_t vendor_in = vendor_out | USB_DIR_IN;
+	struct gs_host_config host_config = { .byte_order = 0x0000beef };
+	(void)ctx;
+
+	sim_usb_reset();
+	host_setup(USB_DIR_IN, USB_GET_DESCRIPTOR, 0x0100, 0, NULL, 18, "GET_DESCRIPTOR(device)");
+	host_setup(0, USB_SET_ADDRESS, 1, 0, NULL, 0, "SET_ADDRESS");
+	host_setup(USB_DIR_IN, USB_GET_DESCRIPTOR, 0x0200, 0, NULL, 255, "GET_DESCRIPTOR(configuration)");
+	host_setup(0, USB_SET_CONFIGURATION, 1, 0, NULL, 0, "SET_CONFIGURATION");
+	host_setup(vendor_out, GS_USB_BREQ_HOST_FORMAT, 1, 0, &host_config, sizeof(host_config), "HOST_FORMAT");
+	host_setup(vendor_in, GS_USB_BREQ_DEVICE_CONFIG, 1, 0, NULL, sizeof(struct gs_device_config), "DEVICE_CONFIG");
+
+	for (unsigned ch=0; ch<config.channels; ch++) {
+		struct gs_device_bitrate bitrate = { .bitrate = config.bitrate, .sample_point = 0 };
+		struct gs_device_mode mode = { .mode = GS_CAN_MODE_START, .flags = config.mode_flags };
+		host_setup(vendor_in, GS_USB_BREQ_BT_CONST, ch, 0, NULL, sizeof(struct gs_device_bt_const), "BT_CONST");
+		host_setup(vendor_out, GS_USB_BREQ_SET_BITRATE, ch, 0, &bitrate, sizeof(bitrate), "SET_BITRATE");
+		host_setup(vendor_out, GS_USB_BREQ_MODE, ch, 0, &mode, sizeof(mode), "MODE");
+	}
+	if (config.in_window_us > 0) {
+		host_setup(vendor_out, GS_USB_BREQ_SET_IN_WINDOW, 0, 0, &config.in_window_us, sizeof(config.in_window_us), "SET_IN_WINDOW");
+	}
+}
+
+static void host_frame(const struct gs_host_frame *frame)
+{
+	sim_host_stats.in_frames++;
+
+	if (frame->echo_id != 0xFFFFFFFF) {
+		if ((frame->channel >= config.channels) || (frame->echo_id >= config.echo_slots)
+		 || !slots[frame->channel][frame->echo_id].used) {
+			sim_host_stats.unknown_echoes++;
+			return;
+		}
+		host_slot_t *s = &slots[frame->channel][frame->echo_id];
+		s->used = false;
+		if (ops.echo != NULL) {
+			ops.echo(ops.ctx, frame, s->tx_ctx);
+		}
+		// a frame that never made it onto the bus is echoed all the same
+		if ((frame->flags & GS_CAN_FLAG_TX_FAILED) && (ops.tx_failed != NULL)) {
+			ops.tx_failed(ops.ctx, frame->channel, s->tx_ctx);
+		}
+		return;
+	}
+
+	if (ops.rx != NULL) {
+		ops.rx(ops.ctx, frame);
+	}
+}
+
+static void host_on_in(void *ctx, const uint8_t *data, unsigned len)
+{
+	size_t frame_len = sizeof(struct gs_host_frame) - ((config.mode_flags & GS_CAN_MODE_HW_TIMESTAMP) ? 0 : 4);
+	size_t stride = (config.mode_flags & GS_CAN_MODE_PAD_PKTS_TO_MAX_PKT_SIZE) ? 32 : frame_len;
+	(void)ctx;
+
+	sim_host_stats.in_transfers++;
+	for (size_t pos=0; pos + frame_len <= len; pos += stride) {
+		struct gs_host_frame frame = { .timestamp_us = 0 };
+		memcpy(&frame, data + pos, frame_len);
+		host_frame(&frame);
+	}
+}
+
+bool sim_host_send(const struct gs_host_frame *frame, unsigned len, void *tx_ctx)
+{
+	struct gs_host_frame out = *frame;
+	host_slot_t *s = NULL;
+	unsigned slot;
+
+	if (frame->channel >= config.channels) {
+		return false;
+	}
+	for (slot=0; slot<config.echo_slots; slot++) {
+		if (!slots[frame->channel][slot].used) {
+			s = &slots[frame->channel][slot];
+			break;
+		}
+	}
+	if (s == NULL) {
+		return false;
+	}
+	out.echo_id = slot;
+	if (!sim_usb_out_submit(&out, len, NULL)) {
+		return false;
+	}
+	s->used = true;
+	s->tx_ctx = tx_ctx;
+	sim_host_stats.out_frames++;
+	return true;
+}
+
+unsigned sim_host_free_slots(unsigned channel)
+{
+	unsigned n = 0;
+	for (unsigned i=0; i<config.echo_slots; i++) {
+		n += slots[channel][i].used ? 0 : 1;
+	}
+	return n;
+}
+
+void sim_host_init(const sim_host_config_t *cfg, const sim_host_ops_t *o)
+{
+	static const sim_usb_host_t usb_host = {
+		.connect = host_on_connect,
+		.in_complete = host_on_in,
+	};
+
+	config = *cfg;
+	if (config.echo_slots > SIM_HOST_ECHO_SLOTS_MAX) {
+		config.echo_slots = SIM_HOST_ECHO_SLOTS_MAX;
+	}
+	if (config.channels > SIM_HOST_CHANNELS) {
+		config.channels = SIM_HOST_CHANNELS;
+	}
+	ops = *o;
+	sim_usb_init(&usb_host);
+}
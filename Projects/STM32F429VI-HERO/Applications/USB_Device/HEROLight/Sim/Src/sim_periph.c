@@ -0,0 +1,416 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "stm32f4xx_hal.h"
+#include "stm32f4xx_hero.h"
+
+#define SYSCLK_HZ   168000000
+#define PCLK1_HZ    42000000
+#define TIM2_CLK_HZ (2 * PCLK1_HZ)
+
+/* registers without side effects, plain memory */
+static sim_region_t plain[] = {
+	{ .base = 0x40001000, .size = 0x00005000, .prot = PROT_READ | PROT_WRITE }, /* TIM3..WWDG */
+	{ .base = 0x40007000, .size = 0x00079000, .prot = PROT_READ | PROT_WRITE }, /* PWR, APB2, AHB1, OTG_HS */
+	{ .base = 0x50000000, .size = 0x00040000, .prot = PROT_READ | PROT_WRITE }, /* OTG_FS */
+	{ .base = 0xE0000000, .size = 0x00001000, .prot = PROT_READ | PROT_WRITE }, /* ITM */
+	{ .base = 0xE000E000, .size = 0x00001000, .prot = PROT_READ | PROT_WRITE }, /* SysTick, NVIC, SCB */
+	{ .base = 0x1FFF7000, .size = 0x00001000, .prot = PROT_READ },              /* OTP, unique ID */
+};
+
+#define SCS_REGION  (&plain[4])
+#define UID_REGION  (&plain[5])
+
+/* ---- TIM2, the microsecond time base ---- */
+
+#define TIM_CR1   0x00
+#define TIM_DIER  0x0C
+#define TIM_SR    0x10
+#define TIM_EGR   0x14
+#define TIM_CNT   0x24
+#define TIM_PSC   0x28
+#define TIM_ARR   0x2C
+#define TIM_CCR1  0x34
+#define TIM_CCR4  0x40
+
+static struct {
+	sim_region_t region;
+	sim_event_t event;
+	bool running;
+	uint64_t base_ns;   /* device time of the last rebase */
+	uint64_t base_cnt;  /* counter at that time */
+	uint64_t last_cnt;  /* counter at the last sync, not wrapped */
+	uint32_t sr;
+} tim;
+
+static uint64_t tim_period(void)
+{
+	return (uint64_t)SIM_REG(&tim.region, TIM_ARR) + 1;
+}
+
+static uint64_t tim_tick_ps(void)
+{
+	return (uint64_t)1000000000000ull * (SIM_REG(&tim.region, TIM_PSC) + 1) / TIM2_CLK_HZ;
+}
+
+static uint64_t tim_count_at(uint64_t t)
+{
+	if (!tim.running || (t < tim.base_ns)) {
+		return tim.base_cnt;
+	}
+	return tim.base_cnt + (t - tim.base_ns) * 1000 / tim_tick_ps();
+}
+
+static uint64_t tim_time_of(uint64_t cnt)
+{
+	return tim.base_ns + ((cnt - tim.base_cnt) * tim_tick_ps() + 999) / 1000;
+}
+
+/* the first count after 'after' at which the counter reads 'value' */
+static uint64_t tim_next_match(uint64_t after, uint64_t value)
+{
+	uint64_t period = tim_period();
+	uint64_t m = after - (after % period) + value;
+	if (m <= after) {
+		m += period;
+	}
+	return m;
+}
+
+static void tim_update_irq(void)
+{
+	SIM_REG(&tim.region, TIM_SR) = tim.sr;
+	sim_irq_level(TIM2_IRQn, (tim.sr & SIM_REG(&tim.region, TIM_DIER) & 0x1F) != 0);
+}
+
+/* catches up with device time: counter value and every flag it set */
+static void tim_sync(void)
+{
+	uint64_t now_cnt = tim_count_at(sim_now());
+	uint64_t period = tim_period();
+
+	if (now_cnt > tim.last_cnt) {
+		if (now_cnt / period != tim.last_cnt / period) {
+			tim.sr |= TIM_SR_UIF;
+		}
+		for (unsigned cc=0; cc<4; cc++) {
+			uint32_t ccr = SIM_REG(&tim.region, TIM_CCR1 + 4*cc);
+			if (tim_next_match(tim.last_cnt, ccr % period) <= now_cnt) {
+				tim.sr |= TIM_SR_CC1IF << cc;
+			}
+		}
+		tim.last_cnt = now_cnt;
+	}
+	SIM_REG(&tim.region, TIM_CNT) = (uint32_t)(now_cnt % period);
+	tim_update_irq();
+}
+
+static void tim_schedule(void)
+{
+	uint32_t dier = SIM_REG(&tim.region, TIM_DIER);
+	uint64_t next = SIM_NEVER;
+
+	if (tim.running) {
+		uint64_t period = tim_period();
+		if (dier & TIM_DIER_UIE) {
+			next = tim_next_match(tim.last_cnt, 0);
+		}
+		for (unsigned cc=0; cc<4; cc++) {
+			if (dier & (TIM_DIER_CC1IE << cc)) {
+				uint64_t m = tim_next_match(tim.last_cnt, SIM_REG(&tim.region, TIM_CCR1 + 4*cc) % period);
+				if (m < next) {
+					next = m;
+				}
+			}
+		}
+	}
+	sim_event_at(&tim.event, (next == SIM_NEVER) ? SIM_NEVER : tim_time_of(next));
+}
+
+static void tim_rebase(uint64_t cnt)
+{
+	tim.base_ns = sim_now();
+	tim.base_cnt = cnt;
+	tim.last_cnt = cnt;
+}
+
+static void tim_on_event(sim_event_t *ev)
+{
+	(void)ev;
+	tim_sync();
+	tim_schedule();
+}
+
+static void tim_on_read(sim_region_t *r, uint32_t offset)
+{
+	(void)r;
+	(void)offset;
+	tim_sync();
+}
+
+static void tim_on_write(sim_region_t *r, uint32_t offset, uint32_t old)
+{
+	uint32_t val = SIM_REG(r, offset);
+
+	SIM_REG(r, offset) = old;
+	tim_sync();
+	SIM_REG(r, offset) = val;
+
+	switch (offset) {
+		case TIM_CR1:
+			if ((val ^ old) & TIM_CR1_CEN) {
+				tim_rebase(tim.last_cnt % tim_period());
+				tim.running = (val & TIM_CR1_CEN) != 0;
+			}
+			break;
+		case TIM_SR:
+			tim.sr &= val; // rc_w0
+			break;
+		case TIM_EGR:
+			if (val & TIM_EGR_UG) {
+				tim_rebase(0);
+				tim.sr |= TIM_SR_UIF;
+			}
+			SIM_REG(r, offset) = 0;
+			break;
+		case TIM_CNT:
+			tim_rebase(val);
+			break;
+		case TIM_PSC:
+		case TIM_ARR:
+			SIM_REG(r, offset) = old;
+			tim_rebase(tim.last_cnt % tim_period());
+			SIM_REG(r, offset) = val;
+			break;
+		default:
+			break;
+	}
+	tim_sync();
+	tim_schedule();
+}
+
+/* the device time at which TIM2 last read timer_us, for timestamps in frames */
+uint64_t sim_timer_to_ns(uint32_t timer_us)
+{
+	uint64_t period = tim_period();
+	uint64_t cnt = tim_count_at(sim_now());
+	uint64_t back = ((cnt % period) + period - timer_us) % period;
+
+	if (back > cnt - tim.base_cnt) {
+		return tim.base_ns; // from before the last rebase
+	}
+	return tim_time_of(cnt - back);
+}
+
+/* what timer_get() reads now */
+uint32_t sim_timer_now(void)
+{
+	return tim_count_at(sim_now()) % tim_period();
+}
+
+/* ---- DWT cycle counter ---- */
+
+#define DWT_CYCCNT 0x04
+
+static struct {
+	sim_region_t region;
+	uint32_t base;
+	uint64_t base_cpu_ns;
+} dwt;
+
+static void dwt_on_read(sim_region_t *r, uint32_t offset)
+{
+	if (offset == DWT_CYCCNT) {
+		SIM_REG(r, offset) = dwt.base + (uint32_t)((sim_cpu_ns() - dwt.base_cpu_ns) * (SYSCLK_HZ / 1000000) / 1000);
+	}
+}
+
+static void dwt_on_write(sim_region_t *r, uint32_t offset, uint32_t old)
+{
+	(void)old;
+	if (offset == DWT_CYCCNT) {
+		dwt.base = SIM_REG(r, offset);
+		dwt.base_cpu_ns = sim_cpu_ns();
+	}
+}
+
+/* ---- SysTick ---- */
+
+static sim_event_t systick;
+static bool systick_running;
+
+static void systick_on_event(sim_event_t *ev)
+{
+	SysTick->CTRL |= SysTick_CTRL_COUNTFLAG_Msk;
+	sim_irq_pend(SysTick_IRQn);
+	sim_event_at(ev, sim_now() + 1000000);
+}
+
+/* ---- HAL ---- */
+
+static volatile uint32_t uwTick;
+
+HAL_StatusTypeDef HAL_Init(void)
+{
+	HAL_NVIC_SetPriorityGrouping(NVIC_PRIORITYGROUP_4);
+	return HAL_InitTick(TICK_INT_PRIORITY);
+}
+
+HAL_StatusTypeDef HAL_InitTick(uint32_t TickPriority)
+{
+	HAL_NVIC_SetPriority(SysTick_IRQn, TickPriority, 0);
+	if (!systick_running) {
+		systick_running = true;
+		sim_event_at(&systick, sim_now() + 1000000);
+	}
+	return HAL_OK;
+}
+
+void HAL_IncTick(void)
+{
+	uwTick++;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	return uwTick;
+}
+
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct)
+{
+	(void)RCC_OscInitStruct;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency)
+{
+	(void)RCC_ClkInitStruct;
+	(void)FLatency;
+	return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetHCLKFreq(void)
+{
+	return SYSCLK_HZ;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+	return PCLK1_HZ;
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+	(void)GPIOx;
+	(void)GPIO_Init;
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+	if (PinState == GPIO_PIN_SET) {
+		GPIOx->ODR |= GPIO_Pin;
+	} else {
+		GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+	}
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	GPIOx->ODR ^= GPIO_Pin;
+}
+
+void BSP_LED_Init(Led_TypeDef Led)
+{
+	(void)Led;
+}
+
+void BSP_LED_On(Led_TypeDef Led)
+{
+	(void)Led;
+}
+
+void BSP_LED_Off(Led_TypeDef Led)
+{
+	(void)Led;
+}
+
+void BSP_LED_Toggle(Led_TypeDef Led)
+{
+	(void)Led;
+}
+
+/* ---- setup ---- */
+
+void sim_periph_init(void)
+{
+	for (unsigned i=0; i<sizeof(plain)/sizeof(plain[0]); i++) {
+		sim_map(&plain[i]);
+	}
+	SIM_REG(UID_REGION, 0xA10) = 0x00470028;
+	SIM_REG(UID_REGION, 0xA14) = 0x30365111;
+	SIM_REG(UID_REGION, 0xA18) = 0x33383437;
+	(void)SCS_REGION;
+
+	tim.region.base = TIM2_BASE;
+	tim.region.size = 0x1000;
+	tim.region.write = tim_on_write;
+	tim.region.read = tim_on_read;
+	sim_map(&tim.region); // protected once the time mode is known, see sim_periph_time_mode()
+	SIM_REG(&tim.region, TIM_ARR) = 0xFFFFFFFF;
+	sim_event_add(&tim.event, "TIM2", tim_on_event, NULL);
+
+	dwt.region.base = DWT_BASE;
+	dwt.region.size = 0x1000;
+	dwt.region.prot = PROT_NONE;
+	dwt.region.read = dwt_on_read;
+	dwt.region.write = dwt_on_write;
+	sim_map(&dwt.region);
+
+	sim_event_add(&systick, "SysTick", systick_on_event, NULL);
+}
+
+/* Without firmware run time, device time only moves while it sleeps, so
+ * TIM2 can be kept up to date there and reads need not trap. */
+void sim_periph_time_mode(sim_time_mode_t mode)
+{
+	sim_protect(&tim.region, (mode == SIM_TIME_VIRTUAL) ? PROT_READ : PROT_NONE);
+}
+
+void sim_periph_time_changed(void)
+{
+	tim_sync();
+}
@@ -0,0 +1,718 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+#include "sim_usb.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stm32f4xx_hal.h"
+
+#define USB_EP0_MPS      64
+#define USB_SOF_NS       1000000
+#define USB_SOF_BITS     40
+#define USB_SETUP_BITS   169
+#define USB_CAUSES       64
+#define USB_CONTROLS     16
+#define USB_OUT_QUEUE    256
+#define USB_OUT_MAX      64
+#define USB_IN_URB       1024
+
+sim_usb_stats_t sim_usb_stats;
+
+/* ---- device side: what the PCD interrupt reports ---- */
+
+typedef enum {
+	CAUSE_RESET,
+	CAUSE_SETUP,
+	CAUSE_DATA_OUT,
+	CAUSE_DATA_IN,
+	CAUSE_SOF  /* a flag like GINTSTS.SOF, not queued */
+} usb_cause_type_t;
+
+typedef struct {
+	uint8_t type;
+	uint8_t ep;
+} usb_cause_t;
+
+static PCD_HandleTypeDef *pcd;
+static IRQn_Type pcd_irq;
+static usb_cause_t causes[USB_CAUSES];
+static unsigned cause_head, cause_count;
+static bool sof_pending;
+static uint8_t setup_latched[8];
+static bool in_armed[16];
+static bool out_armed[16];
+static bool pulled_up;
+
+static void usb_kick(void);
+
+/* SOFs the firmware did not get to yet coalesce, as in the core. The other
+ * causes each need the firmware to arm the endpoint again before they can
+ * repeat, so they are bounded; losing one would stall the endpoint. */
+static void usb_cause(usb_cause_type_t type, uint8_t ep)
+{
+	if (type == CAUSE_SOF) {
+		sof_pending = true;
+	} else if (cause_count == USB_CAUSES) {
+		fprintf(stderr, "sim: more than %u USB interrupt causes pending\n", USB_CAUSES);
+		exit(2);
+	} else {
+		causes[(cause_head + cause_count++) % USB_CAUSES] = (usb_cause_t){ type, ep };
+	}
+	sim_irq_level(pcd_irq, true);
+}
+
+static PCD_EPTypeDef *usb_ep(uint8_t ep_addr)
+{
+	return (ep_addr & 0x80) ? &pcd->IN_ep[ep_addr & 0x0F] : &pcd->OUT_ep[ep_addr & 0x0F];
+}
+
+HAL_StatusTypeDef HAL_PCD_Init(PCD_HandleTypeDef *hpcd)
+{
+	pcd = hpcd;
+	pcd_irq = (hpcd->Instance == USB_OTG_HS) ? OTG_HS_IRQn : OTG_FS_IRQn;
+	for (unsigned i=0; i<16; i++) {
+		hpcd->IN_ep[i].num = i;
+		hpcd->IN_ep[i].is_in = 1;
+		hpcd->OUT_ep[i].num = i;
+		hpcd->OUT_ep[i].is_in = 0;
+	}
+	hpcd->State = HAL_PCD_STATE_READY;
+	HAL_PCD_MspInit(hpcd);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_DeInit(PCD_HandleTypeDef *hpcd)
+{
+	HAL_PCD_Stop(hpcd);
+	HAL_PCD_MspDeInit(hpcd);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCDEx_SetRxFiFo(PCD_HandleTypeDef *hpcd, uint16_t size)
+{
+	(void)hpcd;
+	(void)size;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCDEx_SetTxFiFo(PCD_HandleTypeDef *hpcd, uint8_t fifo, uint16_t size)
+{
+	(void)hpcd;
+	(void)fifo;
+	(void)size;
+	return HAL_OK;
+}
+
+static sim_usb_host_t host;
+static sim_event_t connect_event;
+
+HAL_StatusTypeDef HAL_PCD_Start(PCD_HandleTypeDef *hpcd)
+{
+	(void)hpcd;
+	if (!pulled_up) {
+		pulled_up = true;
+		sim_event_at(&connect_event, sim_now() + 1000000); // host port debounce, shortened
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_Stop(PCD_HandleTypeDef *hpcd)
+{
+	(void)hpcd;
+	pulled_up = false;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_SetAddress(PCD_HandleTypeDef *hpcd, uint8_t address)
+{
+	(void)hpcd;
+	(void)address; // the host model talks to one device only
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type)
+{
+	PCD_EPTypeDef *ep = usb_ep(ep_addr);
+	(void)hpcd;
+	ep->maxpacket = ep_mps;
+	ep->type = ep_type;
+	ep->is_stall = 0;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+	(void)hpcd;
+	if (ep_addr & 0x80) {
+		in_armed[ep_addr & 0x0F] = false;
+	} else {
+		out_armed[ep_addr & 0x0F] = false;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Flush(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+	return HAL_PCD_EP_Close(hpcd, ep_addr);
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pBuf, uint32_t len)
+{
+	PCD_EPTypeDef *ep = usb_ep(ep_addr & 0x0F);
+	(void)hpcd;
+	ep->xfer_buff = pBuf;
+	ep->xfer_len = len;
+	ep->xfer_count = 0;
+	out_armed[ep_addr & 0x0F] = true;
+	usb_kick();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Transmit(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pBuf, uint32_t len)
+{
+	PCD_EPTypeDef *ep = usb_ep(ep_addr | 0x80);
+	(void)hpcd;
+	ep->xfer_buff = pBuf;
+	ep->xfer_len = len;
+	ep->xfer_count = 0;
+	in_armed[ep_addr & 0x0F] = true;
+	usb_kick();
+	return HAL_OK;
+}
+
+uint16_t HAL_PCD_EP_GetRxCount(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+	return hpcd->OUT_ep[ep_addr & 0x0F].xfer_count;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_SetStall(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+	(void)hpcd;
+	usb_ep(ep_addr)->is_stall = 1;
+	usb_kick();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_ClrStall(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+	(void)hpcd;
+	usb_ep(ep_addr)->is_stall = 0;
+	return HAL_OK;
+}
+
+void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
+{
+	while (cause_count > 0) {
+		usb_cause_t c = causes[cause_head];
+		cause_head = (cause_head + 1) % USB_CAUSES;
+		cause_count--;
+
+		switch (c.type) {
+			case CAUSE_RESET:
+				for (unsigned i=0; i<16; i++) {
+					hpcd->IN_ep[i].is_stall = 0;
+					hpcd->OUT_ep[i].is_stall = 0;
+				}
+				HAL_PCD_ResetCallback(hpcd);
+				break;
+			case CAUSE_SETUP:
+				memcpy(hpcd->Setup, setup_latched, sizeof(setup_latched));
+				HAL_PCD_SetupStageCallback(hpcd);
+				break;
+			case CAUSE_DATA_OUT:
+				HAL_PCD_DataOutStageCallback(hpcd, c.ep);
+				break;
+			case CAUSE_DATA_IN:
+				HAL_PCD_DataInStageCallback(hpcd, c.ep);
+				break;
+			case CAUSE_SOF:
+				break;
+		}
+	}
+	if (sof_pending) {
+		sof_pending = false;
+		HAL_PCD_SOFCallback(hpcd); // after the endpoints, like HAL_PCD_IRQHandler()
+	}
+	sim_irq_level(pcd_irq, false);
+}
+
+/* ---- host side ---- */
+
+typedef enum {
+	CTRL_SETUP,
+	CTRL_DATA_IN,
+	CTRL_DATA_OUT,
+	CTRL_STATUS_IN,
+	CTRL_STATUS_OUT
+} usb_ctrl_phase_t;
+
+typedef struct {
+	uint8_t setup[8];
+	uint8_t *data;
+	uint16_t length;
+	uint16_t done;
+	usb_ctrl_phase_t phase;
+	sim_usb_control_done_t cb;
+	void *ctx;
+} usb_control_t;
+
+typedef struct {
+	uint8_t data[USB_OUT_MAX];
+	uint16_t len;
+	uint16_t sent;
+	void *urb;
+} usb_out_t;
+
+typedef enum {
+	XACT_CONTROL,
+	XACT_BULK_IN,
+	XACT_BULK_OUT
+} usb_xact_t;
+
+static usb_control_t controls[USB_CONTROLS];
+static unsigned control_head, control_count;
+static usb_out_t outs[USB_OUT_QUEUE];
+static unsigned out_head, out_count;
+static uint8_t in_urb[USB_IN_URB];
+static unsigned in_urb_len;
+static uint8_t bulk_in_ep, bulk_out_ep;
+static uint16_t bulk_mps;
+static bool rr_out;
+
+static sim_event_t bus_event;
+static sim_event_t sof_event;
+static bool bus_busy;
+static usb_xact_t xact;
+static uint64_t xact_start;
+static uint32_t frame_number;
+
+static uint64_t usb_bits_ns(unsigned bits)
+{
+	return (uint64_t)bits * 250 / 3; // 12 Mbit/s
+}
+
+/* token, data and handshake packet with turnaround gaps */
+static unsigned usb_xact_bits(unsigned len)
+{
+	return 105 + 8*len;
+}
+
+static void usb_kick(void)
+{
+	if (!bus_busy && (bus_event.at == SIM_NEVER)) {
+		sim_event_at(&bus_event, sim_now());
+	}
+}
+
+static bool usb_control_ready(usb_control_t *c)
+{
+	switch (c->phase) {
+		case CTRL_SETUP:
+			return true;
+		case CTRL_DATA_IN:
+		case CTRL_STATUS_IN:
+			return pcd->IN_ep[0].is_stall || in_armed[0];
+		default:
+			return pcd->OUT_ep[0].is_stall || out_armed[0];
+	}
+}
+
+static unsigned usb_control_bits(usb_control_t *c)
+{
+	unsigned rem = c->length - c->done;
+	switch (c->phase) {
+		case CTRL_SETUP:
+			return USB_SETUP_BITS;
+		case CTRL_DATA_IN:
+			return usb_xact_bits((pcd->IN_ep[0].xfer_len - pcd->IN_ep[0].xfer_count > USB_EP0_MPS) ? USB_EP0_MPS : pcd->IN_ep[0].xfer_len - pcd->IN_ep[0].xfer_count);
+		case CTRL_DATA_OUT:
+			return usb_xact_bits((rem > USB_EP0_MPS) ? USB_EP0_MPS : rem);
+		default:
+			return usb_xact_bits(0);
+	}
+}
+
+static void usb_control_finish(int status)
+{
+	usb_control_t c = controls[control_head];
+	control_head = (control_head + 1) % USB_CONTROLS;
+	control_count--;
+	if (c.cb != NULL) {
+		c.cb(c.ctx, status);
+	}
+}
+
+static void usb_control_step(void)
+{
+	usb_control_t *c = &controls[control_head];
+	PCD_EPTypeDef *in = &pcd->IN_ep[0];
+	PCD_EPTypeDef *out = &pcd->OUT_ep[0];
+	unsigned n;
+
+	switch (c->phase) {
+		case CTRL_SETUP:
+			memcpy(setup_latched, c->setup, sizeof(setup_latched));
+			in->is_stall = 0; // a SETUP clears a protocol stall
+			out->is_stall = 0;
+			in_armed[0] = false;
+			out_armed[0] = false;
+			usb_cause(CAUSE_SETUP, 0);
+			if (c->length == 0) {
+				c->phase = CTRL_STATUS_IN;
+			} else {
+				c->phase = (c->setup[0] & 0x80) ? CTRL_DATA_IN : CTRL_DATA_OUT;
+			}
+			break;
+
+		case CTRL_DATA_IN:
+			if (in->is_stall) {
+				usb_control_finish(SIM_USB_STALL);
+				return;
+			}
+			if (!in_armed[0]) {
+				sim_usb_stats.naks++;
+				return;
+			}
+			n = in->xfer_len - in->xfer_count;
+			n = (n > USB_EP0_MPS) ? USB_EP0_MPS : n;
+			memcpy(c->data + c->done, in->xfer_buff, (n < (unsigned)(c->length - c->done)) ? n : (unsigned)(c->length - c->done));
+			c->done = (c->done + n > c->length) ? c->length : c->done + n;
+			in->xfer_buff += n;
+			in->xfer_count += n;
+			in_armed[0] = false;
+			usb_cause(CAUSE_DATA_IN, 0);
+			if ((n < USB_EP0_MPS) || (c->done >= c->length)) {
+				c->phase = CTRL_STATUS_OUT;
+			}
+			break;
+
+		case CTRL_DATA_OUT:
+			if (out->is_stall) {
+				usb_control_finish(SIM_USB_STALL);
+				return;
+			}
+			if (!out_armed[0]) {
+				sim_usb_stats.naks++;
+				return;
+			}
+			n = c->length - c->done;
+			n = (n > USB_EP0_MPS) ? USB_EP0_MPS : n;
+			memcpy(out->xfer_buff, c->data + c->done, (n < out->xfer_len) ? n : out->xfer_len);
+			out->xfer_buff += n;
+			out->xfer_count = n;
+			out_armed[0] = false;
+			usb_cause(CAUSE_DATA_OUT, 0);
+			c->done += n;
+			if (c->done == c->length) {
+				c->phase = CTRL_STATUS_IN;
+			}
+			break;
+
+		case CTRL_STATUS_IN:
+			if (in->is_stall) {
+				usb_control_finish(SIM_USB_STALL);
+				return;
+			}
+			if (!in_armed[0]) {
+				sim_usb_stats.naks++;
+				return;
+			}
+			in_armed[0] = false;
+			usb_cause(CAUSE_DATA_IN, 0);
+			usb_control_finish(c->done);
+			break;
+
+		case CTRL_STATUS_OUT:
+			if (out->is_stall) {
+				usb_control_finish(SIM_USB_STALL);
+				return;
+			}
+			if (!out_armed[0]) {
+				sim_usb_stats.naks++;
+				return;
+			}
+			out->xfer_count = 0;
+			out_armed[0] = false;
+			usb_cause(CAUSE_DATA_OUT, 0);
+			usb_control_finish(c->done);
+			break;
+	}
+}
+
+static bool usb_in_ready(void)
+{
+	return (bulk_mps != 0) && in_armed[bulk_in_ep & 0x0F] && !pcd->IN_ep[bulk_in_ep & 0x0F].is_stall;
+}
+
+static bool usb_out_ready(void)
+{
+	return (bulk_mps != 0) && (out_count > 0) && out_armed[bulk_out_ep] && !pcd->OUT_ep[bulk_out_ep].is_stall;
+}
+
+static unsigned usb_in_packet(void)
+{
+	PCD_EPTypeDef *ep = &pcd->IN_ep[bulk_in_ep & 0x0F];
+	unsigned n = ep->xfer_len - ep->xfer_count;
+	return (n > bulk_mps) ? bulk_mps : n;
+}
+
+static unsigned usb_out_packet(void)
+{
+	usb_out_t *o = &outs[out_head];
+	unsigned n = o->len - o->sent;
+	return (n > bulk_mps) ? bulk_mps : n;
+}
+
+static void usb_bulk_in(void)
+{
+	PCD_EPTypeDef *ep = &pcd->IN_ep[bulk_in_ep & 0x0F];
+	unsigned n;
+
+	if (!usb_in_ready()) {
+		sim_usb_stats.naks++;
+		return;
+	}
+	n = usb_in_packet();
+	if (in_urb_len + n > USB_IN_URB) {
+		fprintf(stderr, "sim: bulk IN babble\n");
+		n = USB_IN_URB - in_urb_len;
+	}
+	memcpy(in_urb + in_urb_len, ep->xfer_buff, n);
+	in_urb_len += n;
+	ep->xfer_buff += n;
+	ep->xfer_count += n;
+	sim_usb_stats.in_bytes += n;
+
+	if ((n < bulk_mps) || (ep->xfer_count >= ep->xfer_len)) {
+		in_armed[bulk_in_ep & 0x0F] = false;
+		usb_cause(CAUSE_DATA_IN, bulk_in_ep & 0x0F);
+	}
+	if ((n < bulk_mps) || (in_urb_len == USB_IN_URB)) {
+		unsigned len = in_urb_len;
+		in_urb_len = 0;
+		host.in_complete(host.ctx, in_urb, len);
+	}
+}
+
+static void usb_bulk_out(void)
+{
+	PCD_EPTypeDef *ep = &pcd->OUT_ep[bulk_out_ep];
+	usb_out_t *o = &outs[out_head];
+	unsigned n, room;
+
+	if (!usb_out_ready()) {
+		sim_usb_stats.naks++;
+		return;
+	}
+	n = usb_out_packet();
+	room = ep->xfer_len - ep->xfer_count;
+	memcpy(ep->xfer_buff, o->data + o->sent, (n < room) ? n : room);
+	ep->xfer_buff += (n < room) ? n : room;
+	ep->xfer_count += (n < room) ? n : room;
+	o->sent += n;
+	sim_usb_stats.out_bytes += n;
+
+	if ((n < bulk_mps) || (ep->xfer_count >= ep->xfer_len)) {
+		out_armed[bulk_out_ep] = false;
+		usb_cause(CAUSE_DATA_OUT, bulk_out_ep);
+	}
+	if (o->sent >= o->len) {
+		void *urb = o->urb;
+		out_head = (out_head + 1) % USB_OUT_QUEUE;
+		out_count--;
+		if (host.out_complete != NULL) {
+			host.out_complete(host.ctx, urb);
+		}
+	}
+}
+
+/* picks the next transaction: control transfers first, then the bulk
+ * endpoints take turns. NAKed polls are left out, the host retries as
+ * soon as the device arms the endpoint. */
+static bool usb_pick(usb_xact_t *next, unsigned *bits)
+{
+	if ((control_count > 0) && usb_control_ready(&controls[control_head])) {
+		*next = XACT_CONTROL;
+		*bits = usb_control_bits(&controls[control_head]);
+		return true;
+	}
+	bool in = usb_in_ready(), out = usb_out_ready();
+	if (in && (!out || !rr_out)) {
+		*next = XACT_BULK_IN;
+		*bits = usb_xact_bits(usb_in_packet());
+		return true;
+	}
+	if (out) {
+		*next = XACT_BULK_OUT;
+		*bits = usb_xact_bits(usb_out_packet());
+		return true;
+	}
+	return false;
+}
+
+static void usb_on_bus(sim_event_t *ev)
+{
+	uint64_t now = sim_now();
+	unsigned bits;
+
+	if (bus_busy) {
+		bus_busy = false;
+		sim_usb_stats.transactions++;
+		sim_usb_stats.busy_ns += now - xact_start;
+		switch (xact) {
+			case XACT_CONTROL:
+				if (control_count > 0) {
+					usb_control_step();
+				}
+				break;
+			case XACT_BULK_IN:
+				rr_out = true;
+				usb_bulk_in();
+				break;
+			case XACT_BULK_OUT:
+				rr_out = false;
+				usb_bulk_out();
+				break;
+		}
+	}
+
+	if (!pulled_up || !usb_pick(&xact, &bits)) {
+		return;
+	}
+	if ((sof_event.at != SIM_NEVER) && (now + usb_bits_ns(bits) > sof_event.at)) {
+		return; // no transaction crosses a frame boundary, the SOF picks up
+	}
+	bus_busy = true;
+	xact_start = now;
+	sim_event_at(ev, now + usb_bits_ns(bits));
+}
+
+static void usb_on_sof(sim_event_t *ev)
+{
+	USB_OTG_DeviceTypeDef *dev = (USB_OTG_DeviceTypeDef *)((uintptr_t)pcd->Instance + USB_OTG_DEVICE_BASE);
+
+	frame_number = (frame_number + 1) & 0x7FF;
+	dev->DSTS = (dev->DSTS & ~USB_OTG_DSTS_FNSOF) | (frame_number << USB_OTG_DSTS_FNSOF_Pos);
+	sim_usb_stats.sofs++;
+	if (pcd->Init.Sof_enable) {
+		usb_cause(CAUSE_SOF, 0);
+	}
+	sim_event_at(ev, sim_now() + USB_SOF_NS);
+	if (!bus_busy) {
+		sim_event_at(&bus_event, sim_now() + usb_bits_ns(USB_SOF_BITS));
+	}
+}
+
+static void usb_on_connect(sim_event_t *ev)
+{
+	(void)ev;
+	if (pulled_up && (host.connect != NULL)) {
+		host.connect(host.ctx);
+	}
+}
+
+void sim_usb_init(const sim_usb_host_t *h)
+{
+	host = *h;
+	sim_event_add(&bus_event, "USB", usb_on_bus, NULL);
+	sim_event_add(&sof_event, "SOF", usb_on_sof, NULL);
+	sim_event_add(&connect_event, "USB connect", usb_on_connect, NULL);
+}
+
+/* bus reset: the device starts over, SOFs begin */
+void sim_usb_reset(void)
+{
+	memset(in_armed, 0, sizeof(in_armed));
+	memset(out_armed, 0, sizeof(out_armed));
+	control_count = 0;
+	out_count = 0;
+	in_urb_len = 0;
+	bulk_mps = 0;
+	usb_cause(CAUSE_RESET, 0);
+	if (sof_event.at == SIM_NEVER) {
+		sim_event_at(&sof_event, sim_now() + USB_SOF_NS);
+	}
+}
+
+bool sim_usb_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+                     void *data, uint16_t wLength, sim_usb_control_done_t done, void *ctx)
+{
+	usb_control_t *c;
+
+	if (control_count == USB_CONTROLS) {
+		return false;
+	}
+	c = &controls[(control_head + control_count++) % USB_CONTROLS];
+	c->setup[0] = bmRequestType;
+	c->setup[1] = bRequest;
+	c->setup[2] = wValue & 0xFF;
+	c->setup[3] = wValue >> 8;
+	c->setup[4] = wIndex & 0xFF;
+	c->setup[5] = wIndex >> 8;
+	c->setup[6] = wLength & 0xFF;
+	c->setup[7] = wLength >> 8;
+	c->data = data;
+	c->length = wLength;
+	c->done = 0;
+	c->phase = CTRL_SETUP;
+	c->cb = done;
+	c->ctx = ctx;
+	usb_kick();
+	return true;
+}
+
+void sim_usb_bulk(uint8_t in_ep, uint8_t out_ep, uint16_t mps)
+{
+	bulk_in_ep = in_ep;
+	bulk_out_ep = out_ep & 0x0F;
+	bulk_mps = mps;
+	usb_kick();
+}
+
+bool sim_usb_out_submit(const void *data, unsigned len, void *urb)
+{
+	usb_out_t *o;
+
+	if ((out_count == USB_OUT_QUEUE) || (len > USB_OUT_MAX)) {
+		return false;
+	}
+	o = &outs[(out_head + out_count++) % USB_OUT_QUEUE];
+	memcpy(o->data, data, len);
+	o->len = len;
+	o->sent = 0;
+	o->urb = urb;
+	usb_kick();
+	return true;
+}
+
+unsigned sim_usb_out_queued(void)
+{
+	return out_count;
+}
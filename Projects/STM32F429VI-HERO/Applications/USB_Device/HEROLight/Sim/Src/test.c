@@ -0,0 +1,948 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+
+
+/* Checks of the firmware against the simulation. Each case sets up the
+ * models, runs the firmware and ends the process with its result; the
+ * firmware keeps its state in globals, so without arguments every case
+ * runs in a child process of its own. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+#include "sim_can.h"
+#include "sim_usb.h"
+#include "sim_host.h"
+#include "queue.h"
+#include "can.h"
+
+#define BITRATE      1000000
+#define MONITOR_MAX  256
+#define SLACK_NS     20000 /* release to start of frame, virtual time leaves the interrupt path free */
+
+typedef struct {
+	uint32_t can_id;
+	uint32_t seq;
+	uint64_t start_ns;
+	uint64_t end_ns;
+} monitor_entry_t;
+
+typedef struct {
+	sim_can_node_t node;
+	monitor_entry_t frames[MONITOR_MAX];
+	unsigned count;
+} monitor_t;
+
+static sim_can_bus_t buses[2];
+static monitor_t monitor;
+static sim_event_t check_event;
+static unsigned failures;
+static unsigned echo_slots = SIM_HOST_ECHO_SLOTS; /* of the host model, per channel */
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	printf("  FAIL ");
+	vprintf(fmt, ap);
+	printf("\n");
+	va_end(ap);
+	failures++;
+}
+
+static void finish(void)
+{
+	fflush(stdout);
+	exit((failures > 0) ? 1 : 0);
+}
+
+static uint32_t seq_get(const uint8_t *data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void seq_put(uint8_t *data, uint32_t seq)
+{
+	data[0] = seq;
+	data[1] = seq >> 8;
+	data[2] = seq >> 16;
+	data[3] = seq >> 24;
+}
+
+/* ---- a node that acknowledges and records every frame on bus 0 ---- */
+
+static bool monitor_pending(sim_can_node_t *n, sim_can_msg_t *msg)
+{
+	(void)n;
+	(void)msg;
+	return false;
+}
+
+static void monitor_done(sim_can_node_t *n, sim_can_result_t result)
+{
+	(void)n;
+	(void)result;
+}
+
+static void monitor_received(sim_can_node_t *n, const sim_can_msg_t *msg)
+{
+	monitor_t *m = n->ctx;
+
+	if (m->count < MONITOR_MAX) {
+		monitor_entry_t *e = &m->frames[m->count++];
+		e->can_id = msg->can_id;
+		e->seq = (msg->dlc >= 4) ? seq_get(msg->data) : 0;
+		e->start_ns = n->bus->frame_start;
+		e->end_ns = sim_now();
+	}
+}
+
+static void monitor_error(sim_can_node_t *n, bool transmitter, unsigned lec)
+{
+	(void)n;
+	(void)transmitter;
+	(void)lec;
+}
+
+static bool monitor_acks(sim_can_node_t *n, sim_can_node_t *tx)
+{
+	return n != tx;
+}
+
+/* ---- common set-up ---- */
+
+static int run_firmware(unsigned channels, uint32_t mode_flags, const sim_host_ops_t *ops, void (*check)(sim_event_t *ev))
+{
+	sim_init(SIM_TIME_VIRTUAL, 0);
+	sim_can_bus_init(&buses[0], "can0", BITRATE);
+	sim_can_bus_init(&buses[1], "can1", BITRATE);
+	sim_can_init(&buses[0], &buses[1]);
+
+	monitor.node.name = "monitor";
+	monitor.node.pending = monitor_pending;
+	monitor.node.done = monitor_done;
+	monitor.node.received = monitor_received;
+	monitor.node.error = monitor_error;
+	monitor.node.acks = monitor_acks;
+	monitor.node.ctx = &monitor;
+	sim_can_attach(&buses[0], &monitor.node);
+	if (check != NULL) {
+		sim_event_add(&check_event, "check", check, NULL);
+	}
+
+	sim_host_config_t cfg = {
+		.channels = channels,
+		.bitrate = BITRATE,
+		.mode_flags = mode_flags,
+		.echo_slots = echo_slots,
+	};
+	sim_host_init(&cfg, ops);
+	return firmware_main();
+}
+
+/* ---- tx_at: GS_CAN_FLAG_TX_AT release order and accuracy ---- */
+
+#define TX_AT_FRAMES   10
+#define TX_AT_START_US 2000
+
+/* release times after the start in the order the host sends the frames:
+ * out of order, equal ones, and ones closer together than a frame lasts */
+static const uint32_t tx_at_plan_us[TX_AT_FRAMES] = { 3000, 1000, 1000, 5000, 2000, 1000, 4000, 4000, 4050, 4000 };
+static uint32_t tx_at_base_us;
+static unsigned tx_at_echoes;
+
+static void tx_at_on_ready(void *ctx)
+{
+	(void)ctx;
+
+	tx_at_base_us = sim_timer_now() + TX_AT_START_US;
+	for (unsigned i=0; i<TX_AT_FRAMES; i++) {
+		struct gs_host_frame frame;
+		memset(&frame, 0, sizeof(frame));
+		frame.can_id = 0x123; // one ID, the TX queue keeps frames of equal priority in order
+		frame.can_dlc = 8;
+		frame.flags = GS_CAN_FLAG_TX_AT;
+		frame.timestamp_us = tx_at_base_us + tx_at_plan_us[i];
+		seq_put(frame.data, i);
+		if (!sim_host_send(&frame, sizeof(frame), NULL)) {
+			fail("frame %u not accepted by the host model", i);
+		}
+	}
+	sim_event_at(&check_event, sim_now() + 10000000);
+}
+
+static void tx_at_on_echo(void *ctx, const struct gs_host_frame *frame, void *tx_ctx)
+{
+	(void)ctx;
+	(void)frame;
+	(void)tx_ctx;
+	tx_at_echoes++;
+}
+
+static void tx_at_check(sim_event_t *ev)
+{
+	unsigned expected[TX_AT_FRAMES];
+	uint64_t bus_free_ns = 0;
+	(void)ev;
+
+	// a stable sort of the plan is the release order
+	for (unsigned i=0; i<TX_AT_FRAMES; i++) {
+		unsigned pos = i;
+		while ((pos > 0) && (tx_at_plan_us[expected[pos-1]] > tx_at_plan_us[i])) {
+			expected[pos] = expected[pos-1];
+			pos--;
+		}
+		expected[pos] = i;
+	}
+
+	if (monitor.count != TX_AT_FRAMES) {
+		fail("%u frames on the bus, expected %u", monitor.count, TX_AT_FRAMES);
+	}
+	if (tx_at_echoes != TX_AT_FRAMES) {
+		fail("%u echoes, expected %u", tx_at_echoes, TX_AT_FRAMES);
+	}
+	for (unsigned i=0; (i<monitor.count) && (i<TX_AT_FRAMES); i++) {
+		monitor_entry_t *e = &monitor.frames[i];
+		uint64_t release_ns = sim_timer_to_ns(tx_at_base_us + tx_at_plan_us[e->seq % TX_AT_FRAMES]);
+		uint64_t earliest_ns = (release_ns > bus_free_ns) ? release_ns : bus_free_ns;
+
+		printf("  frame %u: release %+6lld us, start %6lld ns after the bus allowed it\n", e->seq,
+		       (long long)(release_ns - sim_timer_to_ns(tx_at_base_us)) / 1000, (long long)(e->start_ns - earliest_ns));
+		if (e->seq != expected[i]) {
+			fail("frame %u sent as number %u, expected frame %u", e->seq, i, expected[i]);
+		}
+		if (e->start_ns < release_ns) {
+			fail("frame %u started %llu ns before its release time", e->seq, (unsigned long long)(release_ns - e->start_ns));
+		}
+		if (e->start_ns > earliest_ns + SLACK_NS) {
+			fail("frame %u started %llu ns late", e->seq, (unsigned long long)(e->start_ns - earliest_ns));
+		}
+		bus_free_ns = e->end_ns;
+	}
+	finish();
+}
+
+static int test_tx_at(void)
+{
+	sim_host_ops_t ops = {
+		.ready = tx_at_on_ready,
+		.echo = tx_at_on_echo,
+	};
+	return run_firmware(1, GS_CAN_MODE_HW_TIMESTAMP, &ops, tx_at_check);
+}
+
+/* ---- tx_at_block: a full TX queue holds up its own channel only ---- */
+
+/* Nothing acknowledges on bus 1, so channel 1 retries its first frame for
+ * ever and the rest fill its TX queue. A GS_CAN_FLAG_TX_AT frame for it falls
+ * due first, then two for channel 0 that must still go out on time. The
+ * channel 1 reset then has to echo all of its frames back as failed. */
+#define BLOCK_FILL      (CAN_TX_QUEUE_SIZE + 1) /* one in a mailbox, one ID keeps the others queued */
+#define BLOCK_AT_US     1000
+#define BLOCK_RESET_US  5000
+#define BLOCK_TX_AT     ((void *)1)             /* tx_ctx of channel 1's held frame */
+
+static const uint32_t block_ch0_us[2] = { 1100, 1600 };
+static uint32_t block_base_us;
+static unsigned block_echoes[2], block_failed[2];
+static bool block_tx_at_failed;
+
+static void block_send(uint8_t channel, uint32_t can_id, uint32_t at_us, uint32_t seq, void *tx_ctx)
+{
+	struct gs_host_frame frame;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.channel = channel;
+	frame.can_id = can_id;
+	frame.can_dlc = 8;
+	if (at_us != 0) {
+		frame.flags = GS_CAN_FLAG_TX_AT;
+		frame.timestamp_us = block_base_us + at_us;
+	}
+	seq_put(frame.data, seq);
+	if (!sim_host_send(&frame, sizeof(frame), tx_ctx)) {
+		fail("frame %u for channel %u not accepted by the host model", seq, channel);
+	}
+}
+
+static void block_on_reset(void *ctx, int status, const void *data)
+{
+	(void)ctx;
+	(void)data;
+	if (status < 0) {
+		fail("channel reset stalled");
+	}
+}
+
+static void block_reset(sim_event_t *ev)
+{
+	struct gs_device_mode mode = { .mode = GS_CAN_MODE_RESET };
+	(void)ev;
+
+	if (!sim_host_request(false, GS_USB_BREQ_MODE, 1, &mode, sizeof(mode), block_on_reset, NULL)) {
+		fail("channel reset not sent");
+	}
+}
+
+static sim_event_t block_reset_event;
+
+static void block_on_ready(void *ctx)
+{
+	(void)ctx;
+
+	block_base_us = sim_timer_now();
+	for (unsigned i=0; i<BLOCK_FILL; i++) {
+		block_send(1, 0x100, 0, i, NULL);
+	}
+	block_send(1, 0x100, BLOCK_AT_US, BLOCK_FILL, BLOCK_TX_AT);
+	for (unsigned i=0; i<2; i++) {
+		block_send(0, 0x200, block_ch0_us[i], i, NULL);
+	}
+	sim_event_add(&block_reset_event, "reset", block_reset, NULL);
+	sim_event_at(&block_reset_event, sim_now() + BLOCK_RESET_US * 1000ULL);
+	sim_event_at(&check_event, sim_now() + 2 * BLOCK_RESET_US * 1000ULL);
+}
+
+static void block_on_echo(void *ctx, const struct gs_host_frame *frame, void *tx_ctx)
+{
+	(void)ctx;
+	(void)tx_ctx;
+	block_echoes[frame->channel]++;
+}
+
+static void block_on_tx_failed(void *ctx, unsigned channel, void *tx_ctx)
+{
+	(void)ctx;
+	block_failed[channel]++;
+	if (tx_ctx == BLOCK_TX_AT) {
+		block_tx_at_failed = true;
+	}
+}
+
+static void block_check(sim_event_t *ev)
+{
+	(void)ev;
+
+	printf("  channel 0: %u frames on the bus, %u echoed, %u failed\n", monitor.count, block_echoes[0], block_failed[0]);
+	printf("  channel 1: %u echoed, %u failed after the reset\n", block_echoes[1], block_failed[1]);
+
+	if (monitor.count != 2) {
+		fail("%u frames of channel 0 on the bus, expected 2", monitor.count);
+	}
+	for (unsigned i=0; (i<monitor.count) && (i<2); i++) {
+		monitor_entry_t *e = &monitor.frames[i];
+		uint64_t release_ns = sim_timer_to_ns(block_base_us + block_ch0_us[i]);
+		if ((e->seq != i) || (e->start_ns < release_ns) || (e->start_ns > release_ns + SLACK_NS)) {
+			fail("channel 0 frame %u started %lld ns after its release time", e->seq, (long long)(e->start_ns - release_ns));
+		}
+	}
+	if ((block_echoes[0] != 2) || (block_failed[0] != 0)) {
+		fail("channel 0: %u echoes, %u failed, expected 2 sent", block_echoes[0], block_failed[0]);
+	}
+	if ((block_echoes[1] != BLOCK_FILL + 1) || (block_failed[1] != BLOCK_FILL + 1)) {
+		fail("channel 1: %u echoes, %u failed, expected %u failed", block_echoes[1], block_failed[1], BLOCK_FILL + 1);
+	}
+	if (!block_tx_at_failed) {
+		fail("the held frame of channel 1 was not echoed as failed");
+	}
+	finish();
+}
+
+static int test_tx_at_block(void)
+{
+	sim_host_ops_t ops = {
+		.ready = block_on_ready,
+		.echo = block_on_echo,
+		.tx_failed = block_on_tx_failed,
+	};
+	echo_slots = BLOCK_FILL + 1;
+	return run_firmware(2, GS_CAN_MODE_HW_TIMESTAMP, &ops, block_check);
+}
+
+/* ---- periodic: the periodic transmit table ---- */
+
+#define PERIODIC_ID       0x200 /* slot 0, unlimited */
+#define PERIODIC_COUNT_ID 0x201 /* slot 1, ends after PERIODIC_COUNT frames, echoed */
+#define PERIODIC_US       1000
+#define PERIODIC_COUNT_US 500
+#define PERIODIC_COUNT    5
+#define PERIODIC_JITTER_NS 2000
+/* TIM2 is held across three deadlines, away from the grid of slot 0 */
+#define PERIODIC_HOLD_NS     10500000
+#define PERIODIC_RELEASE_NS  13700000
+#define PERIODIC_RESET_NS    20000000
+
+typedef enum {
+	PERIODIC_SET_COUNT,  /* slot 1, a quarter period after slot 0 */
+	PERIODIC_HOLD,
+	PERIODIC_RELEASE,
+	PERIODIC_STATS,      /* then the channel reset and start */
+	PERIODIC_CHECK
+} periodic_step_t;
+
+static sim_event_t periodic_event;
+static uint64_t periodic_set_ns, periodic_hold_ns, periodic_release_ns, periodic_reset_ns;
+static struct gs_device_stats periodic_stats;
+static unsigned periodic_echoes, periodic_bad_echoes;
+
+/* slot 1 frames come back like received ones */
+static void periodic_on_rx(void *ctx, const struct gs_host_frame *frame)
+{
+	(void)ctx;
+	if ((frame->can_id == PERIODIC_COUNT_ID) && (frame->echo_id == 0xFFFFFFFF)) {
+		periodic_echoes++;
+	} else {
+		periodic_bad_echoes++;
+	}
+}
+
+static void periodic_set(uint8_t slot, uint8_t flags, uint32_t can_id, uint32_t period_us, uint32_t count, sim_host_done_t done)
+{
+	struct gs_device_periodic p;
+
+	memset(&p, 0, sizeof(p));
+	p.slot = slot;
+	p.flags = flags;
+	p.can_id = can_id;
+	p.can_dlc = 8;
+	p.period_us = period_us;
+	p.count = count;
+	if (!sim_host_request(false, GS_USB_BREQ_SET_PERIODIC, 0, &p, sizeof(p), done, NULL)) {
+		fail("SET_PERIODIC for slot %u not sent", slot);
+	}
+}
+
+static void periodic_next(periodic_step_t step, uint64_t at)
+{
+	periodic_event.ctx = (void *)(uintptr_t)step;
+	sim_event_at(&periodic_event, at);
+}
+
+static void periodic_on_set(void *ctx, int status, const void *data)
+{
+	(void)ctx;
+	(void)data;
+	if (status < 0) {
+		fail("SET_PERIODIC stalled");
+	}
+}
+
+static void periodic_on_restart(void *ctx, int status, const void *data)
+{
+	(void)ctx;
+	(void)data;
+	if (status < 0) {
+		fail("channel start stalled");
+	}
+	periodic_next(PERIODIC_CHECK, sim_now() + 10000000);
+}
+
+/* the channel starts again at once: its slots must be gone, not just paused */
+static void periodic_on_reset(void *ctx, int status, const void *data)
+{
+	struct gs_device_mode mode = { .mode = GS_CAN_MODE_START, .flags = GS_CAN_MODE_HW_TIMESTAMP };
+	(void)ctx;
+	(void)data;
+
+	if (status < 0) {
+		fail("channel reset stalled");
+	}
+	periodic_reset_ns = sim_now();
+	if (!sim_host_request(false, GS_USB_BREQ_MODE, 0, &mode, sizeof(mode), periodic_on_restart, NULL)) {
+		fail("channel start not sent");
+	}
+}
+
+static void periodic_on_stats(void *ctx, int status, const void *data)
+{
+	struct gs_device_mode mode = { .mode = GS_CAN_MODE_RESET };
+	(void)ctx;
+
+	if (status == sizeof(periodic_stats)) {
+		memcpy(&periodic_stats, data, sizeof(periodic_stats));
+	} else {
+		fail("GET_STATS failed");
+	}
+	if (!sim_host_request(false, GS_USB_BREQ_MODE, 0, &mode, sizeof(mode), periodic_on_reset, NULL)) {
+		fail("channel reset not sent");
+	}
+}
+
+static void periodic_on_ready(void *ctx)
+{
+	(void)ctx;
+	periodic_set(0, 0, PERIODIC_ID, PERIODIC_US, 0, periodic_on_set);
+	periodic_set_ns = sim_now();
+	periodic_next(PERIODIC_SET_COUNT, sim_now() + PERIODIC_COUNT_US * 1000 / 2);
+}
+
+static void periodic_check(void);
+
+static void periodic_step(sim_event_t *ev)
+{
+	switch ((periodic_step_t)(uintptr_t)ev->ctx) {
+		case PERIODIC_SET_COUNT:
+			periodic_set(1, GS_PERIODIC_FLAG_ECHO, PERIODIC_COUNT_ID, PERIODIC_COUNT_US, PERIODIC_COUNT, periodic_on_set);
+			periodic_next(PERIODIC_HOLD, periodic_set_ns + PERIODIC_HOLD_NS);
+			break;
+		case PERIODIC_HOLD:
+			periodic_hold_ns = sim_now();
+			sim_irq_hold(TIM2_IRQn, true);
+			periodic_next(PERIODIC_RELEASE, periodic_set_ns + PERIODIC_RELEASE_NS);
+			break;
+		case PERIODIC_RELEASE:
+			periodic_release_ns = sim_now();
+			sim_irq_hold(TIM2_IRQn, false);
+			periodic_next(PERIODIC_STATS, periodic_set_ns + PERIODIC_RESET_NS);
+			break;
+		case PERIODIC_STATS:
+			if (!sim_host_request(true, GS_USB_BREQ_GET_STATS, 0, NULL, sizeof(periodic_stats), periodic_on_stats, NULL)) {
+				fail("GET_STATS not sent");
+			}
+			break;
+		case PERIODIC_CHECK:
+			periodic_check();
+			break;
+	}
+}
+
+static void periodic_check(void)
+{
+	uint64_t grid_ns = 0, last_ns = 0, prev_count_ns = 0;
+	unsigned frames = 0, count_frames = 0, late = 0, skipped = 0;
+	uint64_t max_jitter_ns = 0;
+
+	for (unsigned i=0; i<monitor.count; i++) {
+		monitor_entry_t *e = &monitor.frames[i];
+
+		if (e->can_id == PERIODIC_COUNT_ID) {
+			if ((count_frames > 0)) {
+				uint64_t d = e->start_ns - prev_count_ns;
+				uint64_t jitter = (d > PERIODIC_COUNT_US * 1000) ? d - PERIODIC_COUNT_US * 1000 : PERIODIC_COUNT_US * 1000 - d;
+				if (jitter > PERIODIC_JITTER_NS) {
+					fail("slot 1 frame %u came %llu ns after the one before", count_frames, (unsigned long long)d);
+				}
+			}
+			prev_count_ns = e->start_ns;
+			count_frames++;
+			continue;
+		}
+		if (e->can_id != PERIODIC_ID) {
+			fail("unexpected frame 0x%x", e->can_id);
+			continue;
+		}
+
+		if (frames == 0) {
+			grid_ns = e->start_ns; // the phase of slot 0
+		}
+		frames++;
+		last_ns = e->start_ns;
+		if (e->start_ns > periodic_reset_ns) {
+			fail("slot 0 sent at %+lld us, after the channel reset", (long long)(e->start_ns - periodic_reset_ns) / 1000);
+			continue;
+		}
+		if ((e->start_ns >= periodic_release_ns) && (e->start_ns - periodic_release_ns <= PERIODIC_JITTER_NS)) {
+			late++; // the deadline that waited for the held interrupt
+			continue;
+		}
+
+		// every other frame sits on the grid of the period
+		uint64_t offset = (e->start_ns - grid_ns) % (PERIODIC_US * 1000);
+		uint64_t jitter = (offset > PERIODIC_US * 500) ? PERIODIC_US * 1000 - offset : offset;
+		if (jitter > max_jitter_ns) {
+			max_jitter_ns = jitter;
+		}
+		if (jitter > PERIODIC_JITTER_NS) {
+			fail("slot 0 frame %u is %llu ns off its period", frames - 1, (unsigned long long)jitter);
+		}
+		if ((e->start_ns > periodic_hold_ns) && (e->start_ns < periodic_release_ns)) {
+			fail("slot 0 sent while TIM2 was held");
+		}
+	}
+
+	// deadlines that passed while TIM2 was held: one goes out late, the rest are skipped
+	for (uint64_t t = grid_ns; t < periodic_release_ns; t += PERIODIC_US * 1000) {
+		if (t > periodic_hold_ns) {
+			skipped++;
+		}
+	}
+	skipped = (skipped > 0) ? skipped - 1 : 0;
+	unsigned expected = 1 + (periodic_reset_ns - grid_ns) / (PERIODIC_US * 1000) - skipped;
+
+	printf("  slot 0: %u frames, max jitter %llu ns, %u late after the hold, %u deadlines skipped\n",
+	       frames, (unsigned long long)max_jitter_ns, late, skipped);
+	printf("  slot 1: %u frames of %u, %u echoed to the host\n", count_frames, PERIODIC_COUNT, periodic_echoes);
+	printf("  stats: %u periodic frames, %u missed; last frame %lld us before the reset\n",
+	       periodic_stats.periodic_frames, periodic_stats.periodic_missed,
+	       (long long)(periodic_reset_ns - last_ns) / 1000);
+
+	if (count_frames != PERIODIC_COUNT) {
+		fail("slot 1 sent %u frames, its count is %u", count_frames, PERIODIC_COUNT);
+	}
+	if ((periodic_echoes != PERIODIC_COUNT) || (periodic_bad_echoes > 0)) {
+		fail("host got %u echoes of slot 1 and %u other frames", periodic_echoes, periodic_bad_echoes);
+	}
+	unsigned latency_counted = 0;
+	for (unsigned i=0; i<sizeof(periodic_stats.rx_latency_hist)/sizeof(periodic_stats.rx_latency_hist[0]); i++) {
+		latency_counted += periodic_stats.rx_latency_hist[i];
+	}
+	if (latency_counted > 0) {
+		fail("%u periodic echoes in the receive latency histogram", latency_counted);
+	}
+	if (late != 1) {
+		fail("%u frames right after the hold, expected 1", late);
+	}
+	if ((frames < expected - 1) || (frames > expected)) {
+		fail("slot 0 sent %u frames, expected %u", frames, expected);
+	}
+	if (periodic_stats.periodic_missed != skipped) {
+		fail("%u periodic frames counted as missed, %u deadlines were skipped", periodic_stats.periodic_missed, skipped);
+	}
+	if (periodic_reset_ns - last_ns > PERIODIC_US * 1000 + PERIODIC_JITTER_NS) {
+		fail("slot 0 stopped before the channel reset");
+	}
+	finish();
+}
+
+static int test_periodic(void)
+{
+	sim_host_ops_t ops = {
+		.ready = periodic_on_ready,
+		.rx = periodic_on_rx,
+	};
+	sim_event_add(&periodic_event, "periodic step", periodic_step, NULL);
+	return run_firmware(1, GS_CAN_MODE_HW_TIMESTAMP, &ops, NULL);
+}
+
+/* ---- ring: ring_t between two threads ---- */
+
+#define RING_ITEMS 4000000
+#define RING_SPINS 100 /* tries before giving the CPU to the other side */
+
+typedef struct {
+	ring_t ring;
+	void *buf[256];
+	uint32_t items;
+	uint64_t full;    /* pushes refused */
+	uint64_t empty;   /* pops that found nothing */
+	uint32_t bad;     /* pops out of sequence */
+	uint32_t first_bad, first_bad_got;
+	unsigned over;    /* times the consumer saw more than the capacity */
+} ring_test_t;
+
+static void *ring_producer(void *arg)
+{
+	ring_test_t *t = arg;
+
+	// the items count from 1, ring_pop() reports an empty ring as 0
+	for (uint32_t i=1; i<=t->items; i++) {
+		unsigned spins = 0;
+		while (!ring_push(&t->ring, (void *)(uintptr_t)i)) {
+			t->full++;
+			if (++spins % RING_SPINS == 0) {
+				sched_yield(); // on one CPU the consumer only runs when this one stops
+			}
+		}
+	}
+	return NULL;
+}
+
+static void ring_consume(ring_test_t *t)
+{
+	uint32_t next = 1;
+	unsigned spins = 0;
+
+	while (next <= t->items) {
+		unsigned size = ring_size(&t->ring);
+		if (size > t->ring.mask + 1) {
+			t->over++;
+		}
+		// alternate between peek and pop, main() uses both
+		void *el = (next & 1) ? ring_peek(&t->ring) : ring_pop(&t->ring);
+		if (el == 0) {
+			t->empty++;
+			if (++spins % RING_SPINS == 0) {
+				sched_yield();
+			}
+			continue;
+		}
+		if ((next & 1) && (ring_pop(&t->ring) != el)) {
+			fail("ring_pop() returned another item than ring_peek() before it");
+		}
+		uint32_t got = (uintptr_t)el;
+		if ((got != next) && (t->bad++ == 0)) {
+			t->first_bad = next;
+			t->first_bad_got = got;
+		}
+		next = got + 1;
+	}
+}
+
+static void ring_run(unsigned capacity)
+{
+	static ring_test_t t;
+	pthread_t producer;
+
+	memset(&t, 0, sizeof(t));
+	ring_init(&t.ring, t.buf, capacity);
+	t.items = RING_ITEMS;
+	if (pthread_create(&producer, NULL, ring_producer, &t) != 0) {
+		fail("no producer thread");
+		return;
+	}
+	ring_consume(&t);
+	pthread_join(producer, NULL);
+
+	printf("  capacity %3u: %u items, %llu pushes refused, %llu pops empty, high water %u\n",
+	       capacity, t.items, (unsigned long long)t.full, (unsigned long long)t.empty, ring_high_water(&t.ring));
+	if (t.bad > 0) {
+		fail("%u items out of sequence, the first was %u where %u was due", t.bad, t.first_bad_got, t.first_bad);
+	}
+	if (t.over > 0) {
+		fail("ring_size() above the capacity %u times", t.over);
+	}
+	if (!ring_is_empty(&t.ring) || (ring_pop(&t.ring) != 0)) {
+		fail("items left over");
+	}
+	if (ring_high_water(&t.ring) > capacity) {
+		fail("high water %u above the capacity", ring_high_water(&t.ring));
+	}
+}
+
+static int test_ring(void)
+{
+	// a small ring keeps both sides at the wrap and full/empty edges
+	ring_run(4);
+	ring_run(256);
+	return 0;
+}
+
+/* ---- bittiming: can_calc_bittiming() at the 42 MHz CAN clock ---- */
+
+#define CAN_CLOCK 42000000
+
+typedef struct {
+	uint32_t bitrate;
+	uint16_t sample_point; /* 0: the default for the bitrate */
+	uint16_t brp;
+	uint8_t tseg1, tseg2, sjw;
+	uint16_t sp;           /* resulting sample point, per mille */
+} bittiming_case_t;
+
+static const bittiming_case_t bittiming_cases[] = {
+	{ 125000,   0, 21, 13, 2, 2, 875 },
+	{ 250000,   0, 12, 11, 2, 2, 857 },
+	{ 500000,   0,  6, 11, 2, 2, 857 },
+	{ 1000000,  0,  2, 15, 5, 4, 761 },
+	{ 500000, 800,  4, 16, 4, 4, 809 },
+	{ 20000,    0, 140, 12, 2, 2, 866 },
+};
+
+/* more than 0.5 % off at 42 MHz, out of range, or invalid */
+static const struct {
+	uint32_t bitrate;
+	uint16_t sample_point;
+} bittiming_errors[] = {
+	{ 800000, 0 },   // 52.5 clocks per bit
+	{ 5000000, 0 },  // fewer than 9 clocks per bit
+	{ 1000, 0 },     // needs more than 1024 * 25 clocks per bit
+	{ 0, 0 },
+	{ 500000, 1000 },
+};
+
+static int test_bittiming(void)
+{
+	for (unsigned i=0; i<sizeof(bittiming_cases)/sizeof(bittiming_cases[0]); i++) {
+		const bittiming_case_t *c = &bittiming_cases[i];
+		can_bittiming_t bt;
+
+		memset(&bt, 0, sizeof(bt));
+		if (!can_calc_bittiming(CAN_CLOCK, c->bitrate, c->sample_point, &bt)) {
+			fail("%u bit/s not reached", c->bitrate);
+			continue;
+		}
+		unsigned nbt = 1 + bt.phase_seg1 + bt.phase_seg2;
+		unsigned sp = 1000 * (1 + bt.phase_seg1) / nbt;
+		printf("  %7u bit/s: brp %4u, tseg1 %2u, tseg2 %u, sjw %u, sample point %u\n",
+		       c->bitrate, bt.brp, bt.phase_seg1, bt.phase_seg2, bt.sjw, sp);
+
+		if ((bt.brp != c->brp) || (bt.phase_seg1 != c->tseg1) || (bt.phase_seg2 != c->tseg2) || (bt.sjw != c->sjw)) {
+			fail("%u bit/s: expected brp %u, tseg1 %u, tseg2 %u, sjw %u",
+			     c->bitrate, c->brp, c->tseg1, c->tseg2, c->sjw);
+		}
+		if (CAN_CLOCK / (bt.brp * nbt) != c->bitrate) {
+			fail("%u bit/s: the timing gives %u bit/s", c->bitrate, CAN_CLOCK / (bt.brp * nbt));
+		}
+		if (sp != c->sp) {
+			fail("%u bit/s: sample point %u, expected %u", c->bitrate, sp, c->sp);
+		}
+		if ((bt.phase_seg1 > 16) || (bt.phase_seg2 > 8) || (bt.sjw > bt.phase_seg2) || (bt.brp > 1024)) {
+			fail("%u bit/s: outside the BTR fields", c->bitrate);
+		}
+	}
+
+	for (unsigned i=0; i<sizeof(bittiming_errors)/sizeof(bittiming_errors[0]); i++) {
+		can_bittiming_t bt;
+		if (can_calc_bittiming(CAN_CLOCK, bittiming_errors[i].bitrate, bittiming_errors[i].sample_point, &bt)) {
+			fail("%u bit/s, sample point %u accepted", bittiming_errors[i].bitrate, bittiming_errors[i].sample_point);
+		}
+	}
+	return 0;
+}
+
+/* ---- decimate: can_decimate() keeps the IDs of a masked slot apart ---- */
+
+#define DECIMATE_IDS    4      /* per slot, interleaved */
+#define DECIMATE_STEP   100    /* us between two frames */
+#define DECIMATE_FRAMES 400
+
+static void decimate_set(can_data_t *hcan, uint8_t slot, uint8_t mode, uint32_t id, uint32_t param)
+{
+	struct gs_device_decimate d = { .slot = slot, .mode = mode, .id = id, .mask = 0x7F0, .param = param };
+	if (!can_set_decimate(hcan, &d)) {
+		fail("slot %u refused", slot);
+	}
+}
+
+static int test_decimate(void)
+{
+	static can_data_t hcan;
+	unsigned forwarded[3][DECIMATE_IDS];
+
+	memset(forwarded, 0, sizeof(forwarded));
+	decimate_set(&hcan, 0, GS_CAN_DECIMATE_INTERVAL, 0x100, 1000);
+	decimate_set(&hcan, 1, GS_CAN_DECIMATE_ON_CHANGE, 0x200, 0);
+	decimate_set(&hcan, 2, GS_CAN_DECIMATE_EVERY_NTH, 0x300, 10);
+
+	for (unsigned n=0; n<DECIMATE_FRAMES; n++) {
+		for (unsigned slot=0; slot<3; slot++) {
+			struct gs_host_frame frame;
+			unsigned id = n % DECIMATE_IDS;
+
+			memset(&frame, 0, sizeof(frame));
+			frame.can_id = 0x100 * (slot + 1) + id;
+			frame.can_dlc = 8;
+			frame.timestamp_us = n * DECIMATE_STEP;
+			frame.data[0] = id;                              // the IDs differ from each other,
+			frame.data[1] = (n / (10 * DECIMATE_IDS)) & 0xFF; // but each changes every tenth frame only
+			if (!can_decimate(&hcan, &frame)) {
+				forwarded[slot][id]++;
+			}
+		}
+	}
+
+	// every ID of a slot sends one frame per DECIMATE_IDS * DECIMATE_STEP us,
+	// so the interval lets through one of every 1 ms / 400 us rounded up
+	static const char *names[3] = { "interval", "on change", "every nth" };
+	unsigned per_id = DECIMATE_FRAMES / DECIMATE_IDS;
+	unsigned apart = (1000 + DECIMATE_IDS * DECIMATE_STEP - 1) / (DECIMATE_IDS * DECIMATE_STEP);
+	unsigned expected[3] = { (per_id + apart - 1) / apart, per_id / 10, per_id / 10 };
+	for (unsigned slot=0; slot<3; slot++) {
+		printf("  %-10s", names[slot]);
+		for (unsigned id=0; id<DECIMATE_IDS; id++) {
+			printf(" %3u", forwarded[slot][id]);
+		}
+		printf(", expected %u each\n", expected[slot]);
+		for (unsigned id=0; id<DECIMATE_IDS; id++) {
+			if (forwarded[slot][id] != expected[slot]) {
+				fail("%s: ID %u forwarded %u frames", names[slot], id, forwarded[slot][id]);
+			}
+		}
+	}
+
+	// a slot matching more IDs than it keeps apart lets the first frame of each new one through
+	struct gs_host_frame frame = { .can_id = 0x100 + DECIMATE_IDS, .can_dlc = 8, .timestamp_us = DECIMATE_FRAMES * DECIMATE_STEP };
+	for (unsigned i=0; i<CAN_DECIMATE_IDS; i++, frame.can_id++) {
+		if (can_decimate(&hcan, &frame)) {
+			fail("first frame of 0x%03X held back", (unsigned)frame.can_id);
+		}
+	}
+	return 0;
+}
+
+/* ---- the cases ---- */
+
+typedef struct {
+	const char *name;
+	int (*run)(void);
+} test_case_t;
+
+static const test_case_t cases[] = {
+	{ "tx_at", test_tx_at },
+	{ "tx_at_block", test_tx_at_block },
+	{ "periodic", test_periodic },
+	{ "ring", test_ring },
+	{ "bittiming", test_bittiming },
+	{ "decimate", test_decimate },
+};
+
+#define CASE_COUNT (sizeof(cases) / sizeof(cases[0]))
+
+int main(int argc, char **argv)
+{
+	unsigned failed = 0;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (argc > 1) {
+		for (unsigned i=0; i<CASE_COUNT; i++) {
+			if (strcmp(argv[1], cases[i].name) == 0) {
+				cases[i].run();
+				finish();
+			}
+		}
+		fprintf(stderr, "usage: %s [case], cases:", argv[0]);
+		for (unsigned i=0; i<CASE_COUNT; i++) {
+			fprintf(stderr, " %s", cases[i].name);
+		}
+		fprintf(stderr, "\n");
+		return 2;
+	}
+
+	for (unsigned i=0; i<CASE_COUNT; i++) {
+		int status = 1;
+		printf("%s\n", cases[i].name);
+		pid_t pid = fork();
+		if (pid == 0) {
+			cases[i].run();
+			finish();
+		}
+		if ((pid < 0) || (waitpid(pid, &status, 0) < 0) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+			printf("%s failed\n", cases[i].name);
+			failed++;
+		}
+	}
+	printf("%u of %u cases passed\n", (unsigned)CASE_COUNT - failed, (unsigned)CASE_COUNT);
+	return (failed > 0) ? 1 : 0;
+}
@@ -25,38 +25,424 @@ THE SOFTWARE.
 */
 
 #include "can.h"
-volatile uint32_t pclk1 ;
-void can_init(can_data_t *hcan, CAN_TypeDef *instance)
+#include "util.h"
+#include "timer.h"
+#include <string.h>
+
+#define CAN_IER_RX_MSG    (CAN_IER_FMPIE0 | CAN_IER_FMPIE1)
+#define CAN_IER_RX_OVR    (CAN_IER_FOVIE0 | CAN_IER_FOVIE1)
+#define CAN_IER_ERR       (CAN_IER_ERRIE | CAN_IER_EWGIE | CAN_IER_EPVIE | CAN_IER_BOFIE | CAN_IER_LECIE)
+#define CAN_TSR_ABRQ_ALL  (CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2)
+
+/* RF0R and RF1R are adjacent and share the same bit layout */
+static inline __IO uint32_t *can_rfr(CAN_TypeDef *can, uint8_t fifo)
+{
+	return &can->RF0R + fifo;
+}
+
+void can_init(can_data_t *hcan, CAN_TypeDef *instance, uint8_t channel)
 {
+	IRQn_Type rx0_irq, rx1_irq, sce_irq;
+
+	/* CAN2 is a slave of CAN1 and needs its clock as well */
 	__HAL_RCC_CAN1_CLK_ENABLE();
   __HAL_RCC_GPIOB_CLK_ENABLE();
 
 	GPIO_InitTypeDef itd;
-	itd.Pin = GPIO_PIN_8|GPIO_PIN_9;
 	itd.Mode = GPIO_MODE_AF_PP;
 	itd.Pull = GPIO_NOPULL;
 	itd.Speed = GPIO_SPEED_FREQ_HIGH;
-	itd.Alternate = GPIO_AF9_CAN1;
+
+	if (instance == CAN2) {
+		__HAL_RCC_CAN2_CLK_ENABLE();
+		itd.Pin = GPIO_PIN_12|GPIO_PIN_13;
+		itd.Alternate = GPIO_AF9_CAN2;
+		rx0_irq = CAN2_RX0_IRQn;
+		rx1_irq = CAN2_RX1_IRQn;
+		sce_irq = CAN2_SCE_IRQn;
+		hcan->tx_irq = CAN2_TX_IRQn;
+	} else {
+		itd.Pin = GPIO_PIN_8|GPIO_PIN_9;
+		itd.Alternate = GPIO_AF9_CAN1;
+		rx0_irq = CAN1_RX0_IRQn;
+		rx1_irq = CAN1_RX1_IRQn;
+		sce_irq = CAN1_SCE_IRQn;
+		hcan->tx_irq = CAN1_TX_IRQn;
+	}
 	HAL_GPIO_Init(GPIOB, &itd);
 
-	/* PCLK1 = SysClk/4 => PCLK1 = 42 */
-  pclk1 = HAL_RCC_GetPCLK1Freq(); // APB1
 	hcan->instance   = instance;
-	hcan->brp        = 2; /* div by 2 => 21 Mhz*/
-	hcan->phase_seg1 = 7+8;
-	hcan->phase_seg2 = 5;
-	hcan->sjw        = 4;
+	hcan->channel    = channel;
+	hcan->filter_base = (instance == CAN2) ? CAN_FILTER_BANKS : 0;
+	can_set_bitrate(hcan, CAN_BITRATE_DEFAULT, 0);
+	can_set_error_interval(hcan, CAN_ERROR_REPORT_US);
+
+	can_clear_filters(hcan);
+
+	// the RX and TX handlers push to q_to_host, a single producer ring: none of
+	// these may preempt another, the USB or the TIM2 interrupt, see CAN_IRQ_PRIORITY
+	HAL_NVIC_SetPriority(rx0_irq, CAN_IRQ_PRIORITY, 0);
+	HAL_NVIC_SetPriority(rx1_irq, CAN_IRQ_PRIORITY, 0);
+	HAL_NVIC_SetPriority(sce_irq, CAN_IRQ_PRIORITY, 0);
+	HAL_NVIC_SetPriority(hcan->tx_irq, CAN_IRQ_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(rx0_irq);
+	HAL_NVIC_EnableIRQ(rx1_irq);
+	HAL_NVIC_EnableIRQ(sce_irq);
+	HAL_NVIC_EnableIRQ(hcan->tx_irq);
+}
+
+static void can_config_filters(can_data_t *hcan)
+{
+	CAN_TypeDef *can = CAN1;         // filter registers only exist in the master
+	uint32_t fa1r = 0, fs1r = 0, fm1r = 0, ffa1r = 0;
+	uint32_t own = ((1UL << CAN_FILTER_BANKS) - 1) << hcan->filter_base;
+
+	can->FMR |= CAN_FMR_FINIT;
+	can->FMR = (can->FMR & ~CAN_FMR_CAN2SB) | (CAN_FILTER_BANKS << CAN_FMR_CAN2SB_Pos); // banks 14..27 belong to CAN2
+	can->FA1R &= ~own;               // disable our filters while changing them
+
+	for (unsigned i=0; i<CAN_FILTER_BANKS; i++) {
+		can_filter_t *f = &hcan->filters[i];
+		unsigned bank = hcan->filter_base + i;
+		uint32_t bit = 1UL << bank;
+
+		if (f->mode == GS_CAN_FILTER_DISABLE) {
+			continue;
+		}
+		if ((f->mode == GS_CAN_FILTER_MASK32) || (f->mode == GS_CAN_FILTER_LIST32)) {
+			fs1r |= bit;             // single 32-bit scale
+		}
+		if ((f->mode == GS_CAN_FILTER_LIST32) || (f->mode == GS_CAN_FILTER_LIST16)) {
+			fm1r |= bit;             // identifier list mode
+		}
+		if (f->fifo != 0) {
+			ffa1r |= bit;            // assign to FIFO 1
+		}
+		can->sFilterRegister[bank].FR1 = f->fr1;
+		can->sFilterRegister[bank].FR2 = f->fr2;
+		fa1r |= bit;
+	}
+
+	can->FS1R = (can->FS1R & ~own) | fs1r;
+	can->FM1R = (can->FM1R & ~own) | fm1r;
+	can->FFA1R = (can->FFA1R & ~own) | ffa1r;
+	can->FA1R |= fa1r;
+	can->FMR &= ~CAN_FMR_FINIT;
+}
+
+static void can_load_default_filters(can_data_t *hcan)
+{
+	memset(hcan->filters, 0, sizeof(hcan->filters));
+
+	// filter 0 accepts everything into FIFO 0
+	hcan->filters[0].mode = GS_CAN_FILTER_MASK32;
+
+	if (hcan->fifo_split) {
+		// on a match, the lower filter number wins: filter 0 picks the
+		// high priority IDs for FIFO 0, filter 1 catches the rest
+		hcan->filters[0].fr1 = CAN_SPLIT_FILTER_ID;
+		hcan->filters[0].fr2 = CAN_SPLIT_FILTER_MASK;
+		hcan->filters[1].mode = GS_CAN_FILTER_MASK32;
+		hcan->filters[1].fifo = 1;
+	}
+}
+
+/* can_id layout to the 32-bit scale filter register layout */
+static uint32_t can_filter_reg32(uint32_t id, bool extended)
+{
+	uint32_t reg = extended ? (id & 0x1FFFFFFF) << 3 : (id & 0x7FF) << 21;
+	if (id & CAN_EFF_FLAG) {
+		reg |= CAN_ID_EXT;
+	}
+	if (id & CAN_RTR_FLAG) {
+		reg |= CAN_RTR_REMOTE;
+	}
+	return reg;
+}
+
+/* can_id layout to the 16-bit scale filter register layout */
+static uint32_t can_filter_reg16(uint32_t id, bool extended)
+{
+	uint32_t reg = extended ? ((id >> 13) & 0xFFE0) | ((id >> 15) & 0x07) : (id & 0x7FF) << 5;
+	if (id & CAN_EFF_FLAG) {
+		reg |= 0x08;
+	}
+	if (id & CAN_RTR_FLAG) {
+		reg |= 0x10;
+	}
+	return reg;
+}
+
+void can_set_fifo_split(can_data_t *hcan, bool enable)
+{
+	hcan->fifo_split = enable;
+	if (!hcan->host_filters) {
+		can_load_default_filters(hcan);
+	}
+}
+
+bool can_set_filter(can_data_t *hcan, const struct gs_device_filter *filter)
+{
+	uint32_t id[4];
+	can_filter_t *f;
+
+	if (filter->bank == GS_CAN_FILTER_BANK_ALL) {
+		if (filter->mode != GS_CAN_FILTER_DISABLE) {
+			return false;
+		}
+		can_clear_filters(hcan);
+		return true;
+	}
+
+	if ( (filter->bank >= CAN_FILTER_BANKS)
+	  || (filter->mode > GS_CAN_FILTER_LIST16)
+	  || (filter->fifo >= CAN_RX_FIFO_COUNT)
+	) {
+		return false;
+	}
+
+	// the first host filter replaces the default accept-all setup
+	if (!hcan->host_filters) {
+		memset(hcan->filters, 0, sizeof(hcan->filters));
+		hcan->host_filters = true;
+	}
+
+	memcpy(id, filter->id, sizeof(id));
+	f = &hcan->filters[filter->bank];
+	f->mode = filter->mode;
+	f->fifo = filter->fifo;
+
+	switch (filter->mode) {
+		case GS_CAN_FILTER_MASK32:
+			f->fr1 = can_filter_reg32(id[0], id[0] & CAN_EFF_FLAG);
+			f->fr2 = can_filter_reg32(id[1], id[0] & CAN_EFF_FLAG);
+			break;
+		case GS_CAN_FILTER_LIST32:
+			f->fr1 = can_filter_reg32(id[0], id[0] & CAN_EFF_FLAG);
+			f->fr2 = can_filter_reg32(id[1], id[1] & CAN_EFF_FLAG);
+			break;
+		case GS_CAN_FILTER_MASK16:
+			f->fr1 = can_filter_reg16(id[0], id[0] & CAN_EFF_FLAG)
+			       | can_filter_reg16(id[1], id[0] & CAN_EFF_FLAG) << 16;
+			f->fr2 = can_filter_reg16(id[2], id[2] & CAN_EFF_FLAG)
+			       | can_filter_reg16(id[3], id[2] & CAN_EFF_FLAG) << 16;
+			break;
+		case GS_CAN_FILTER_LIST16:
+			f->fr1 = can_filter_reg16(id[0], id[0] & CAN_EFF_FLAG)
+			       | can_filter_reg16(id[1], id[1] & CAN_EFF_FLAG) << 16;
+			f->fr2 = can_filter_reg16(id[2], id[2] & CAN_EFF_FLAG)
+			       | can_filter_reg16(id[3], id[3] & CAN_EFF_FLAG) << 16;
+			break;
+		default:
+			f->fr1 = 0;
+			f->fr2 = 0;
+			break;
+	}
+
+	if (can_is_enabled(hcan)) {
+		can_config_filters(hcan);
+	}
+	return true;
+}
+
+void can_clear_filters(can_data_t *hcan)
+{
+	hcan->host_filters = false;
+	can_load_default_filters(hcan);
+
+	if (can_is_enabled(hcan)) {
+		can_config_filters(hcan);
+	}
+}
+
+/* Called from the USB interrupt, at the priority of the RX interrupts
+ * that read the table. */
+bool can_set_decimate(can_data_t *hcan, const struct gs_device_decimate *decimate)
+{
+	if ((decimate->slot == GS_CAN_DECIMATE_SLOT_ALL) && (decimate->mode == GS_CAN_DECIMATE_OFF)) {
+		memset(hcan->decimate, 0, sizeof(hcan->decimate));
+		hcan->decimate_slots = 0;
+		return true;
+	}
+
+	if ( (decimate->slot >= CAN_DECIMATE_SLOTS)
+	  || (decimate->mode > GS_CAN_DECIMATE_INTERVAL)
+	  || ((decimate->mode == GS_CAN_DECIMATE_EVERY_NTH) && (decimate->param == 0))
+	) {
+		return false;
+	}
+
+	can_decimate_t *d = &hcan->decimate[decimate->slot];
+	memset(d, 0, sizeof(*d));
+	d->id = decimate->id;
+	d->mask = decimate->mask;
+	d->param = decimate->param;
+	d->mode = decimate->mode;
+
+	unsigned used = 0;
+	for (unsigned i=0; i<CAN_DECIMATE_SLOTS; i++) {
+		if (hcan->decimate[i].mode != GS_CAN_DECIMATE_OFF) {
+			used = i + 1;
+		}
+	}
+	hcan->decimate_slots = used;
+	return true;
+}
+
+/* the state of an ID in a slot, or NULL if the slot does not track it yet */
+static can_decimate_id_t *can_decimate_find(can_decimate_t *d, uint32_t can_id)
+{
+	for (unsigned i=0; i<d->ids; i++) {
+		if (d->seen[i].can_id == can_id) {
+			return &d->seen[i];
+		}
+	}
+	return 0;
+}
+
+/* starts tracking an ID, in place of the one tracked longest once all entries are in use */
+static can_decimate_id_t *can_decimate_add(can_decimate_t *d, uint32_t can_id)
+{
+	can_decimate_id_t *s;
+	if (d->ids < CAN_DECIMATE_IDS) {
+		s = &d->seen[d->ids++];
+	} else {
+		s = &d->seen[d->next];
+		d->next = (d->next + 1) % CAN_DECIMATE_IDS;
+	}
+	memset(s, 0, sizeof(*s));
+	s->can_id = can_id;
+	return s;
+}
+
+/* Returns true if a received frame is to be held back from the host.
+ * Runs for every frame in the RX interrupt: a masked compare per used
+ * slot, and nothing at all while the table is empty. Each ID the slot
+ * matches is thinned out on its own, see gs_device_decimate. */
+bool can_decimate(can_data_t *hcan, const struct gs_host_frame *frame)
+{
+	for (unsigned i=0; i<hcan->decimate_slots; i++) {
+		can_decimate_t *d = &hcan->decimate[i];
+		if ((d->mode == GS_CAN_DECIMATE_OFF) || (((frame->can_id ^ d->id) & d->mask) != 0)) {
+			continue;
+		}
+
+		can_decimate_id_t *s = can_decimate_find(d, frame->can_id);
+		bool forward = (s == 0);
+		if (s == 0) {
+			s = can_decimate_add(d, frame->can_id); // the first frame of an ID always goes through
+		} else {
+			switch (d->mode) {
+				case GS_CAN_DECIMATE_EVERY_NTH:
+					forward = (s->count == 0);
+					break;
+				case GS_CAN_DECIMATE_ON_CHANGE:
+					forward = (frame->can_dlc != s->last_dlc)
+					       || (memcmp(frame->data, s->last_data, (frame->can_dlc < 8) ? frame->can_dlc : 8) != 0);
+					break;
+				default: // GS_CAN_DECIMATE_INTERVAL
+					forward = (frame->timestamp_us - s->last_us) >= d->param;
+					break;
+			}
+		}
+
+		if ((d->mode == GS_CAN_DECIMATE_EVERY_NTH) && (++s->count >= d->param)) {
+			s->count = 0;
+		}
+		if (forward) {
+			s->last_us = frame->timestamp_us;
+			s->last_dlc = frame->can_dlc;
+			memcpy(s->last_data, frame->data, sizeof(s->last_data));
+		} else {
+			hcan->rx_decimated++;
+		}
+		return !forward;
+	}
+	return false;
+}
+
+/* both bxCAN cells are clocked from APB1 */
+uint32_t can_get_clock(void)
+{
+	return HAL_RCC_GetPCLK1Freq();
+}
+
+/* Picks brp and segments for a bit rate, sample_point in 1/1000 of the bit
+ * time or 0 for the CiA recommendation. The closest bit rate wins, then the
+ * closest sample point (within 2% counts as exact), then the finest time
+ * quantum. Fails if the best match is more than 0.5% off. */
+bool can_calc_bittiming(uint32_t fclk, uint32_t bitrate, uint16_t sample_point, can_bittiming_t *bt)
+{
+	uint32_t best_rate_err = UINT32_MAX;
+	uint32_t best_sp_err = UINT32_MAX;
+
+	if ((bitrate == 0) || (sample_point >= 1000)) {
+		return false;
+	}
+
+	if (sample_point == 0) {
+		sample_point = (bitrate > 800000) ? 750 : (bitrate > 500000) ? 800 : 875;
+	}
+
+	for (uint32_t brp=1; brp<=1024; brp++) {
+		uint32_t nbt = (fclk / brp + bitrate / 2) / bitrate; // time quanta per bit
+		if ((nbt < 1+1+1) || (nbt > 1+16+8)) {
+			continue;
+		}
+
+		uint32_t rate = fclk / (brp * nbt);
+		uint32_t rate_err = (rate > bitrate) ? (rate - bitrate) : (bitrate - rate);
+
+		// the sample point sits after sync_seg + tseg1
+		int32_t tseg1 = (nbt * sample_point + 500) / 1000 - 1;
+		int32_t tseg2 = nbt - 1 - tseg1;
+		if (tseg2 > 8) {
+			tseg2 = 8;
+			tseg1 = nbt - 1 - tseg2;
+		} else if (tseg2 < 1) {
+			tseg2 = 1;
+			tseg1 = nbt - 1 - tseg2;
+		}
+		if (tseg1 > 16) {
+			tseg1 = 16;
+			tseg2 = nbt - 1 - tseg1;
+		}
+		if ((tseg1 < 1) || (tseg2 > 8)) {
+			continue;
+		}
+
+		uint32_t sp = 1000 * (1 + tseg1) / nbt;
+		uint32_t sp_err = (sp > sample_point) ? (sp - sample_point) : (sample_point - sp);
+		if (sp_err <= 20) {
+			sp_err = 0; // within 2% is as good as exact, keep the finer time quantum
+		}
+
+		if ((rate_err < best_rate_err) || ((rate_err == best_rate_err) && (sp_err < best_sp_err))) {
+			best_rate_err = rate_err;
+			best_sp_err = sp_err;
+			bt->brp = brp;
+			bt->phase_seg1 = tseg1;
+			bt->phase_seg2 = tseg2;
+			bt->sjw = (tseg2 < 4) ? tseg2 : 4;
+		}
+	}
+
+	return best_rate_err <= bitrate / 200;
+}
+
+bool can_set_bitrate(can_data_t *hcan, uint32_t bitrate, uint16_t sample_point)
+{
+	can_bittiming_t bt;
+
+	if (!can_calc_bittiming(can_get_clock(), bitrate, sample_point, &bt)) {
+		return false;
+	}
+	return can_set_bittiming(hcan, bt.brp, bt.phase_seg1, bt.phase_seg2, bt.sjw);
 }
 
+/* takes effect with the next can_enable() */
 bool can_set_bittiming(can_data_t *hcan, uint16_t brp, uint8_t phase_seg1, uint8_t phase_seg2, uint8_t sjw)
 {
-	/* force 1 Mbps, until we figure out how the usb host knows what the PCLK1 is */
-	brp        = 2; /* div by 2 => 21 Mhz*/
-	phase_seg1 = 7+8;
-	phase_seg2 = 5;
-	sjw        = 4;
-	
-	
 	if ( (brp>0) && (brp<=1024)
 	  && (phase_seg1>0) && (phase_seg1<=16)
 	  && (phase_seg2>0) && (phase_seg2<=8)
@@ -76,9 +462,9 @@ void can_enable(can_data_t *hcan, bool loop_back, bool listen_only, bool one_sho
 {
 	CAN_TypeDef *can = hcan->instance;
 
+	// TXFP stays clear: the mailboxes go out by identifier, as queued by can_tx_schedule()
 	uint32_t mcr = CAN_MCR_INRQ
 				 | CAN_MCR_ABOM
-			     | CAN_MCR_TXFP
 				 | (one_shot ? CAN_MCR_NART : 0);
 
 	uint32_t btr = ((uint32_t)(hcan->sjw-1)) << 24
@@ -103,24 +489,36 @@ void can_enable(can_data_t *hcan, bool loop_back, bool listen_only, bool one_sho
 	can->MCR &= ~CAN_MCR_INRQ;
 	while((can->MSR & CAN_MSR_INAK) != 0);
 
-	uint32_t filter_bit = 0x00000001;
-	can->FMR |= CAN_FMR_FINIT;
-	can->FMR &= ~CAN_FMR_CAN2SB;
-	can->FA1R &= ~filter_bit;        // disable filter
-	can->FS1R |= filter_bit;         // set to single 32-bit filter mode
-	can->FM1R &= ~filter_bit;        // set filter mask mode for filter 0
-	can->sFilterRegister[0].FR1 = 0; // filter ID = 0
-	can->sFilterRegister[0].FR2 = 0; // filter Mask = 0
-	can->FFA1R &= ~filter_bit;       // assign filter 0 to FIFO 0
-	can->FA1R |= filter_bit;         // enable filter
-	can->FMR &= ~CAN_FMR_FINIT;
-
+	can_config_filters(hcan);
+
+	// frames are drained from the FIFOs by the CANx_RXy interrupts,
+	// finished mailboxes are handed back by the CANx_TX interrupt,
+	// CANx_SCE counts protocol errors and error state changes
+	hcan->rx_irq_masked = false;
+	hcan->err_state = GS_CAN_STATE_ERROR_ACTIVE;
+	hcan->err_reported_state = GS_CAN_STATE_ERROR_ACTIVE;
+	hcan->err_lec_seen = 0;
+	hcan->err_restarted = false;
+	hcan->err_pending = false;
+	can->IER = CAN_IER_RX_MSG | CAN_IER_RX_OVR | CAN_IER_TMEIE | CAN_IER_ERR;
+
+	// the reset emptied the mailboxes without completing them
+	for (unsigned mb=0; mb<CAN_TX_MAILBOX_COUNT; mb++) {
+		if (hcan->tx_frames[mb] != 0) {
+			HAL_NVIC_SetPendingIRQ(hcan->tx_irq);
+		}
+	}
 }
 
 void can_disable(can_data_t *hcan)
 {
 	CAN_TypeDef *can = hcan->instance;
+	can->IER = CAN_IER_TMEIE;   // still collect the aborted mailboxes
+	can->TSR = CAN_TSR_ABRQ_ALL;
 	can->MCR |= CAN_MCR_INRQ ; // send can controller into initialization mode
+	if (hcan->tx_queue_len > 0) {
+		HAL_NVIC_SetPendingIRQ(hcan->tx_irq); // hand queued frames back as aborted
+	}
 }
 
 bool can_is_enabled(can_data_t *hcan)
@@ -131,16 +529,56 @@ bool can_is_enabled(can_data_t *hcan)
 
 bool can_is_rx_pending(can_data_t *hcan)
 {
-	CAN_TypeDef *can = hcan->instance;
-	return ((can->RF0R & CAN_RF0R_FMP0) != 0);
+	return can_is_rx_pending_fifo(hcan, 0) || can_is_rx_pending_fifo(hcan, 1);
 }
 
+/* FIFO 0 carries the high priority IDs in split mode, so it is emptied first */
 bool can_receive(can_data_t *hcan, struct gs_host_frame *rx_frame)
+{
+	return can_receive_fifo(hcan, 0, rx_frame)
+	    || can_receive_fifo(hcan, 1, rx_frame);
+}
+
+bool can_is_rx_pending_fifo(can_data_t *hcan, uint8_t fifo)
+{
+	CAN_TypeDef *can = hcan->instance;
+	return ((*can_rfr(can, fifo) & CAN_RF0R_FMP0) != 0);
+}
+
+bool can_check_rx_overrun(can_data_t *hcan, uint8_t fifo)
+{
+	__IO uint32_t *rfr = can_rfr(hcan->instance, fifo);
+
+	if ((*rfr & CAN_RF0R_FOVR0) != 0) {
+		*rfr = CAN_RF0R_FOVR0; // rc_w1, the other bits ignore a written 0
+		hcan->rx_fifo_overruns[fifo]++;
+		hcan->rx_overflow = true;
+		return true;
+	}
+	return false;
+}
+
+/* stop taking frames out of the FIFOs, overruns are still counted */
+void can_rx_irq_mask(can_data_t *hcan)
+{
+	hcan->instance->IER &= ~CAN_IER_RX_MSG;
+	hcan->rx_irq_masked = true;
+}
+
+void can_rx_irq_unmask(can_data_t *hcan)
+{
+	hcan->rx_irq_masked = false;
+	if (can_is_enabled(hcan)) {
+		hcan->instance->IER |= CAN_IER_RX_MSG;
+	}
+}
+
+bool can_receive_fifo(can_data_t *hcan, uint8_t fifo_num, struct gs_host_frame *rx_frame)
 {
 	CAN_TypeDef *can = hcan->instance;
 
-	if (can_is_rx_pending(hcan)) {
-		CAN_FIFOMailBox_TypeDef *fifo = &can->sFIFOMailBox[0];
+	if (can_is_rx_pending_fifo(hcan, fifo_num)) {
+		CAN_FIFOMailBox_TypeDef *fifo = &can->sFIFOMailBox[fifo_num];
 
 		if (fifo->RIR &  CAN_RI0R_IDE) {
 			rx_frame->can_id =  CAN_EFF_FLAG | ((fifo->RIR >> 3) & 0x1FFFFFFF);
@@ -163,7 +601,8 @@ bool can_receive(can_data_t *hcan, struct gs_host_frame *rx_frame)
 		rx_frame->data[6] = (fifo->RDHR >> 16) & 0xFF;
 		rx_frame->data[7] = (fifo->RDHR >> 24) & 0xFF;
 
-		can->RF0R |= CAN_RF0R_RFOM0; // release FIFO
+		*can_rfr(can, fifo_num) = CAN_RF0R_RFOM0; // release FIFO
+		hcan->rx_fifo_frames[fifo_num]++;
 
 	    return true;
 
@@ -174,130 +613,395 @@ bool can_receive(can_data_t *hcan, struct gs_host_frame *rx_frame)
 	}
 }
 
-static CAN_TxMailBox_TypeDef *can_find_free_mailbox(can_data_t *hcan)
+/* Orders frames the way the bus arbitrates them, a lower key wins. The base
+ * ID is compared first, then RTR/SRR and IDE, so a standard frame beats an
+ * extended one with the same base ID. */
+static uint32_t can_tx_key(uint32_t can_id)
 {
-	CAN_TypeDef *can = hcan->instance;
+	uint32_t rtr = (can_id & CAN_RTR_FLAG) ? 1 : 0;
 
-	uint32_t tsr = can->TSR;
-	if ( tsr & CAN_TSR_TME0 ) {
-		return &can->sTxMailBox[0];
-	} else if ( tsr & CAN_TSR_TME1 ) {
-		return &can->sTxMailBox[1];
-	} else if ( tsr & CAN_TSR_TME2 ) {
-		return &can->sTxMailBox[2];
+	if (can_id & CAN_EFF_FLAG) {
+		uint32_t id = can_id & 0x1FFFFFFF;
+		return ((id >> 18) << 21) | (3 << 19) | ((id & 0x3FFFF) << 1) | rtr;
+	} else {
+		return ((can_id & 0x7FF) << 21) | (rtr << 20);
+	}
+}
+
+/* A requeued frame goes back ahead of later frames with the same key,
+ * a new one behind them. */
+static void can_tx_insert(can_data_t *hcan, struct gs_host_frame *frame, bool requeue)
+{
+	uint32_t key = can_tx_key(frame->can_id);
+	unsigned pos = 0;
+
+	while (pos < hcan->tx_queue_len) {
+		uint32_t k = hcan->tx_queue[pos].key;
+		if ((k < key) || (!requeue && (k == key))) {
+			break;
+		}
+		pos++;
+	}
+
+	memmove(&hcan->tx_queue[pos+1], &hcan->tx_queue[pos], (hcan->tx_queue_len - pos) * sizeof(can_tx_entry_t));
+	hcan->tx_queue[pos].key = key;
+	hcan->tx_queue[pos].frame = frame;
+	hcan->tx_queue_len++;
+	if (hcan->tx_queue_len > hcan->tx_queue_high_water) {
+		hcan->tx_queue_high_water = hcan->tx_queue_len;
+	}
+}
+
+static struct gs_host_frame *can_tx_remove(can_data_t *hcan, unsigned pos)
+{
+	struct gs_host_frame *frame = hcan->tx_queue[pos].frame;
+	hcan->tx_queue_len--;
+	memmove(&hcan->tx_queue[pos], &hcan->tx_queue[pos+1], (hcan->tx_queue_len - pos) * sizeof(can_tx_entry_t));
+	return frame;
+}
+
+static void can_load_mailbox(can_data_t *hcan, unsigned mb_num, struct gs_host_frame *frame, uint32_t key)
+{
+	CAN_TxMailBox_TypeDef *mb = &hcan->instance->sTxMailBox[mb_num];
+	hcan->tx_frames[mb_num] = frame;
+	hcan->tx_keys[mb_num] = key;
+
+	/* first, clear transmission request */
+	mb->TIR &= CAN_TI0R_TXRQ;
+
+	if (frame->can_id & CAN_EFF_FLAG) { // extended id
+		mb->TIR = CAN_ID_EXT | (frame->can_id & 0x1FFFFFFF) << 3;
 	} else {
-		return 0;
+		mb->TIR = (frame->can_id & 0x7FF) << 21;
+	}
+
+	if (frame->can_id & CAN_RTR_FLAG) {
+		mb->TIR |= CAN_RTR_REMOTE;
 	}
+
+	mb->TDTR &= 0xFFFFFFF0;
+	mb->TDTR |= frame->can_dlc & 0x0F;
+
+	mb->TDLR =
+		  ( frame->data[3] << 24 )
+		| ( frame->data[2] << 16 )
+		| ( frame->data[1] <<  8 )
+		| ( frame->data[0] <<  0 );
+
+	mb->TDHR =
+		  ( frame->data[7] << 24 )
+		| ( frame->data[6] << 16 )
+		| ( frame->data[5] <<  8 )
+		| ( frame->data[4] <<  0 );
+
+	/* request transmission */
+	mb->TIR |= CAN_TI0R_TXRQ;
 }
 
 //#define, CAN_ID_EXT CAN_Id_Extended
 
+/* Queues a host frame for transmission in CAN ID order, false if the
+ * channel's TX queue is full. The frame is handed back by can_tx_complete(). */
 bool can_send(can_data_t *hcan, struct gs_host_frame *frame)
 {
-	CAN_TxMailBox_TypeDef *mb = can_find_free_mailbox(hcan);
-	if (mb != 0) {
+	bool retval = false;
+	int primask = disable_irq();
+
+	// keep a slot for the frame of a pending abort, it has to go back in
+	unsigned reserved = hcan->tx_abort_pending ? 1 : 0;
+	if (hcan->tx_queue_len + reserved < CAN_TX_QUEUE_SIZE) {
+		frame->timestamp_us = timer_get(); // queueing delay reference, the echo overwrites it
+		can_tx_insert(hcan, frame, false);
+		hcan->tx_queued++;
+		can_tx_schedule(hcan);
+		retval = true;
+	}
+
+	enable_irq(primask);
+	return retval;
+}
+
+/* Keeps the mailboxes loaded with the most urgent queued frames. If all
+ * are busy and the queue holds a frame that beats one of them, the least
+ * urgent mailbox is aborted; can_tx_complete() then requeues its frame.
+ * Must run at CAN interrupt level or with interrupts disabled. */
+void can_tx_schedule(can_data_t *hcan)
+{
+	CAN_TypeDef *can = hcan->instance;
 
-		/* first, clear transmission request */
-		mb->TIR &= CAN_TI0R_TXRQ;
+	if (!can_is_enabled(hcan)) {
+		if (hcan->tx_queue_len > 0) {
+			HAL_NVIC_SetPendingIRQ(hcan->tx_irq); // hand them back as aborted
+		}
+		return;
+	}
 
-		if (frame->can_id & CAN_EFF_FLAG) { // extended id
-			mb->TIR = CAN_ID_EXT | (frame->can_id & 0x1FFFFFFF) << 3;
-		} else {
-			mb->TIR = (frame->can_id & 0x7FF) << 21;
+	for (int i = (int)hcan->tx_queue_len - 1; i >= 0; i--) {
+		uint32_t key = hcan->tx_queue[i].key;
+		uint32_t tsr = can->TSR;
+		int free_mb = -1;
+		int victim = -1;
+		bool same_key = false;
+
+		for (unsigned mb=0; mb<CAN_TX_MAILBOX_COUNT; mb++) {
+			if (hcan->tx_frames[mb] == 0) {
+				if ((free_mb < 0) && (tsr & (CAN_TSR_TME0 << mb))) {
+					free_mb = mb;
+				}
+			} else if (hcan->tx_keys[mb] == key) {
+				same_key = true;
+			} else if ((victim < 0) || (hcan->tx_keys[mb] > hcan->tx_keys[victim])) {
+				victim = mb;
+			}
 		}
 
-		if (frame->can_id & CAN_RTR_FLAG) {
-			mb->TIR |= CAN_RTR_REMOTE;
+		if (same_key) {
+			// the hardware picks the lowest mailbox on equal IDs, which
+			// could reorder them, so only one frame per ID is in flight
+			continue;
 		}
 
-		mb->TDTR &= 0xFFFFFFF0;
-		mb->TDTR |= frame->can_dlc & 0x0F;
+		if (free_mb >= 0) {
+			can_load_mailbox(hcan, free_mb, hcan->tx_queue[i].frame, key);
+			can_tx_remove(hcan, i);
+			continue;
+		}
 
-		mb->TDLR =
-			  ( frame->data[3] << 24 )
-			| ( frame->data[2] << 16 )
-			| ( frame->data[1] <<  8 )
-			| ( frame->data[0] <<  0 );
+		if ((hcan->tx_abort_pending == 0) && (victim >= 0) && (hcan->tx_keys[victim] > key)) {
+			hcan->tx_abort_pending = 1 << victim;
+			can->TSR = CAN_TSR_ABRQ0 << (8*victim);
+			hcan->tx_preempted++;
+		}
+		break;
+	}
+}
 
-		mb->TDHR =
-			  ( frame->data[7] << 24 )
-			| ( frame->data[6] << 16 )
-			| ( frame->data[5] <<  8 )
-			| ( frame->data[4] <<  0 );
+static void can_tx_account(can_data_t *hcan, struct gs_host_frame *frame, uint32_t key)
+{
+	unsigned cls = key >> (32 - 2);
+	uint32_t delay = timer_get() - frame->timestamp_us;
 
-		/* request transmission */
-		mb->TIR |= CAN_TI0R_TXRQ;
+	hcan->tx_prio_frames[cls]++;
+	hcan->tx_prio_delay_us[cls] += delay;
+	if (delay > hcan->tx_prio_delay_max_us[cls]) {
+		hcan->tx_prio_delay_max_us[cls] = delay;
+	}
+}
 
-		return true;
+/* Returns the frame of a finished mailbox, or 0 once there is none left.
+ * Must run at CAN interrupt level, e.g. from the CANx_TX interrupt. */
+struct gs_host_frame *can_tx_complete(can_data_t *hcan, can_tx_result_t *result)
+{
+	CAN_TypeDef *can = hcan->instance;
+	uint32_t tsr = can->TSR;
+
+	for (unsigned mb=0; mb<CAN_TX_MAILBOX_COUNT; mb++) {
+		struct gs_host_frame *frame = hcan->tx_frames[mb];
+		uint32_t status = tsr >> (8*mb);
+		bool emptied = (tsr & (CAN_TSR_TME0 << mb)) != 0;
+
+		if (status & CAN_TSR_RQCP0) {
+			can->TSR = CAN_TSR_RQCP0 << (8*mb); // also clears TXOK, ALST and TERR
+		} else if (!emptied) {
+			continue; // still pending
+		}
+
+		if (frame == 0) {
+			continue;
+		}
+		hcan->tx_frames[mb] = 0;
+
+		bool preempted = (hcan->tx_abort_pending & (1 << mb)) != 0;
+		hcan->tx_abort_pending &= ~(1 << mb);
+
+		if ((status & (CAN_TSR_RQCP0 | CAN_TSR_TXOK0)) == (CAN_TSR_RQCP0 | CAN_TSR_TXOK0)) {
+			*result = can_tx_ok;
+		} else if (status & CAN_TSR_TERR0) {
+			*result = can_tx_error;
+		} else if (status & CAN_TSR_ALST0) {
+			*result = can_tx_lost_arbitration;
+		} else {
+			*result = can_tx_aborted; // abort request, one shot failure or reset
+		}
+
+		if ((*result == can_tx_aborted) && preempted) {
+			can_tx_insert(hcan, frame, true); // made room for a more urgent frame
+			continue;
+		}
+		if (*result == can_tx_ok) {
+			hcan->tx_echoed++;
+			can_tx_account(hcan, frame, hcan->tx_keys[mb]);
+		} else {
+			hcan->tx_failed++;
+		}
+		return frame;
 	}
-	return false;
+
+	// the channel was stopped, queued frames will not go out either
+	if (!can_is_enabled(hcan) && (hcan->tx_queue_len > 0)) {
+		*result = can_tx_aborted;
+		hcan->tx_failed++;
+		return can_tx_remove(hcan, hcan->tx_queue_len - 1);
+	}
+	return 0;
+}
+
+bool can_parse_tx_error(can_tx_result_t result, struct gs_host_frame *frame)
+{
+	frame->echo_id = 0xFFFFFFFF;
+	frame->can_id  = CAN_ERR_FLAG;
+	frame->can_dlc = CAN_ERR_DLC;
+	frame->flags = 0;
+	frame->reserved = 0;
+	memset(frame->data, 0, sizeof(frame->data));
+
+	switch (result) {
+		case can_tx_lost_arbitration:
+			frame->can_id |= CAN_ERR_LOSTARB;
+			frame->data[0] = CAN_ERR_LOSTARB_UNSPEC;
+			break;
+		case can_tx_error:
+			frame->can_id |= CAN_ERR_PROT;
+			frame->data[2] = CAN_ERR_PROT_TX;
+			break;
+		case can_tx_aborted:
+			frame->can_id |= CAN_ERR_TX_TIMEOUT;
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+static uint8_t can_error_state(uint32_t esr)
+{
+	if (esr & CAN_ESR_BOFF) {
+		return GS_CAN_STATE_BUS_OFF;
+	} else if (esr & CAN_ESR_EPVF) {
+		return GS_CAN_STATE_ERROR_PASSIVE;
+	} else if (esr & CAN_ESR_EWGF) {
+		return GS_CAN_STATE_ERROR_WARNING;
+	}
+	return GS_CAN_STATE_ERROR_ACTIVE;
+}
+
+/* at CAN interrupt level or with interrupts disabled */
+static void can_error_update_state(can_data_t *hcan, uint32_t esr)
+{
+	uint8_t state = can_error_state(esr);
+	if (state == hcan->err_state) {
+		return;
+	}
+	if (hcan->err_state == GS_CAN_STATE_BUS_OFF) {
+		hcan->err_restarted = true;
+	} else if (state == GS_CAN_STATE_BUS_OFF) {
+		hcan->bus_off_count++;
+	}
+	hcan->err_state = state;
+	hcan->err_pending = true;
 }
 
-uint32_t can_get_error_status(can_data_t *hcan)
+/* Called from the CANx_SCE interrupt for every protocol error and error
+ * state change. Only counts them, can_error_report() builds the frame.
+ * Returns true if a report is due. */
+bool can_error_irq(can_data_t *hcan)
 {
 	CAN_TypeDef *can = hcan->instance;
-	return can->ESR;
+	uint32_t esr = can->ESR;
+	unsigned lec = (esr & CAN_ESR_LEC) >> CAN_ESR_LEC_Pos;
+
+	if ((lec != 0) && (lec != 7)) {
+		hcan->err_lec[lec-1]++;
+		hcan->err_lec_seen |= 1 << (lec-1);
+		hcan->err_pending = true;
+		can->ESR = CAN_ESR_LEC; // 7 is never set by hardware, so the next error shows
+	}
+	can_error_update_state(hcan, esr);
+	can->MSR = CAN_MSR_ERRI;
+
+	return hcan->err_pending && ((timer_get() - hcan->err_report_us) >= hcan->err_interval_us);
+}
+
+void can_set_error_interval(can_data_t *hcan, uint32_t interval_us)
+{
+	hcan->err_interval_us = interval_us;
 }
 
-bool can_parse_error_status(uint32_t err, struct gs_host_frame *frame)
+/* Called from main(). True if errors were seen since the last report and
+ * the report interval has passed. */
+bool can_error_report_due(can_data_t *hcan, uint32_t now)
 {
+	// leaving bus off or the warning level raises no interrupt
+	int primask = disable_irq();
+	can_error_update_state(hcan, hcan->instance->ESR);
+	enable_irq(primask);
+
+	return hcan->err_pending && ((now - hcan->err_report_us) >= hcan->err_interval_us);
+}
+
+/* Sums up everything since the last report into one error frame: the
+ * current error state and counters, a bus off recovery and each kind of
+ * protocol error seen. */
+void can_error_report(can_data_t *hcan, uint32_t now, struct gs_host_frame *frame)
+{
+	uint32_t esr = hcan->instance->ESR;
+	uint8_t tec = (esr & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+	uint8_t rec = (esr & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+
 	frame->echo_id = 0xFFFFFFFF;
-	frame->can_id  = CAN_ERR_FLAG | CAN_ERR_CRTL;
+	frame->can_id  = CAN_ERR_FLAG | CAN_ERR_CNT;
 	frame->can_dlc = CAN_ERR_DLC;
-	frame->data[0] = CAN_ERR_LOSTARB_UNSPEC;
-	frame->data[1] = CAN_ERR_CRTL_UNSPEC;
-	frame->data[2] = CAN_ERR_PROT_UNSPEC;
-	frame->data[3] = CAN_ERR_PROT_LOC_UNSPEC;
-	frame->data[4] = CAN_ERR_TRX_UNSPEC;
-	frame->data[5] = 0;
-	frame->data[6] = 0;
-	frame->data[7] = 0;
-
-	if ((err & CAN_ESR_BOFF) != 0) {
-		frame->can_id |= CAN_ERR_BUSOFF;
-	}
-
-	/*
-	uint8_t tx_error_cnt = (err>>16) & 0xFF;
-	uint8_t rx_error_cnt = (err>>24) & 0xFF;
-	*/
-
-	if (err & CAN_ESR_EPVF) {
-		frame->data[1] |= CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE;
-	} else if (err & CAN_ESR_EWGF) {
-		frame->data[1] |= CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING;
-	}
-
-	uint8_t lec = (err>>4) & 0x07;
-	if (lec!=0) { /* protocol error */
-		switch (lec) {
-			case 0x01: /* stuff error */
-				frame->can_id |= CAN_ERR_PROT;
-				frame->data[2] |= CAN_ERR_PROT_STUFF;
-				break;
-			case 0x02: /* form error */
-				frame->can_id |= CAN_ERR_PROT;
-				frame->data[2] |= CAN_ERR_PROT_FORM;
-				break;
-			case 0x03: /* ack error */
-				frame->can_id |= CAN_ERR_ACK;
-				break;
-			case 0x04: /* bit recessive error */
-				frame->can_id |= CAN_ERR_PROT;
-				frame->data[2] |= CAN_ERR_PROT_BIT1;
+	memset(frame->data, 0, sizeof(frame->data));
+	frame->data[6] = tec;
+	frame->data[7] = rec;
+
+	int primask = disable_irq();
+
+	if (hcan->err_state != hcan->err_reported_state) {
+		switch (hcan->err_state) {
+			case GS_CAN_STATE_BUS_OFF:
+				frame->can_id |= CAN_ERR_BUSOFF;
 				break;
-			case 0x05: /* bit dominant error */
-				frame->can_id |= CAN_ERR_PROT;
-				frame->data[2] |= CAN_ERR_PROT_BIT0;
+			case GS_CAN_STATE_ERROR_PASSIVE:
+				frame->can_id |= CAN_ERR_CRTL;
+				frame->data[1] |= (tec >= 128) ? CAN_ERR_CRTL_TX_PASSIVE : 0;
+				frame->data[1] |= (rec >= 128) ? CAN_ERR_CRTL_RX_PASSIVE : 0;
 				break;
-			case 0x06: /* CRC error */
-				frame->can_id |= CAN_ERR_PROT;
-				frame->data[3] |= CAN_ERR_PROT_LOC_CRC_SEQ;
+			case GS_CAN_STATE_ERROR_WARNING:
+				frame->can_id |= CAN_ERR_CRTL;
+				frame->data[1] |= (tec >= 96) ? CAN_ERR_CRTL_TX_WARNING : 0;
+				frame->data[1] |= (rec >= 96) ? CAN_ERR_CRTL_RX_WARNING : 0;
 				break;
 			default:
+				frame->can_id |= CAN_ERR_CRTL;
+				frame->data[1] |= CAN_ERR_CRTL_ACTIVE;
 				break;
 		}
+		hcan->err_reported_state = hcan->err_state;
+	}
+	if (hcan->err_restarted) {
+		frame->can_id |= CAN_ERR_RESTARTED;
 	}
 
-	return true;
+	// err_lec_seen bits follow the LEC codes: stuff, form, ack, bit recessive, bit dominant, CRC
+	uint8_t seen = hcan->err_lec_seen;
+	if (seen & (1<<2)) {
+		frame->can_id |= CAN_ERR_ACK;
+	}
+	if (seen & ~(1<<2)) {
+		frame->can_id |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+		frame->data[2] |= (seen & (1<<0)) ? CAN_ERR_PROT_STUFF : 0;
+		frame->data[2] |= (seen & (1<<1)) ? CAN_ERR_PROT_FORM : 0;
+		frame->data[2] |= (seen & (1<<3)) ? CAN_ERR_PROT_BIT1 : 0;
+		frame->data[2] |= (seen & (1<<4)) ? CAN_ERR_PROT_BIT0 : 0;
+		frame->data[3] = (seen & (1<<5)) ? CAN_ERR_PROT_LOC_CRC_SEQ : CAN_ERR_PROT_LOC_UNSPEC;
+	}
+
+	hcan->err_lec_seen = 0;
+	hcan->err_restarted = false;
+	hcan->err_pending = false;
+	hcan->err_report_us = now;
+	hcan->bus_errors++;
+
+	enable_irq(primask);
 }
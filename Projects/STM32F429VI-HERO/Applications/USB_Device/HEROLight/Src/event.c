@@ -0,0 +1,62 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#include "event.h"
+#include "config.h"
+#include "util.h"
+#include "stm32f4xx.h"
+
+static volatile uint32_t pending_events;
+
+/* Callable from any interrupt. SysTick runs above the CAN and USB
+ * priority, so the flags are updated with an exclusive access. */
+void event_post(uint32_t events)
+{
+	uint32_t old;
+	do {
+		old = __LDREXW(&pending_events);
+	} while (__STREXW(old | events, &pending_events) != 0);
+}
+
+/* Returns and clears the pending events, sleeps until there is one. */
+uint32_t event_wait(void)
+{
+#if MAIN_LOOP_SLEEP
+	int primask = disable_irq();
+	while (pending_events == 0) {
+		__WFI(); // a pending interrupt ends it even while masked
+		enable_irq(primask);
+		primask = disable_irq();
+	}
+	uint32_t events = pending_events;
+	pending_events = 0;
+	enable_irq(primask);
+	return events;
+#else
+	pending_events = 0;
+	return EVENT_ALL; // run every stage each time, like a plain polling loop
+#endif
+}
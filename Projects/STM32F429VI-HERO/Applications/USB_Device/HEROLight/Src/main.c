@@ -30,8 +30,7 @@ THE SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 
-//#include "config.h"
-#define CAN_QUEUE_SIZE 4
+#include "config.h"
 
 #include "stm32f4xx_hal.h"
 #include "usbd_def.h"
@@ -45,6 +44,10 @@ THE SOFTWARE.
 #include "led.h"
 #include "dfu.h"
 #include "timer.h"
+#include "profile.h"
+#include "event.h"
+#include "periodic.h"
+#include "tx_at.h"
 //#include "flash.h"
 
 void SystemClock_Config(void);
@@ -63,13 +66,25 @@ static void Error_Handler(void)
   }
 }
 
-can_data_t hCAN;
+can_data_t hCAN[NUM_CAN_CHANNEL];
 USBD_HandleTypeDef hUSB;
 led_data_t hLED;
 
 queue_t *q_frame_pool;
-queue_t *q_from_host;
-queue_t *q_to_host;
+ring_t *q_from_host;
+ring_t *q_to_host;
+
+#if CAN_POOL_IN_CCMRAM
+#define CAN_POOL_SECTION __attribute__((section(".ccmram")))
+#else
+#define CAN_POOL_SECTION
+#endif
+
+/* statically placed, the heap is far too small for a useful pool */
+static struct gs_host_frame msgbuf[CAN_QUEUE_SIZE] CAN_POOL_SECTION __attribute__((aligned(4)));
+static queue_t frame_pool;
+static ring_t rings[2];
+static void *queue_bufs[3][CAN_QUEUE_SIZE];
 
 uint32_t received_count=0;
 
@@ -80,8 +95,6 @@ uint32_t received_count=0;
   */
 int main(void)
 {
-	uint32_t last_can_error_status = 0;
-	
 	/* STM32F429xx HAL library initialization */
 	HAL_Init();
 	
@@ -98,8 +111,11 @@ int main(void)
 	BSP_LED_On(LED3);
 	
 	
-	can_init(&hCAN, CAN1);
-	can_disable(&hCAN);
+	can_init(&hCAN[0], CAN1, 0);
+	can_init(&hCAN[1], CAN2, 1);
+	for (unsigned ch=0; ch<NUM_CAN_CHANNEL; ch++) {
+		can_disable(&hCAN[ch]);
+	}
 
 	led_init(&hLED,
 					LED1_GPIO_PORT, LED1_PIN, false, 
@@ -107,21 +123,35 @@ int main(void)
 	led_set_mode(&hLED, led_mode_off);
 
 	timer_init();
+	profile_init();
+
+
+	// q_from_host: USB interrupt -> main(), q_to_host: CAN interrupts -> main()
+	// q_to_host has more than one producer: the CAN RX and TX interrupts, and
+	// main() with interrupts masked. They count as the single producer ring_t
+	// allows only because CAN, USB and TIM2 share priority 5 and cannot
+	// preempt one another, see CAN_IRQ_PRIORITY.
+	// q_to_host has a slot for every frame of the pool, so an echo is never
+	// dropped: the host would leak the TX slot waiting for it.
+	q_frame_pool = &frame_pool;
+	q_from_host  = &rings[0];
+	q_to_host    = &rings[1];
+	queue_init(q_frame_pool, queue_bufs[0], CAN_QUEUE_SIZE);
+	ring_init(q_from_host,   queue_bufs[1], CAN_QUEUE_SIZE);
+	ring_init(q_to_host,     queue_bufs[2], CAN_QUEUE_SIZE);
 
-
-	q_frame_pool = queue_create(CAN_QUEUE_SIZE);
-	q_from_host  = queue_create(CAN_QUEUE_SIZE);
-	q_to_host    = queue_create(CAN_QUEUE_SIZE);
-
-	struct gs_host_frame *msgbuf = calloc(CAN_QUEUE_SIZE, sizeof(struct gs_host_frame));
 	for (unsigned i=0; i<CAN_QUEUE_SIZE; i++) {
 		queue_push_back(q_frame_pool, &msgbuf[i]);
 	}
+	periodic_init(q_frame_pool);
+	tx_at_init();
 
 	USBD_Init(&hUSB, &FS_Desc, 0);
 	USBD_RegisterClass(&hUSB, &USBD_GS_CAN);
-	USBD_GS_CAN_Init(&hUSB, q_frame_pool, q_from_host, &hLED);
-	USBD_GS_CAN_SetChannel(&hUSB, 0, &hCAN);
+	USBD_GS_CAN_Init(&hUSB, q_frame_pool, q_from_host, q_to_host, &hLED);
+	for (unsigned ch=0; ch<NUM_CAN_CHANNEL; ch++) {
+		USBD_GS_CAN_SetChannel(&hUSB, ch, &hCAN[ch]);
+	}
 	USBD_Start(&hUSB);
 
 #ifdef CAN_S_GPIO_Port
@@ -129,70 +159,89 @@ int main(void)
 #endif
     		
 	while (1) {
-		
+		// sleeps until an interrupt posts work, see MAIN_LOOP_SLEEP
+		uint32_t events = event_wait();
+		PROFILE_BEGIN(PROFILE_LOOP);
+
 		/* additional loop blink */
-		static long time0_us = 0;
-		long time1_us = timer_get();
-		long time_dur = time1_us - time0_us;
-		if (time_dur < 0 || time_dur > 500e3) {
-			BSP_LED_Toggle(LED3);
-			time0_us = time1_us;
+		PROFILE_BEGIN(PROFILE_LOOP_BLINK);
+		if (events & EVENT_TICK) {
+			static long time0_us = 0;
+			long time1_us = timer_get();
+			long time_dur = time1_us - time0_us;
+			if (time_dur < 0 || time_dur > 500e3) {
+				BSP_LED_Toggle(LED3);
+				time0_us = time1_us;
+			}
 		}
+		PROFILE_END(PROFILE_LOOP_BLINK);
 		
-		struct gs_host_frame *frame = queue_pop_front(q_from_host);
-		if (frame != 0) { // send can message from host
-			if (can_send(&hCAN, frame)) {
-			        // Echo sent frame back to host
-			        frame->timestamp_us = timer_get();
-				send_to_host_or_enqueue(frame);
-				
-				led_indicate_trx(&hLED, led_2);
-			} else {
-				queue_push_front(q_from_host, frame); // retry later
+		PROFILE_BEGIN(PROFILE_LOOP_FROM_HOST);
+		if (events & (EVENT_FROM_HOST | EVENT_CAN_TX)) {
+			struct gs_host_frame *frame;
+			while ((frame = ring_peek(q_from_host)) != 0) {
+				if (frame->channel >= NUM_CAN_CHANNEL) {
+					ring_pop(q_from_host);
+					queue_push_back(q_frame_pool, frame); // no such channel
+				} else if (frame->flags & GS_CAN_FLAG_TX_AT) {
+					if (!tx_at_push(&hCAN[frame->channel], frame)) {
+						break; // all held, retried once one is released
+					}
+					ring_pop(q_from_host);
+				} else if (can_send(&hCAN[frame->channel], frame)) { // send can message from host
+					// echoed by can_tx_irq_handler() once it is on the bus
+					ring_pop(q_from_host);
+				} else {
+					break; // TX queue full, retried on EVENT_CAN_TX
+				}
 			}
 		}
+		PROFILE_END(PROFILE_LOOP_FROM_HOST);
 
-		if (USBD_GS_CAN_TxReady(&hUSB)) {
-			send_to_host();
+		PROFILE_BEGIN(PROFILE_LOOP_TO_HOST);
+		if ((events & EVENT_TO_HOST) && USBD_GS_CAN_TxReady(&hUSB)) {
+			send_to_host(); // DataIn posts EVENT_TO_HOST again for the rest
 		}
-
-		if (can_is_rx_pending(&hCAN)) {
-			struct gs_host_frame *frame = queue_pop_front(q_frame_pool);
-			if ((frame != 0) && can_receive(&hCAN, frame)) {
-             			received_count++;
-
-				frame->timestamp_us = timer_get();
-				frame->echo_id = 0xFFFFFFFF; // not a echo frame
-				frame->channel = 0;
-				frame->flags = 0;
-				frame->reserved = 0;
-				
-				send_to_host_or_enqueue(frame);
-
-				led_indicate_trx(&hLED, led_1);
-
-			} else {
-				queue_push_back(q_frame_pool, frame);
+		PROFILE_END(PROFILE_LOOP_TO_HOST);
+
+		PROFILE_BEGIN(PROFILE_LOOP_CHANNELS);
+		// Frames also go back to the pool from interrupts: CAN TX complete, a
+		// host frame dropped on OUT, tx_at_stop(), and decimation and periodic
+		// handing back a frame they just took. All but the last two post an
+		// event, and those two leave the pool as it was, so every pass after
+		// a refill runs through here.
+		USBD_GS_CAN_ResumeReceive(&hUSB); // host frames were held off while the pool was empty
+
+		for (unsigned ch=0; ch<NUM_CAN_CHANNEL; ch++) {
+			if (hCAN[ch].rx_irq_masked && !queue_is_empty(q_frame_pool)) {
+				can_rx_irq_unmask(&hCAN[ch]); // frames were returned to the pool
 			}
 
-		}
+			if ((events & (EVENT_CAN_ERROR | EVENT_TICK)) == 0) {
+				continue;
+			}
 
-		uint32_t can_err = can_get_error_status(&hCAN);
-		if (can_err != last_can_error_status) {
-			struct gs_host_frame *frame = queue_pop_front(q_frame_pool);
-			if (frame != 0) {
-				frame->timestamp_us = timer_get();
-				if (can_parse_error_status(can_err, frame)) {
+			// at most one error frame per interval, whatever happened meanwhile is summed up in it
+			uint32_t now = timer_get();
+			if (can_error_report_due(&hCAN[ch], now)) {
+				struct gs_host_frame *frame = queue_pop_front(q_frame_pool);
+				if (frame != 0) {
+					frame->timestamp_us = now;
+					frame->channel = ch;
+					can_error_report(&hCAN[ch], now, frame);
 					send_to_host_or_enqueue(frame);
-					last_can_error_status = can_err;
-				} else {
-					queue_push_back(q_frame_pool, frame);
 				}
-
 			}
 		}
+		PROFILE_END(PROFILE_LOOP_CHANNELS);
+
+		PROFILE_BEGIN(PROFILE_LOOP_LED);
+		if (events & EVENT_TICK) {
+			led_update(&hLED);
+		}
+		PROFILE_END(PROFILE_LOOP_LED);
 
-		led_update(&hLED);
+		PROFILE_END(PROFILE_LOOP);
 
 		if (USBD_GS_CAN_DfuDetachRequested(&hUSB)) {
 			dfu_run_bootloader();
@@ -264,10 +313,23 @@ void SystemClock_Config(void)
   }
 }
 
+/* q_to_host is produced from CAN interrupt level, keep those out while
+ * main() adds a frame of its own */
+static void enqueue_to_host(struct gs_host_frame *frame)
+{
+	int primask = disable_irq();
+	if (!ring_push(q_to_host, frame)) {
+		queue_push_back_i(q_frame_pool, frame);
+		hCAN[frame->channel].to_host_dropped++;
+	}
+	enable_irq(primask);
+	event_post(EVENT_TO_HOST);
+}
+
 bool send_to_host_or_enqueue(struct gs_host_frame *frame)
 {
-	if (USBD_GS_CAN_GetProtocolVersion(&hUSB) == 2) {
-		queue_push_back(q_to_host, frame);
+	if ((USBD_GS_CAN_GetProtocolVersion(&hUSB) == 2) || USBD_GS_CAN_GetBatchIn(&hUSB)) {
+		enqueue_to_host(frame);
 		return true;
 
 	} else {
@@ -276,7 +338,7 @@ bool send_to_host_or_enqueue(struct gs_host_frame *frame)
 			queue_push_back(q_frame_pool, frame);
 			retval = true;
 		} else {
-			queue_push_back(q_to_host, frame);
+			enqueue_to_host(frame);
 		}
 		return retval;
 	}
@@ -284,18 +346,166 @@ bool send_to_host_or_enqueue(struct gs_host_frame *frame)
 
 void send_to_host(void)
 {
-        struct gs_host_frame *frame = queue_pop_front(q_to_host);
+	if (USBD_GS_CAN_GetBatchIn(&hUSB)) {
+		// pack everything that is queued into one multi packet transfer
+		USBD_GS_CAN_SendFrameBatch(&hUSB, q_to_host);
+		return;
+	}
+
+        struct gs_host_frame *frame = ring_peek(q_to_host);
 
 	if(!frame)
 	  return;
 	
 	if (USBD_GS_CAN_SendFrame(&hUSB, frame) == USBD_OK) {
+	        ring_pop(q_to_host);
 	        queue_push_back(q_frame_pool, frame);
+	}
+}
+
+
+/**
+  * @brief  Drains the bxCAN receive FIFOs into the frame pool, FIFO 0 first.
+  *         Called from the CANx_RXy interrupt handlers, which run at the
+  *         same priority as the USB interrupt.
+  * @param  hcan: channel the interrupt belongs to
+  * @param  fifo: receive FIFO that raised the interrupt (0 or 1)
+  * @retval None
+  */
+void can_rx_irq_handler(can_data_t *hcan, uint8_t fifo)
+{
+	PROFILE_BEGIN(PROFILE_CAN_RX_IRQ);
+	can_check_rx_overrun(hcan, fifo);
+
+	while (can_is_rx_pending(hcan)) {
+		struct gs_host_frame *frame = queue_pop_front_i(q_frame_pool);
+		if (frame == 0) {
+			// leave the rest in hardware until main() frees a buffer,
+			// an overrun meanwhile is flagged on the next frame
+			can_rx_irq_mask(hcan);
+			hcan->rx_pool_empty++;
+			break;
+		}
+
+		can_receive(hcan, frame);
+		received_count++;
+
+		frame->timestamp_us = timer_get();
+		frame->echo_id = 0xFFFFFFFF; // not a echo frame
+		frame->channel = hcan->channel;
+		frame->flags = 0;
+		frame->reserved = 0;
+
+		if (can_decimate(hcan, frame)) {
+			queue_push_front_i(q_frame_pool, frame); // thinned out, receive the next one into it
+			continue;
+		}
+
+		if (hcan->rx_overflow) {
+			frame->flags |= GS_CAN_FLAG_OVERFLOW;
+		}
+		if (!ring_push(q_to_host, frame)) {
+			queue_push_front_i(q_frame_pool, frame);
+			hcan->to_host_dropped++;
+			hcan->rx_overflow = true;
+			continue;
+		}
+		hcan->rx_overflow = false;
+		event_post(EVENT_TO_HOST);
+
+		led_indicate_trx(&hLED, led_1);
+	}
+	PROFILE_END(PROFILE_CAN_RX_IRQ);
+}
+
+/* echoes a finished host frame, and an error frame after it if it failed */
+static void can_tx_report(can_data_t *hcan, struct gs_host_frame *frame, can_tx_result_t result, uint32_t now)
+{
+	struct gs_host_frame *error_frame = 0;
+	frame->timestamp_us = now;
+
+	if (result == can_tx_ok) {
+		frame->flags &= ~GS_CAN_FLAG_TX_FAILED;
+		led_indicate_trx(&hLED, led_2);
+	} else {
+		// the frame never made it onto the bus. It is echoed all the same, the host
+		// releases its TX slot on the echo_id and sees the failure in the flags.
+		// The error frame after it tells why, if a buffer is left for it.
+		frame->flags |= GS_CAN_FLAG_TX_FAILED;
+		error_frame = queue_pop_front_i(q_frame_pool);
+		if (error_frame != 0) {
+			error_frame->channel = frame->channel;
+			error_frame->timestamp_us = now;
+			can_parse_tx_error(result, error_frame);
+		}
+	}
+
+	if (frame->echo_id == PERIODIC_ECHO_ID) {
+		queue_push_back_i(q_frame_pool, frame); // periodic frame without echo
+	} else if ((frame->echo_id == PERIODIC_RX_ECHO_ID) && (result != can_tx_ok)) {
+		queue_push_back_i(q_frame_pool, frame); // periodic frame to be reported as received, but it was not sent
 	} else {
-	        queue_push_front(q_to_host, frame);
+		ring_push(q_to_host, frame); // always fits, see main()
+	}
+
+	if ((error_frame != 0) && !ring_push(q_to_host, error_frame)) {
+		queue_push_back_i(q_frame_pool, error_frame);
+		hcan->to_host_dropped++;
 	}
+	event_post(EVENT_TO_HOST);
 }
 
+/**
+  * @brief  Reports a host frame that will not be sent back as aborted, the
+  *         way an aborted mailbox is. Must run at CAN interrupt priority,
+  *         e.g. from the USB interrupt.
+  * @param  hcan: channel the frame was meant for
+  * @param  frame: the host frame, echoed with GS_CAN_FLAG_TX_FAILED
+  * @retval None
+  */
+void can_tx_drop(can_data_t *hcan, struct gs_host_frame *frame)
+{
+	hcan->tx_failed++;
+	can_tx_report(hcan, frame, can_tx_aborted, timer_get());
+}
+
+/**
+  * @brief  Echoes frames back to the host once their mailbox completed.
+  *         Called from the CANx_TX interrupt handlers, which run at the
+  *         same priority as the USB interrupt.
+  * @param  hcan: channel the interrupt belongs to
+  * @retval None
+  */
+void can_tx_irq_handler(can_data_t *hcan)
+{
+	PROFILE_BEGIN(PROFILE_CAN_TX_IRQ);
+	uint32_t now = timer_get();
+	struct gs_host_frame *frame;
+	can_tx_result_t result;
+
+	while ((frame = can_tx_complete(hcan, &result)) != 0) {
+		can_tx_report(hcan, frame, result, now);
+	}
+
+	can_tx_schedule(hcan); // refill the mailboxes that just became free
+	event_post(EVENT_CAN_TX);
+	PROFILE_END(PROFILE_CAN_TX_IRQ);
+}
+
+/**
+  * @brief  Counts bxCAN errors and wakes the main loop once a report is due.
+  *         Called from the CANx_SCE interrupt handlers.
+  * @param  hcan: channel the interrupt belongs to
+  * @retval None
+  */
+void can_sce_irq_handler(can_data_t *hcan)
+{
+	PROFILE_BEGIN(PROFILE_CAN_SCE_IRQ);
+	if (can_error_irq(hcan)) {
+		event_post(EVENT_CAN_ERROR);
+	}
+	PROFILE_END(PROFILE_CAN_SCE_IRQ);
+}
 
 /**
   * @brief This function provides accurate delay (in milliseconds) based 
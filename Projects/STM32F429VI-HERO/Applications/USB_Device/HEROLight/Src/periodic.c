@@ -0,0 +1,187 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#include "periodic.h"
+#include <string.h>
+#include "config.h"
+#include "timer.h"
+
+/* The table is only touched at CAN/USB/TIM2 interrupt priority, so the
+ * handlers never interrupt each other while working on it. */
+
+typedef struct {
+	can_data_t *hcan; /* 0 = slot unused */
+	uint32_t can_id;
+	uint8_t can_dlc;
+	uint8_t flags;
+	uint8_t data[8];
+	uint32_t period_us;
+	uint32_t remaining; /* frames left to send, 0 = unlimited */
+	uint32_t next_us;
+} periodic_slot_t;
+
+static periodic_slot_t slots[CAN_PERIODIC_SLOTS];
+static queue_t *frame_pool;
+static volatile bool table_changed;
+
+void periodic_init(queue_t *q_frame_pool)
+{
+	frame_pool = q_frame_pool;
+	memset(slots, 0, sizeof(slots));
+}
+
+/* have the TIM2 interrupt pick up the changed table */
+static void periodic_reschedule(void)
+{
+	table_changed = true;
+	HAL_NVIC_SetPendingIRQ(TIM2_IRQn);
+}
+
+bool periodic_set(can_data_t *hcan, const struct gs_device_periodic *periodic)
+{
+	if ((periodic->slot >= CAN_PERIODIC_SLOTS) || (periodic->can_dlc > 8)) {
+		return false;
+	}
+	periodic_slot_t *slot = &slots[periodic->slot];
+
+	if (periodic->flags & GS_PERIODIC_FLAG_UPDATE_DATA) {
+		if (slot->hcan != hcan) {
+			return false;
+		}
+		slot->can_dlc = periodic->can_dlc;
+		memcpy(slot->data, periodic->data, sizeof(slot->data));
+		return true;
+	}
+
+	if (periodic->period_us == 0) {
+		slot->hcan = 0;
+	} else if (periodic->period_us < GS_PERIODIC_MIN_PERIOD_US) {
+		return false;
+	} else {
+		slot->can_id = periodic->can_id;
+		slot->can_dlc = periodic->can_dlc;
+		slot->flags = periodic->flags;
+		memcpy(slot->data, periodic->data, sizeof(slot->data));
+		slot->period_us = periodic->period_us;
+		slot->remaining = periodic->count;
+		slot->next_us = timer_get();
+		slot->hcan = hcan;
+	}
+
+	periodic_reschedule();
+	return true;
+}
+
+void periodic_stop(can_data_t *hcan)
+{
+	for (unsigned i=0; i<CAN_PERIODIC_SLOTS; i++) {
+		if (slots[i].hcan == hcan) {
+			slots[i].hcan = 0;
+		}
+	}
+	periodic_reschedule();
+}
+
+/* queues one frame of a due slot and moves it to its next deadline */
+static void periodic_fire(periodic_slot_t *slot, uint32_t now)
+{
+	can_data_t *hcan = slot->hcan;
+
+	// nothing goes out before the host starts the channel, the phase keeps running
+	if (can_is_enabled(hcan)) {
+		struct gs_host_frame *frame = queue_pop_front_i(frame_pool);
+		if (frame == 0) {
+			hcan->periodic_missed++;
+		} else {
+			frame->echo_id = (slot->flags & GS_PERIODIC_FLAG_ECHO) ? PERIODIC_RX_ECHO_ID : PERIODIC_ECHO_ID;
+			frame->can_id = slot->can_id;
+			frame->can_dlc = slot->can_dlc;
+			frame->channel = hcan->channel;
+			frame->flags = 0;
+			frame->reserved = 0;
+			memcpy(frame->data, slot->data, sizeof(frame->data));
+
+			if (can_send(hcan, frame)) {
+				hcan->periodic_frames++;
+				if ((slot->remaining != 0) && (--slot->remaining == 0)) {
+					slot->hcan = 0;
+					return;
+				}
+			} else {
+				queue_push_front_i(frame_pool, frame);
+				hcan->periodic_missed++;
+			}
+		}
+	}
+
+	slot->next_us += slot->period_us;
+	while ((int32_t)(slot->next_us - now) <= 0) {
+		// stalled for whole periods, drop them rather than sending a burst
+		slot->next_us += slot->period_us;
+		hcan->periodic_missed++;
+	}
+}
+
+/* Called for every TIM2 interrupt. Sends the due slots and arms the
+ * compare for the earliest of the remaining ones. */
+void periodic_irq_handler(void)
+{
+	if (!timer_compare_clear(TIMER_CC_PERIODIC) && !table_changed) {
+		return;
+	}
+	table_changed = false;
+
+	uint32_t next_us = 0;
+	do {
+		uint32_t now = timer_get();
+		bool active = false;
+
+		for (unsigned i=0; i<CAN_PERIODIC_SLOTS; i++) {
+			periodic_slot_t *slot = &slots[i];
+			if (slot->hcan == 0) {
+				continue;
+			}
+			if ((int32_t)(slot->next_us - now) <= 0) {
+				periodic_fire(slot, now);
+				if (slot->hcan == 0) {
+					continue; // count reached
+				}
+			}
+			if (!active || ((int32_t)(slot->next_us - next_us) < 0)) {
+				next_us = slot->next_us;
+				active = true;
+			}
+		}
+
+		if (!active) {
+			timer_compare_disarm(TIMER_CC_PERIODIC);
+			return;
+		}
+		timer_compare_arm(TIMER_CC_PERIODIC, next_us);
+
+		// the compare only fires on a match, a deadline that passed while arming is handled here
+	} while ((int32_t)(next_us - timer_get()) <= 0);
+}
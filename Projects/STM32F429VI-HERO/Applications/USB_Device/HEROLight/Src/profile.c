@@ -0,0 +1,91 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#include "profile.h"
+#include "util.h"
+
+#if PROFILE_ENABLE
+
+typedef struct {
+	uint32_t hits;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+} profile_data_t;
+
+static profile_data_t zones[PROFILE_ZONE_COUNT];
+
+void profile_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	profile_reset();
+}
+
+/* Each zone is only recorded from one priority level, so writers never meet.
+ * GS_USB_BREQ_GET_PROFILE reads and clears the zones from the USB interrupt,
+ * though, which may hit the main loop halfway through a record: the update
+ * is done with interrupts masked so that it only ever sees whole ones. */
+void profile_record(profile_zone_t zone, uint32_t cycles)
+{
+	profile_data_t *z = &zones[zone];
+	int primask = disable_irq();
+
+	if ((z->hits == 0) || (cycles < z->min)) {
+		z->min = cycles;
+	}
+	if (cycles > z->max) {
+		z->max = cycles;
+	}
+	z->total += cycles;
+	z->hits++;
+
+	enable_irq(primask);
+}
+
+/* called at the USB interrupt priority, see profile_record() */
+void profile_get(profile_zone_t zone, uint32_t *hits, uint32_t *min, uint32_t *max, uint32_t *avg)
+{
+	profile_data_t *z = &zones[zone];
+
+	*hits = z->hits;
+	*min = z->min;
+	*max = z->max;
+	*avg = (z->hits > 0) ? (uint32_t)(z->total / z->hits) : 0;
+}
+
+void profile_reset(void)
+{
+	for (unsigned i=0; i<PROFILE_ZONE_COUNT; i++) {
+		zones[i].hits = 0;
+		zones[i].min = 0;
+		zones[i].max = 0;
+		zones[i].total = 0;
+	}
+}
+
+#endif
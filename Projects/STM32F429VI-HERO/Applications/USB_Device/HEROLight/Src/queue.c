@@ -26,14 +26,37 @@ THE SOFTWARE.
 
 #include <queue.h>
 #include <stdlib.h>
+#include "stm32f4xx.h"
 
 queue_t *queue_create(unsigned max_elements){
 	queue_t *q = calloc(1, sizeof(queue_t));
-	q->buf = calloc(max_elements, sizeof(void*));
-	q->max_elements = max_elements;
+	queue_init(q, calloc(max_elements, sizeof(void*)), max_elements);
 	return q;
 }
 
+/* set up a queue on caller provided storage for max_elements pointers */
+void queue_init(queue_t *q, void **buf, unsigned max_elements)
+{
+	q->buf = buf;
+	q->max_elements = max_elements;
+	q->first = 0;
+	q->size = 0;
+	q->high_water = 0;
+	q->low_water = max_elements;
+}
+
+/* most elements ever held */
+unsigned queue_high_water(queue_t *q)
+{
+	return q->high_water;
+}
+
+/* fewest elements left after a pop, max_elements if never popped */
+unsigned queue_low_water(queue_t *q)
+{
+	return q->low_water;
+}
+
 void queue_destroy(queue_t *q)
 {
 	free(q->buf);
@@ -62,6 +85,9 @@ bool queue_push_back(queue_t *q, void *el)
 		unsigned pos = (q->first + q->size) % q->max_elements;
 		q->buf[pos] = el;
 		q->size += 1;
+		if (q->size > q->high_water) {
+			q->high_water = q->size;
+		}
 		retval = true;
 	}
 
@@ -81,6 +107,9 @@ bool queue_push_front(queue_t *q, void *el)
 		}
 		q->buf[q->first] = el;
 		q->size += 1;
+		if (q->size > q->high_water) {
+			q->high_water = q->size;
+		}
 		retval = true;
 	}
 	enable_irq(primask);
@@ -95,6 +124,9 @@ void *queue_pop_front(queue_t *q)
 		el = q->buf[q->first];
 		q->first = (q->first + 1) % q->max_elements;
 		q->size -= 1;
+		if (q->size < q->low_water) {
+			q->low_water = q->size;
+		}
 	}
 	enable_irq(primask);
 	return el;
@@ -118,6 +150,9 @@ bool queue_push_back_i(queue_t *q, void *el)
 		unsigned pos = (q->first + q->size) % q->max_elements;
 		q->buf[pos] = el;
 		q->size += 1;
+		if (q->size > q->high_water) {
+			q->high_water = q->size;
+		}
 		retval = true;
 	}
 
@@ -135,6 +170,9 @@ bool queue_push_front_i(queue_t *q, void *el)
 		}
 		q->buf[q->first] = el;
 		q->size += 1;
+		if (q->size > q->high_water) {
+			q->high_water = q->size;
+		}
 		retval = true;
 	}
 	return retval;
@@ -147,6 +185,81 @@ void *queue_pop_front_i(queue_t *q)
 		el = q->buf[q->first];
 		q->first = (q->first + 1) % q->max_elements;
 		q->size -= 1;
+		if (q->size < q->low_water) {
+			q->low_water = q->size;
+		}
+	}
+	return el;
+}
+
+/* max_elements must be a power of two, anything else is rounded down */
+void ring_init(ring_t *r, void **buf, unsigned max_elements)
+{
+	unsigned size = 1;
+	while ((size << 1) != 0 && (size << 1) <= max_elements) {
+		size <<= 1;
+	}
+
+	r->buf = buf;
+	r->mask = size - 1;
+	r->head = 0;
+	r->tail = 0;
+	r->high_water = 0;
+}
+
+unsigned ring_size(ring_t *r)
+{
+	return r->head - r->tail;
+}
+
+bool ring_is_empty(ring_t *r)
+{
+	return r->head == r->tail;
+}
+
+unsigned ring_high_water(ring_t *r)
+{
+	return r->high_water;
+}
+
+bool ring_push(ring_t *r, void *el)
+{
+	unsigned head = r->head;
+	unsigned size = head - r->tail;
+
+	if (size > r->mask) {
+		return false;
+	}
+
+	r->buf[head & r->mask] = el;
+	__DMB(); // slot contents must be visible before the consumer sees the new head
+	r->head = head + 1;
+
+	if (size + 1 > r->high_water) {
+		r->high_water = size + 1;
+	}
+	return true;
+}
+
+void *ring_peek(ring_t *r)
+{
+	unsigned tail = r->tail;
+
+	if (tail == r->head) {
+		return 0;
+	}
+
+	__DMB(); // don't read the slot ahead of the head that published it
+	return r->buf[tail & r->mask];
+}
+
+void *ring_pop(ring_t *r)
+{
+	void *el = ring_peek(r);
+
+	if (el != 0) {
+		__DMB(); // finish reading the slot before handing it back to the producer
+		r->tail = r->tail + 1;
 	}
 	return el;
 }
@@ -27,6 +27,12 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f4xx_it.h"
+#include "profile.h"
+#include "event.h"
+#include "timer.h"
+#include "periodic.h"
+#include "tx_at.h"
+#include "usbd_gs_can.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -35,6 +41,7 @@
 
 extern PCD_HandleTypeDef hpcd_USB;
 extern USBD_HandleTypeDef USBD_Device;
+extern can_data_t hCAN[NUM_CAN_CHANNEL];
 
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
@@ -139,6 +146,7 @@ void PendSV_Handler(void)
 void SysTick_Handler(void)
 {
   HAL_IncTick();
+  event_post(EVENT_TICK);
 }
 
 /******************************************************************************/
@@ -155,12 +163,16 @@ void SysTick_Handler(void)
   */
 void OTG_FS_IRQHandler(void)
 {
+  PROFILE_BEGIN(PROFILE_USB_IRQ);
   HAL_PCD_IRQHandler(&hpcd_USB);
+  PROFILE_END(PROFILE_USB_IRQ);
 }
 
 void OTG_HS_IRQHandler(void)
 {
+  PROFILE_BEGIN(PROFILE_USB_IRQ);
   HAL_PCD_IRQHandler(&hpcd_USB);
+  PROFILE_END(PROFILE_USB_IRQ);
 }
 
 /**
@@ -244,6 +256,101 @@ void OTG_HS_WKUP_IRQHandler(void)
 }
 
 
+/**
+  * @brief  This function handles CAN1 TX interrupt request.
+  * @param  None
+  * @retval None
+  */
+void CAN1_TX_IRQHandler(void)
+{
+  can_tx_irq_handler(&hCAN[0]);
+}
+
+/**
+  * @brief  This function handles CAN1 RX FIFO 0 interrupt request.
+  * @param  None
+  * @retval None
+  */
+void CAN1_RX0_IRQHandler(void)
+{
+  can_rx_irq_handler(&hCAN[0], 0);
+}
+
+/**
+  * @brief  This function handles CAN1 RX FIFO 1 interrupt request.
+  * @param  None
+  * @retval None
+  */
+void CAN1_RX1_IRQHandler(void)
+{
+  can_rx_irq_handler(&hCAN[0], 1);
+}
+
+/**
+  * @brief  This function handles CAN2 TX interrupt request.
+  * @param  None
+  * @retval None
+  */
+void CAN2_TX_IRQHandler(void)
+{
+  can_tx_irq_handler(&hCAN[1]);
+}
+
+/**
+  * @brief  This function handles CAN2 RX FIFO 0 interrupt request.
+  * @param  None
+  * @retval None
+  */
+void CAN2_RX0_IRQHandler(void)
+{
+  can_rx_irq_handler(&hCAN[1], 0);
+}
+
+/**
+  * @brief  This function handles CAN2 RX FIFO 1 interrupt request.
+  * @param  None
+  * @retval None
+  */
+void CAN2_RX1_IRQHandler(void)
+{
+  can_rx_irq_handler(&hCAN[1], 1);
+}
+
+/**
+  * @brief  This function handles CAN1 status change / error interrupt request.
+  * @param  None
+  * @retval None
+  */
+void CAN1_SCE_IRQHandler(void)
+{
+  can_sce_irq_handler(&hCAN[0]);
+}
+
+/**
+  * @brief  This function handles CAN2 status change / error interrupt request.
+  * @param  None
+  * @retval None
+  */
+void CAN2_SCE_IRQHandler(void)
+{
+  can_sce_irq_handler(&hCAN[1]);
+}
+
+/**
+  * @brief  This function handles TIM2 global interrupt request.
+  * @param  None
+  * @retval None
+  */
+void TIM2_IRQHandler(void)
+{
+  PROFILE_BEGIN(PROFILE_TIMER_IRQ);
+  timer_irq_handler();
+  periodic_irq_handler();
+  tx_at_irq_handler();
+  USBD_GS_CAN_InWindowIrqHandler();
+  PROFILE_END(PROFILE_TIMER_IRQ);
+}
+
 /**
   * @brief  This function handles External line 0 interrupt request.
   * @param  None
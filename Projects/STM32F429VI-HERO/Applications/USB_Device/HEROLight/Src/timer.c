@@ -26,6 +26,10 @@ THE SOFTWARE.
 
 #include "timer.h"
 #include "stm32f4xx_hal.h"
+#include "util.h"
+
+/* upper half of timer_get64(), counted by the TIM2 update interrupt */
+static volatile uint32_t timer_hi;
 
 void timer_init(void)
 {
@@ -42,9 +46,66 @@ void timer_init(void)
 	TIM2->ARR = 0xFFFFFFFF;
 	TIM2->CR1 |= TIM_CR1_CEN;
 	TIM2->EGR = TIM_EGR_UG;
+	TIM2->SR = 0;
+
+	TIM2->DIER = TIM_DIER_UIE;
+	// the periodic and tx_at handlers share the frame pool and the TX queues
+	// with the CAN and USB interrupts, which must not preempt them
+	HAL_NVIC_SetPriority(TIM2_IRQn, TIMER_IRQ_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(TIM2_IRQn);
 }
 
 uint32_t timer_get(void)
 {
 	return TIM2->CNT;
 }
+
+uint64_t timer_get64(void)
+{
+	int primask = disable_irq();
+	uint32_t hi = timer_hi;
+	uint32_t lo = TIM2->CNT;
+	if ((TIM2->SR & TIM_SR_UIF) && (lo < 0x80000000)) {
+		hi++; // wrapped, but the update interrupt has not been serviced yet
+	}
+	enable_irq(primask);
+	return ((uint64_t)hi << 32) | lo;
+}
+
+void timer_irq_handler(void)
+{
+	if (TIM2->SR & TIM_SR_UIF) {
+		TIM2->SR = ~TIM_SR_UIF;
+		timer_hi++;
+	}
+}
+
+/* The compare only fires on an exact match, callers have to check
+ * themselves whether at_us already passed while arming. */
+void timer_compare_arm(unsigned cc, uint32_t at_us)
+{
+	int primask = disable_irq();
+	(&TIM2->CCR1)[cc-1] = at_us;
+	TIM2->SR = ~(TIM_SR_CC1IF << (cc-1));
+	TIM2->DIER |= TIM_DIER_CC1IE << (cc-1);
+	enable_irq(primask);
+}
+
+void timer_compare_disarm(unsigned cc)
+{
+	int primask = disable_irq();
+	TIM2->DIER &= ~(TIM_DIER_CC1IE << (cc-1));
+	TIM2->SR = ~(TIM_SR_CC1IF << (cc-1));
+	enable_irq(primask);
+}
+
+/* returns whether the compare of an armed channel fired, and acknowledges it */
+bool timer_compare_clear(unsigned cc)
+{
+	uint32_t flag = TIM_SR_CC1IF << (cc-1);
+	if ((TIM2->DIER & (TIM_DIER_CC1IE << (cc-1))) && (TIM2->SR & flag)) {
+		TIM2->SR = ~flag;
+		return true;
+	}
+	return false;
+}
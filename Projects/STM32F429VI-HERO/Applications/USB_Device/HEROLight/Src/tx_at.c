@@ -0,0 +1,186 @@
+/*
+
+The MIT License (MIT)
+
+Copyright (c) 2016 Hubert Denkmair
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*/
+
+#include "tx_at.h"
+#include "config.h"
+#include "timer.h"
+#include "event.h"
+#include "util.h"
+#include "main.h"
+
+/* retry interval while the channel's TX queue is full, about one short frame at 1 Mbit/s */
+#define TX_AT_RETRY_US 50
+
+typedef struct {
+	uint32_t at_us;
+	struct gs_host_frame *frame;
+	can_data_t *hcan;
+	bool expired; /* already due on arrival, left out of the lateness statistics */
+} tx_at_entry_t;
+
+/* sorted by falling release time: the next one is last */
+static tx_at_entry_t tx_at_queue[CAN_TX_AT_QUEUE_SIZE];
+static unsigned tx_at_len;
+
+void tx_at_init(void)
+{
+	tx_at_len = 0;
+}
+
+/* closes the gaps of entries whose frame was handed on, from the given one up */
+static void tx_at_compact(unsigned from)
+{
+	unsigned kept = from;
+	for (unsigned i=from; i<tx_at_len; i++) {
+		if (tx_at_queue[i].frame != 0) {
+			tx_at_queue[kept++] = tx_at_queue[i];
+		}
+	}
+	tx_at_len = kept;
+}
+
+/* Releases the due frames and arms the compare for the next one.
+ * Must run at TIM2 interrupt level or with interrupts disabled. */
+static void tx_at_run(void)
+{
+	uint32_t next_us;
+	do {
+		uint32_t now = timer_get();
+
+		// tx_at_queue[due..] are due, the one to go first last
+		unsigned due = tx_at_len;
+		while ((due > 0) && ((int32_t)(now - tx_at_queue[due - 1].at_us) >= 0)) {
+			due--;
+		}
+
+		// a channel with a full TX queue keeps its frames, and their order,
+		// but does not hold up the other one
+		uint32_t blocked = 0;
+		for (unsigned i=tx_at_len; i>due; i--) {
+			tx_at_entry_t *entry = &tx_at_queue[i - 1];
+			uint32_t channel_bit = 1u << entry->hcan->channel;
+			if (blocked & channel_bit) {
+				continue;
+			}
+
+			struct gs_host_frame *frame = entry->frame;
+			frame->flags &= ~GS_CAN_FLAG_TX_AT;
+			if (!can_send(entry->hcan, frame)) {
+				frame->flags |= GS_CAN_FLAG_TX_AT;
+				blocked |= channel_bit;
+				continue;
+			}
+
+			uint32_t late = now - entry->at_us;
+			entry->hcan->tx_at_frames++;
+			if (!entry->expired && (late > entry->hcan->tx_at_late_max_us)) {
+				entry->hcan->tx_at_late_max_us = late;
+			}
+			entry->frame = 0;
+			event_post(EVENT_CAN_TX); // room for the next host frame
+		}
+
+		tx_at_compact(due);
+
+		if (tx_at_len == 0) {
+			timer_compare_disarm(TIMER_CC_TX_AT);
+			return;
+		}
+
+		next_us = tx_at_queue[tx_at_len - 1].at_us;
+		if ((int32_t)(next_us - now) <= 0) {
+			// due but the TX queue is full, try again a bit later,
+			// or when the next frame is due if that comes first
+			next_us = now + TX_AT_RETRY_US;
+			if ((due > 0) && ((int32_t)(tx_at_queue[due - 1].at_us - next_us) < 0)) {
+				next_us = tx_at_queue[due - 1].at_us;
+			}
+		}
+		timer_compare_arm(TIMER_CC_TX_AT, next_us);
+
+		// the compare only fires on a match, a release time that passed while arming is handled here
+	} while ((int32_t)(next_us - timer_get()) <= 0);
+}
+
+/* Called from main(). Returns false while the queue is full. */
+bool tx_at_push(can_data_t *hcan, struct gs_host_frame *frame)
+{
+	bool retval = false;
+	int primask = disable_irq();
+
+	if (tx_at_len < CAN_TX_AT_QUEUE_SIZE) {
+		uint32_t at_us = frame->timestamp_us;
+		unsigned pos = tx_at_len;
+
+		// a replay delivers the frames in time order, so this rarely moves anything.
+		// Frames of the same time stay in the order they came in.
+		while ((pos > 0) && ((int32_t)(tx_at_queue[pos-1].at_us - at_us) <= 0)) {
+			tx_at_queue[pos] = tx_at_queue[pos-1];
+			pos--;
+		}
+		tx_at_queue[pos].at_us = at_us;
+		tx_at_queue[pos].frame = frame;
+		tx_at_queue[pos].hcan = hcan;
+		tx_at_queue[pos].expired = (int32_t)(timer_get() - at_us) >= 0;
+		if (tx_at_queue[pos].expired) {
+			hcan->tx_at_expired++;
+		}
+		tx_at_len++;
+
+		if (pos == tx_at_len - 1) {
+			tx_at_run(); // new first frame, or already due
+		}
+		retval = true;
+	}
+
+	enable_irq(primask);
+	return retval;
+}
+
+/* Drops the held frames of a channel that is reset. Each is echoed back
+ * as failed, in the order it would have gone out, like a frame aborted in
+ * its mailbox. Called from the USB interrupt. */
+void tx_at_stop(can_data_t *hcan)
+{
+	for (unsigned i=tx_at_len; i>0; i--) {
+		if (tx_at_queue[i - 1].hcan == hcan) {
+			struct gs_host_frame *frame = tx_at_queue[i - 1].frame;
+			frame->flags &= ~GS_CAN_FLAG_TX_AT;
+			can_tx_drop(hcan, frame);
+			tx_at_queue[i - 1].frame = 0;
+		}
+	}
+	tx_at_compact(0);
+	tx_at_run();
+	event_post(EVENT_CAN_TX);
+}
+
+void tx_at_irq_handler(void)
+{
+	if (timer_compare_clear(TIMER_CC_TX_AT)) {
+		tx_at_run();
+	}
+}
@@ -27,6 +27,7 @@ THE SOFTWARE.
 #include <stdbool.h>
 #include "usbd_core.h"
 #include "usbd_gs_can.h"
+#include "config.h"
 //#include "main.h"
 
 PCD_HandleTypeDef hpcd_USB;
@@ -129,6 +130,10 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef* hpcd)
 				
 		/* Enable USB HS Clocks */
 		__HAL_RCC_USB_OTG_HS_CLK_ENABLE();
+
+		/* No external PHY: the ULPI clock must stay gated in sleep mode,
+		   or the core stops responding after WFI */
+		__HAL_RCC_USB_OTG_HS_ULPI_CLK_SLEEP_DISABLE();
 		
 		/* Set USBHS Interrupt priority */
 		HAL_NVIC_SetPriority(OTG_HS_IRQn, 5, 0);
@@ -277,7 +282,7 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
 	hpcd_USB.Init.dev_endpoints = 4;
 	hpcd_USB.Init.speed = PCD_SPEED_FULL;
 	hpcd_USB.Init.ep0_mps = DEP0CTL_MPS_64;
-	hpcd_USB.Init.dma_enable = 0;
+	hpcd_USB.Init.dma_enable = USB_HS_DMA_ENABLE;
 	hpcd_USB.Init.use_dedicated_ep1 = 0;
 	hpcd_USB.Init.phy_itface = PCD_PHY_EMBEDDED;
 	hpcd_USB.Init.low_power_enable = 0;
@@ -289,11 +294,21 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
 #error Use FS or HS
 #endif
 	
+#ifdef USE_USBD_FS
 	/* total is what? */
 	HAL_PCDEx_SetRxFiFo(&hpcd_USB, 0x80); // all EPs
 	HAL_PCDEx_SetTxFiFo(&hpcd_USB, 0, 0x40); // setup
 	HAL_PCDEx_SetTxFiFo(&hpcd_USB, 1, 0x40); // GSUSB_ENDPOINT_IN
 	HAL_PCDEx_SetTxFiFo(&hpcd_USB, 2, 0x80); // GSUSB_ENDPOINT_OUT
+#else
+	/* OTG_HS has 1024 words of FIFO RAM. Leave the top of it alone, the
+	   core keeps its DMA state there. The IN FIFO holds four max size
+	   packets of a batched transfer. */
+	HAL_PCDEx_SetRxFiFo(&hpcd_USB, 0x200); // all EPs
+	HAL_PCDEx_SetTxFiFo(&hpcd_USB, 0, 0x40); // setup
+	HAL_PCDEx_SetTxFiFo(&hpcd_USB, 1, 0x100); // GSUSB_ENDPOINT_IN
+	HAL_PCDEx_SetTxFiFo(&hpcd_USB, 2, 0x40); // unused
+#endif
 	
 	return USBD_OK;
 }
@@ -383,6 +398,18 @@ uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
 	return HAL_PCD_EP_GetRxCount((PCD_HandleTypeDef*) pdev->pData, ep_addr);
 }
 
+/**
+  * @brief  Returns the frame number of the last SOF received.
+  * @param  pdev: Device handle
+  * @retval Frame number (11 bits)
+  */
+uint32_t USBD_LL_GetFrameNumber(USBD_HandleTypeDef *pdev)
+{
+	PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef*) pdev->pData;
+	USB_OTG_DeviceTypeDef *dev = (USB_OTG_DeviceTypeDef*) ((uint32_t)hpcd->Instance + USB_OTG_DEVICE_BASE);
+	return (dev->DSTS & USB_OTG_DSTS_FNSOF) >> USB_OTG_DSTS_FNSOF_Pos;
+}
+
 /**
   * @brief  Delays routine for the USB Device Library.
   * @param  Delay: Delay in ms
@@ -35,10 +35,20 @@ THE SOFTWARE.
 #include "gs_usb.h"
 #include "can.h"
 #include "timer.h" 
+#include "profile.h"
+#include "event.h"
+#include "periodic.h"
+#include "tx_at.h"
 //#include "flash.h"
 
 typedef struct {
-	uint8_t ep0_buf[CAN_CMD_PACKET_SIZE];
+	uint8_t ep0_buf[MAX(MAX(MAX(CAN_CMD_PACKET_SIZE, sizeof(struct gs_device_stats)),
+	                        PROFILE_ZONE_COUNT * sizeof(struct gs_device_profile_zone)),
+	                    sizeof(struct gs_device_timesync))] __attribute__((aligned(4)));
+
+	/* must outlive the IN transfer, so it cannot live on the stack.
+	   Word aligned for the OTG_HS DMA. */
+	uint8_t to_host_buf[CAN_IN_BATCH_BYTES] __attribute__((aligned(4)));
 
 	__IO uint32_t TxState;
 
@@ -46,15 +56,26 @@ typedef struct {
 
 	struct gs_host_config host_config;
 	queue_t *q_frame_pool;
-	queue_t *q_from_host;
+	ring_t *q_from_host;
+	ring_t *q_to_host;
 
         struct gs_host_frame *from_host_buf;
+	struct gs_host_frame *from_host_spare; /* armed next, without waiting on the pool */
 
 	can_data_t *channels[NUM_CAN_CHANNEL];
 
 	uint32_t out_requests;
 	uint32_t out_requests_fail;
 	uint32_t out_requests_no_buf;
+	uint32_t out_dropped;
+
+	/* time from CAN receive to USB submit, per channel */
+	uint32_t rx_latency_hist[NUM_CAN_CHANNEL][CAN_LATENCY_BUCKETS];
+
+	/* OUT endpoint left NAKing while the frame pool is empty */
+	__IO bool out_throttled;
+	uint32_t out_throttle_start_us;
+	uint32_t out_throttle_us;
 
 	led_data_t *leds;
 	bool dfu_detach_requested;
@@ -62,8 +83,25 @@ typedef struct {
 	bool timestamps_enabled;
 	uint32_t sof_timestamp_us;
 
+	/* device time of the last SOFs, for GS_USB_BREQ_GET_TIMESYNC */
+	struct gs_device_sof_sample sof_samples[GS_DEVICE_SOF_SAMPLES];
+	uint32_t sof_count;
+
         bool pad_pkts_to_max_pkt_size;
 
+	bool batch_in;
+	bool zlp_pending;
+
+	/* how long a batched IN transfer may wait for more frames, 0: none.
+	   Ends on the SOF after the deadline, or on TIMER_CC_IN_WINDOW below 1 ms. */
+	uint32_t in_window_us;
+	uint32_t in_window_deadline_us;
+	__IO bool in_window_held;
+
+	uint32_t in_transfers;
+	uint32_t in_frames;
+	uint32_t in_window_expired;
+
 } USBD_GS_CAN_HandleTypeDef __attribute__ ((aligned (4)));
 
 static uint8_t USBD_GS_CAN_Start(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
@@ -75,6 +113,7 @@ static uint8_t *USBD_GS_CAN_GetCfgDesc(uint16_t *len);
 static uint8_t USBD_GS_CAN_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t *USBD_GS_CAN_GetStrDesc(USBD_HandleTypeDef *pdev, uint8_t index, uint16_t *length);
 static uint8_t USBD_GS_CAN_SOF(struct _USBD_HandleTypeDef *pdev);
+static void USBD_GS_CAN_Throttle(USBD_GS_CAN_HandleTypeDef *hcan);
 
 /* CAN interface class callbacks structure */
 USBD_ClassTypeDef USBD_GS_CAN = {
@@ -263,20 +302,32 @@ static const struct gs_device_config USBD_GS_CAN_dconf = {
 	0, // reserved 1
 	0, // reserved 2
 	0, // reserved 3
-	0, // interface count (0=1, 1=2..)
+	NUM_CAN_CHANNEL-1, // interface count (0=1, 1=2..)
 	2, // software version
 	1  // hardware version
 };
 
-// bit timing constraints
-static const struct gs_device_bt_const USBD_GS_CAN_btconst = {
+// bit timing constraints, fclk_can is filled in from the clock tree
+static struct gs_device_bt_const USBD_GS_CAN_btconst = {
 	GS_CAN_FEATURE_LISTEN_ONLY  // supported features
 	| GS_CAN_FEATURE_LOOP_BACK
 	| GS_CAN_FEATURE_HW_TIMESTAMP
 	| GS_CAN_FEATURE_IDENTIFY
 	| GS_CAN_FEATURE_USER_ID
-	| GS_CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE,
-	48000000, // can timing base clock
+	| GS_CAN_FEATURE_PAD_PKTS_TO_MAX_PKT_SIZE
+	| GS_CAN_FEATURE_BATCH_IN
+	| GS_CAN_FEATURE_FIFO_SPLIT
+	| GS_CAN_FEATURE_SET_BITRATE
+	| GS_CAN_FEATURE_TIMESYNC
+	| GS_CAN_FEATURE_PERIODIC
+	| GS_CAN_FEATURE_TX_AT
+	| GS_CAN_FEATURE_DECIMATE
+	| GS_CAN_FEATURE_IN_WINDOW
+#if PROFILE_ENABLE
+	| GS_CAN_FEATURE_PROFILE
+#endif
+	,
+	0, // can timing base clock
 	1, // tseg1 min
 	16, // tseg1 max
 	1, // tseg2 min
@@ -288,24 +339,24 @@ static const struct gs_device_bt_const USBD_GS_CAN_btconst = {
 };
 
 
-uint8_t USBD_GS_CAN_Init(USBD_HandleTypeDef *pdev, queue_t *q_frame_pool, queue_t *q_from_host, led_data_t *leds)
+/* static, the class data outgrew the 0x200 byte heap */
+static USBD_GS_CAN_HandleTypeDef USBD_GS_CAN_Handle;
+
+uint8_t USBD_GS_CAN_Init(USBD_HandleTypeDef *pdev, queue_t *q_frame_pool, ring_t *q_from_host, ring_t *q_to_host, led_data_t *leds)
 {
-	uint8_t ret = USBD_FAIL;
-	USBD_GS_CAN_HandleTypeDef *hcan = calloc(1, sizeof(USBD_GS_CAN_HandleTypeDef));
+	USBD_GS_CAN_HandleTypeDef *hcan = &USBD_GS_CAN_Handle;
 
-	if(hcan != 0) {
-		hcan->q_frame_pool = q_frame_pool;
-		hcan->q_from_host = q_from_host;
-		hcan->leds = leds;
-		pdev->pClassData = hcan;
-		hcan->from_host_buf = NULL;
+	USBD_GS_CAN_btconst.fclk_can = can_get_clock();
 
-		ret = USBD_OK;
-	} else {
-		pdev->pClassData = 0;
-	}
+	hcan->q_frame_pool = q_frame_pool;
+	hcan->q_from_host = q_from_host;
+	hcan->q_to_host = q_to_host;
+	hcan->leds = leds;
+	pdev->pClassData = hcan;
+	hcan->from_host_buf = NULL;
+	hcan->from_host_spare = NULL;
 
-	return ret;
+	return USBD_OK;
 }
 
 
@@ -319,8 +370,19 @@ static uint8_t USBD_GS_CAN_Start(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 	  USBD_GS_CAN_HandleTypeDef *hcan = (USBD_GS_CAN_HandleTypeDef*) pdev->pClassData;
 		USBD_LL_OpenEP(pdev, GSUSB_ENDPOINT_IN, USBD_EP_TYPE_BULK, CAN_DATA_MAX_PACKET_SIZE);
 		USBD_LL_OpenEP(pdev, GSUSB_ENDPOINT_OUT, USBD_EP_TYPE_BULK, CAN_DATA_MAX_PACKET_SIZE);
-                hcan->from_host_buf = queue_pop_front(hcan->q_frame_pool);
-		USBD_GS_CAN_PrepareReceive(pdev);
+		hcan->in_window_us = 0; // a new host session starts without one
+		hcan->in_window_held = false;
+		if (hcan->from_host_buf == NULL) {
+			hcan->from_host_buf = queue_pop_front(hcan->q_frame_pool);
+		}
+		if (hcan->from_host_spare == NULL) {
+			hcan->from_host_spare = queue_pop_front(hcan->q_frame_pool);
+		}
+		if (hcan->from_host_buf != NULL) {
+			USBD_GS_CAN_PrepareReceive(pdev);
+		} else {
+			USBD_GS_CAN_Throttle(hcan);
+		}
 		ret = USBD_OK;
 	} else {
 		ret = USBD_FAIL;
@@ -342,7 +404,19 @@ static uint8_t USBD_GS_CAN_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 static uint8_t USBD_GS_CAN_SOF(struct _USBD_HandleTypeDef *pdev)
 {
 	USBD_GS_CAN_HandleTypeDef *hcan = (USBD_GS_CAN_HandleTypeDef*) pdev->pClassData;
-	hcan->sof_timestamp_us = timer_get();
+	uint64_t now = timer_get64();
+	struct gs_device_sof_sample *sample = &hcan->sof_samples[hcan->sof_count % GS_DEVICE_SOF_SAMPLES];
+
+	sample->frame = USBD_LL_GetFrameNumber(pdev);
+	sample->timestamp_us = now;
+	hcan->sof_count++;
+
+	hcan->sof_timestamp_us = (uint32_t)now;
+
+	if (hcan->in_window_held && ((int32_t)((uint32_t)now - hcan->in_window_deadline_us) >= 0)) {
+		hcan->in_window_held = false;
+		event_post(EVENT_TO_HOST);
+	}
 	return USBD_OK;
 }
 
@@ -381,8 +455,8 @@ static uint8_t USBD_GS_CAN_EP0_RxReady(USBD_HandleTypeDef *pdev) {
     		memcpy(&param_u32, hcan->ep0_buf, sizeof(param_u32));
     		if (param_u32) {
     			led_run_sequence(hcan->leds, led_identify_seq, -1);
-    		} else {
-    			ch = hcan->channels[req->wValue]; // TODO verify wValue input data (implement getChannelData() ?)
+    		} else if (req->wValue < NUM_CAN_CHANNEL) {
+    			ch = hcan->channels[req->wValue];
 						int isEnabled = 1;
 						isEnabled = can_is_enabled(ch);
         		led_set_mode(hcan->leds, isEnabled ? led_mode_normal : led_mode_off);
@@ -404,6 +478,8 @@ static uint8_t USBD_GS_CAN_EP0_RxReady(USBD_HandleTypeDef *pdev) {
 
 				if (mode->mode == GS_CAN_MODE_RESET) {
 
+					periodic_stop(ch);
+					tx_at_stop(ch);
 					can_disable(ch);
 					led_set_mode(hcan->leds, led_mode_off);
 
@@ -411,6 +487,8 @@ static uint8_t USBD_GS_CAN_EP0_RxReady(USBD_HandleTypeDef *pdev) {
 
 					hcan->timestamps_enabled = (mode->flags & GS_CAN_MODE_HW_TIMESTAMP) != 0;
 					hcan->pad_pkts_to_max_pkt_size = (mode->flags & GS_CAN_MODE_PAD_PKTS_TO_MAX_PKT_SIZE) != 0;
+					hcan->batch_in = (mode->flags & GS_CAN_MODE_BATCH_IN) != 0;
+					can_set_fifo_split(ch, (mode->flags & GS_CAN_MODE_FIFO_SPLIT) != 0);
 					can_enable(ch,
 						(mode->flags & GS_CAN_MODE_LOOP_BACK) != 0,
 						(mode->flags & GS_CAN_MODE_LISTEN_ONLY) != 0,
@@ -422,6 +500,50 @@ static uint8_t USBD_GS_CAN_EP0_RxReady(USBD_HandleTypeDef *pdev) {
 			}
     		break;
 
+    	case GS_USB_BREQ_SET_FILTER:
+    		if (req->wValue < NUM_CAN_CHANNEL) {
+    			can_set_filter(hcan->channels[req->wValue], (struct gs_device_filter*)hcan->ep0_buf);
+    		}
+    		break;
+
+    	case GS_USB_BREQ_SET_BITRATE:
+    		if (req->wValue < NUM_CAN_CHANNEL) {
+    			struct gs_device_bitrate bitrate;
+    			memcpy(&bitrate, hcan->ep0_buf, sizeof(bitrate));
+    			can_set_bitrate(hcan->channels[req->wValue], bitrate.bitrate, MIN(bitrate.sample_point, 1000));
+    		}
+    		break;
+
+    	case GS_USB_BREQ_SET_ERROR_INTERVAL:
+    		if (req->wValue < NUM_CAN_CHANNEL) {
+    			uint32_t interval_us;
+    			memcpy(&interval_us, hcan->ep0_buf, sizeof(interval_us));
+    			can_set_error_interval(hcan->channels[req->wValue], interval_us);
+    		}
+    		break;
+
+    	case GS_USB_BREQ_SET_IN_WINDOW:
+    		memcpy(&param_u32, hcan->ep0_buf, sizeof(param_u32));
+    		hcan->in_window_us = param_u32;
+    		event_post(EVENT_TO_HOST); // anything held goes by the new window
+    		break;
+
+    	case GS_USB_BREQ_SET_DECIMATE:
+    		if (req->wValue < NUM_CAN_CHANNEL) {
+    			struct gs_device_decimate decimate;
+    			memcpy(&decimate, hcan->ep0_buf, sizeof(decimate));
+    			can_set_decimate(hcan->channels[req->wValue], &decimate);
+    		}
+    		break;
+
+    	case GS_USB_BREQ_SET_PERIODIC:
+    		if (req->wValue < NUM_CAN_CHANNEL) {
+    			struct gs_device_periodic periodic;
+    			memcpy(&periodic, hcan->ep0_buf, sizeof(periodic));
+    			periodic_set(hcan->channels[req->wValue], &periodic);
+    		}
+    		break;
+
     	case GS_USB_BREQ_BITTIMING:
     		timing = (struct gs_device_bittiming*)hcan->ep0_buf;
     		if (req->wValue < NUM_CAN_CHANNEL) {
@@ -469,6 +591,83 @@ static uint8_t USBD_GS_CAN_DFU_Request(USBD_HandleTypeDef *pdev, USBD_SetupReqTy
 	return USBD_OK;
 }
 
+static void USBD_GS_CAN_GetStats(USBD_GS_CAN_HandleTypeDef *hcan, can_data_t *ch, struct gs_device_stats *stats)
+{
+	for (unsigned i=0; i<CAN_RX_FIFO_COUNT; i++) {
+		stats->rx_fifo_frames[i] = ch->rx_fifo_frames[i];
+		stats->rx_fifo_overruns[i] = ch->rx_fifo_overruns[i];
+	}
+	stats->pool_size = hcan->q_frame_pool->max_elements;
+	stats->pool_used_max = stats->pool_size - MIN(queue_low_water(hcan->q_frame_pool), stats->pool_size);
+	stats->tx_preempted = ch->tx_preempted;
+	for (unsigned i=0; i<CAN_TX_PRIO_CLASSES; i++) {
+		stats->tx_prio_frames[i] = ch->tx_prio_frames[i];
+		stats->tx_prio_delay_us[i] = ch->tx_prio_delay_us[i];
+		stats->tx_prio_delay_max_us[i] = ch->tx_prio_delay_max_us[i];
+	}
+	stats->rx_frames = ch->rx_fifo_frames[0] + ch->rx_fifo_frames[1];
+	stats->tx_queued = ch->tx_queued;
+	stats->tx_echoed = ch->tx_echoed;
+	stats->tx_failed = ch->tx_failed;
+	stats->bus_errors = ch->bus_errors;
+	stats->tx_queue_max = ch->tx_queue_high_water;
+	stats->from_host_max = ring_high_water(hcan->q_from_host);
+	stats->to_host_max = ring_high_water(hcan->q_to_host);
+	stats->out_requests = hcan->out_requests;
+	stats->out_requests_fail = hcan->out_requests_fail;
+	memcpy(stats->rx_latency_hist, hcan->rx_latency_hist[ch->channel], sizeof(stats->rx_latency_hist));
+	stats->periodic_frames = ch->periodic_frames;
+	stats->periodic_missed = ch->periodic_missed;
+	stats->tx_at_frames = ch->tx_at_frames;
+	stats->tx_at_expired = ch->tx_at_expired;
+	stats->tx_at_late_max_us = ch->tx_at_late_max_us;
+	stats->rx_decimated = ch->rx_decimated;
+	for (unsigned i=0; i<6; i++) {
+		stats->err_lec[i] = ch->err_lec[i];
+	}
+	stats->bus_off = ch->bus_off_count;
+	stats->rx_pool_empty = ch->rx_pool_empty;
+	stats->to_host_dropped = ch->to_host_dropped;
+	stats->out_dropped = hcan->out_dropped;
+	stats->in_transfers = hcan->in_transfers;
+	stats->in_frames = hcan->in_frames;
+	stats->in_window_expired = hcan->in_window_expired;
+	stats->out_throttle_count = hcan->out_requests_no_buf;
+	stats->out_throttle_us = hcan->out_throttle_us;
+	if (hcan->out_throttled) {
+		stats->out_throttle_us += timer_get() - hcan->out_throttle_start_us;
+	}
+}
+
+/* runs in the USB interrupt like USBD_GS_CAN_SOF, so the samples are consistent */
+static void USBD_GS_CAN_GetTimesync(USBD_GS_CAN_HandleTypeDef *hcan, struct gs_device_timesync *sync)
+{
+	unsigned count = MIN(hcan->sof_count, GS_DEVICE_SOF_SAMPLES);
+
+	memset(sync, 0, sizeof(*sync));
+	sync->now_us = timer_get64();
+	sync->sof_count = hcan->sof_count;
+	sync->sample_count = count;
+	for (unsigned i=0; i<count; i++) {
+		sync->samples[i] = hcan->sof_samples[(hcan->sof_count - 1 - i) % GS_DEVICE_SOF_SAMPLES];
+	}
+}
+
+/* data stage length of the requests that send the device data, as EP0_RxReady reads it */
+static uint16_t USBD_GS_CAN_OutRequestLength(uint8_t bRequest)
+{
+	switch (bRequest) {
+		case GS_USB_BREQ_HOST_FORMAT:        return sizeof(struct gs_host_config);
+		case GS_USB_BREQ_MODE:               return sizeof(struct gs_device_mode);
+		case GS_USB_BREQ_BITTIMING:          return sizeof(struct gs_device_bittiming);
+		case GS_USB_BREQ_SET_FILTER:         return sizeof(struct gs_device_filter);
+		case GS_USB_BREQ_SET_BITRATE:        return sizeof(struct gs_device_bitrate);
+		case GS_USB_BREQ_SET_PERIODIC:       return sizeof(struct gs_device_periodic);
+		case GS_USB_BREQ_SET_DECIMATE:       return sizeof(struct gs_device_decimate);
+		default:                             return sizeof(uint32_t); // IDENTIFY, SET_USER_ID, SET_ERROR_INTERVAL, SET_IN_WINDOW
+	}
+}
+
 static uint8_t USBD_GS_CAN_Config_Request(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 {
 	USBD_GS_CAN_HandleTypeDef *hcan = (USBD_GS_CAN_HandleTypeDef*) pdev->pClassData;
@@ -481,18 +680,30 @@ static uint8_t USBD_GS_CAN_Config_Request(USBD_HandleTypeDef *pdev, USBD_SetupRe
 		case GS_USB_BREQ_BITTIMING:
 		case GS_USB_BREQ_IDENTIFY:
 		case GS_USB_BREQ_SET_USER_ID:
+		case GS_USB_BREQ_SET_FILTER:
+		case GS_USB_BREQ_SET_BITRATE:
+		case GS_USB_BREQ_SET_PERIODIC:
+		case GS_USB_BREQ_SET_DECIMATE:
+		case GS_USB_BREQ_SET_ERROR_INTERVAL:
+		case GS_USB_BREQ_SET_IN_WINDOW:
+			// EP0_RxReady reads the whole struct, anything else would leave
+			// stale bytes in it or run past ep0_buf
+			if ((req->wLength != USBD_GS_CAN_OutRequestLength(req->bRequest)) || (req->wLength > sizeof(hcan->ep0_buf))) {
+				USBD_CtlError(pdev, req);
+				break;
+			}
 			hcan->last_setup_request = *req;
 			USBD_CtlPrepareRx(pdev, hcan->ep0_buf, req->wLength);
 			break;
 
 		case GS_USB_BREQ_DEVICE_CONFIG:
 			memcpy(hcan->ep0_buf, &USBD_GS_CAN_dconf, sizeof(USBD_GS_CAN_dconf));
-			USBD_CtlSendData(pdev, hcan->ep0_buf, req->wLength);
+			USBD_CtlSendData(pdev, hcan->ep0_buf, MIN(sizeof(USBD_GS_CAN_dconf), req->wLength));
 			break;
 
 		case GS_USB_BREQ_BT_CONST:
 			memcpy(hcan->ep0_buf, &USBD_GS_CAN_btconst, sizeof(USBD_GS_CAN_btconst));
-			USBD_CtlSendData(pdev, hcan->ep0_buf, req->wLength);
+			USBD_CtlSendData(pdev, hcan->ep0_buf, MIN(sizeof(USBD_GS_CAN_btconst), req->wLength));
 			break;
 
 		case GS_USB_BREQ_TIMESTAMP:
@@ -500,6 +711,39 @@ static uint8_t USBD_GS_CAN_Config_Request(USBD_HandleTypeDef *pdev, USBD_SetupRe
 			USBD_CtlSendData(pdev, hcan->ep0_buf, sizeof(hcan->sof_timestamp_us));
     		break;
 
+		case GS_USB_BREQ_GET_TIMESYNC:
+			USBD_GS_CAN_GetTimesync(hcan, (struct gs_device_timesync*)hcan->ep0_buf);
+			USBD_CtlSendData(pdev, hcan->ep0_buf, MIN(sizeof(struct gs_device_timesync), req->wLength));
+			break;
+
+		case GS_USB_BREQ_GET_STATS:
+			if (req->wValue < NUM_CAN_CHANNEL) {
+				USBD_GS_CAN_GetStats(hcan, hcan->channels[req->wValue], (struct gs_device_stats*)hcan->ep0_buf);
+				USBD_CtlSendData(pdev, hcan->ep0_buf, MIN(sizeof(struct gs_device_stats), req->wLength));
+			} else {
+				USBD_CtlError(pdev, req);
+			}
+			break;
+
+#if PROFILE_ENABLE
+		case GS_USB_BREQ_GET_PROFILE: {
+			struct gs_device_profile_zone *zone = (struct gs_device_profile_zone*)hcan->ep0_buf;
+			for (unsigned i=0; i<PROFILE_ZONE_COUNT; i++) {
+				uint32_t hits, min, max, avg;
+				profile_get(i, &hits, &min, &max, &avg);
+				zone[i].hits = hits;
+				zone[i].cycles_min = min;
+				zone[i].cycles_max = max;
+				zone[i].cycles_avg = avg;
+			}
+			if (req->wValue != 0) {
+				profile_reset();
+			}
+			USBD_CtlSendData(pdev, hcan->ep0_buf, MIN(PROFILE_ZONE_COUNT * sizeof(*zone), req->wLength));
+			break;
+		}
+#endif
+
 		case GS_USB_BREQ_GET_USER_ID:
 			if (req->wValue < NUM_CAN_CHANNEL) {
 				d32 = 0; // flash_get_user_id(req->wValue);
@@ -602,7 +846,17 @@ static uint8_t USBD_GS_CAN_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum) {
 	(void) epnum;
 
 	USBD_GS_CAN_HandleTypeDef *hcan = (USBD_GS_CAN_HandleTypeDef*)pdev->pClassData;
+
+	// A transfer that is an exact multiple of the max packet size
+	// must be terminated with a zero length packet
+	if (hcan->zlp_pending) {
+		hcan->zlp_pending = false;
+		USBD_LL_Transmit(pdev, GSUSB_ENDPOINT_IN, NULL, 0);
+		return USBD_OK;
+	}
+
 	hcan->TxState = 0;
+	event_post(EVENT_TO_HOST);
 	return USBD_OK;
 }
 
@@ -615,23 +869,77 @@ static uint8_t USBD_GS_CAN_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum) {
 	hcan->out_requests++;
 
 	uint32_t rxlen = USBD_LL_GetRxDataSize(pdev, epnum);
-	if (rxlen >= (sizeof(struct gs_host_frame)-4)) {
-	        struct gs_host_frame *frame = queue_pop_front_i(hcan->q_frame_pool);
-		if(frame){
-		        queue_push_back_i(hcan->q_from_host, hcan->from_host_buf);
-		        hcan->from_host_buf = frame;
-		  
-		        retval = USBD_OK;
+	if ((rxlen >= (sizeof(struct gs_host_frame)-4)) && (hcan->from_host_buf->channel >= NUM_CAN_CHANNEL)) {
+		hcan->out_dropped++; // no such channel, receive into the same buffer again
+		USBD_GS_CAN_PrepareReceive(pdev);
+	} else if (rxlen >= (sizeof(struct gs_host_frame)-4)) {
+		struct gs_host_frame *frame = hcan->from_host_buf;
+		if (rxlen < sizeof(struct gs_host_frame)) {
+			frame->flags &= ~GS_CAN_FLAG_TX_AT; // no timestamp to hold it for
+		}
+
+		// re-arm into the spare first so the endpoint stops NAKing as early
+		// as possible, then hand the filled frame on and restock the spare
+		hcan->from_host_buf = hcan->from_host_spare;
+		if (hcan->from_host_buf == NULL) {
+			hcan->from_host_buf = queue_pop_front_i(hcan->q_frame_pool); // spare ran out earlier
 		}
-		else{
-		// Discard current packet from host if we have no place
-		// to put the next one
+		if (hcan->from_host_buf != NULL) {
+			USBD_GS_CAN_PrepareReceive(pdev);
+			hcan->from_host_spare = queue_pop_front_i(hcan->q_frame_pool);
+		} else {
+			// no room for the next one: keep the endpoint NAKing until
+			// USBD_GS_CAN_ResumeReceive() finds a free buffer
+			USBD_GS_CAN_Throttle(hcan);
+		}
+
+		if (ring_push(hcan->q_from_host, frame)) {
+			event_post(EVENT_FROM_HOST);
+		} else {
+			queue_push_back_i(hcan->q_frame_pool, frame);
+			hcan->out_dropped++;
+			event_post(EVENT_FROM_HOST); // the main loop resumes OUT once it sees the returned frame
 		}
+		retval = USBD_OK;
+	} else {
+		hcan->out_requests_fail++; // short packet, receive into the same buffer again
+		USBD_GS_CAN_PrepareReceive(pdev);
 	}
-	USBD_GS_CAN_PrepareReceive(pdev);
     return retval;
 }
 
+static void USBD_GS_CAN_Throttle(USBD_GS_CAN_HandleTypeDef *hcan)
+{
+	if (!hcan->out_throttled) {
+		hcan->out_throttled = true;
+		hcan->out_throttle_start_us = timer_get();
+		hcan->out_requests_no_buf++;
+	}
+}
+
+/* re-arm the OUT endpoint after a throttle once the pool has a buffer again,
+ * called from main() */
+void USBD_GS_CAN_ResumeReceive(USBD_HandleTypeDef *pdev)
+{
+	USBD_GS_CAN_HandleTypeDef *hcan = (USBD_GS_CAN_HandleTypeDef*)pdev->pClassData;
+
+	if (!hcan->out_throttled) {
+		return;
+	}
+
+	int primask = disable_irq();
+	if (hcan->out_throttled) {
+		hcan->from_host_buf = queue_pop_front_i(hcan->q_frame_pool);
+		if (hcan->from_host_buf != NULL) {
+			hcan->out_throttled = false;
+			hcan->out_throttle_us += timer_get() - hcan->out_throttle_start_us;
+			USBD_GS_CAN_PrepareReceive(pdev);
+			hcan->from_host_spare = queue_pop_front_i(hcan->q_frame_pool);
+		}
+	}
+	enable_irq(primask);
+}
+
 static uint8_t *USBD_GS_CAN_GetCfgDesc(uint16_t *len)
 {
 	*len = sizeof(USBD_GS_CAN_CfgDesc);
@@ -678,9 +986,40 @@ uint8_t USBD_GS_CAN_GetPadPacketsToMaxPacketSize(USBD_HandleTypeDef *pdev)
 	return hcan->pad_pkts_to_max_pkt_size;
 }
 
+bool USBD_GS_CAN_GetBatchIn(USBD_HandleTypeDef *pdev)
+{
+	USBD_GS_CAN_HandleTypeDef *hcan = (USBD_GS_CAN_HandleTypeDef*)pdev->pClassData;
+	return hcan->batch_in;
+}
+
+/* log2 histogram of how long a received frame waited for the USB IN transfer */
+static void USBD_GS_CAN_CountLatency(USBD_GS_CAN_HandleTypeDef *hcan, struct gs_host_frame *frame)
+{
+	if ((frame->echo_id != 0xFFFFFFFF) || (frame->can_id & CAN_ERR_FLAG) || (frame->channel >= NUM_CAN_CHANNEL)) {
+		return; // echoes, periodic frames and error frames don't come from the receive FIFOs
+	}
+
+	uint32_t latency = timer_get() - frame->timestamp_us;
+	unsigned bucket = (latency == 0) ? 0 : 32 - __CLZ(latency);
+	if (bucket >= CAN_LATENCY_BUCKETS) {
+		bucket = CAN_LATENCY_BUCKETS - 1;
+	}
+	hcan->rx_latency_hist[frame->channel][bucket]++;
+}
+
+/* copies a frame into the IN buffer the way the host expects it */
+static void USBD_GS_CAN_CopyFrame(USBD_GS_CAN_HandleTypeDef *hcan, uint8_t *buf, struct gs_host_frame *frame, size_t len)
+{
+	memcpy(buf, frame, len);
+	if (frame->echo_id == PERIODIC_RX_ECHO_ID) {
+		((struct gs_host_frame *)buf)->echo_id = 0xFFFFFFFF; // reported like a received frame
+	}
+	USBD_GS_CAN_CountLatency(hcan, frame);
+}
+
 uint8_t USBD_GS_CAN_SendFrame(USBD_HandleTypeDef *pdev, struct gs_host_frame *frame)
 {
-        uint8_t buf[CAN_DATA_MAX_PACKET_SIZE],*send_addr;
+        uint8_t *buf;
   
 	USBD_GS_CAN_HandleTypeDef *hcan = (USBD_GS_CAN_HandleTypeDef*)pdev->pClassData;
 	size_t len = sizeof(struct gs_host_frame);
@@ -688,22 +1027,120 @@ uint8_t USBD_GS_CAN_SendFrame(USBD_HandleTypeDef *pdev, struct gs_host_frame *fr
 	if (!hcan->timestamps_enabled)
 	  len -= 4;
 
-	send_addr = (uint8_t *)frame;
-	
+	if (hcan->TxState != 0)
+		return USBD_BUSY;
+
+	// The caller hands the frame back to the pool right away, so the
+	// transfer (DMA on OTG_HS) has to run from our own copy.
+	buf = hcan->to_host_buf;
+	USBD_GS_CAN_CopyFrame(hcan, buf, frame, len);
+	hcan->in_transfers++;
+	hcan->in_frames++;
+
 	if(hcan->pad_pkts_to_max_pkt_size){
 	        // When talking to WinUSB it seems to help a lot if the
 		// size of packet you send equals the max packet size.
 	        // In this mode, fill packets out to max packet size and
 	        // then send.
-		memcpy(buf, frame, len);
 
 		// zero rest of buffer
-		memset(buf + len, 0, sizeof(buf) - len);
-		send_addr = buf;
-		len = sizeof(buf);
+		memset(buf + len, 0, CAN_DATA_MAX_PACKET_SIZE - len);
+		len = CAN_DATA_MAX_PACKET_SIZE;
 	}
    
-	return USBD_GS_CAN_Transmit(pdev, send_addr, len);
+	return USBD_GS_CAN_Transmit(pdev, buf, len);
+}
+
+/* returns whether the batch may wait for deadline_us, and makes sure
+ * EVENT_TO_HOST is posted once it passes */
+static bool USBD_GS_CAN_InWindowHold(USBD_GS_CAN_HandleTypeDef *hcan, uint32_t deadline_us)
+{
+	if ((int32_t)(timer_get() - deadline_us) >= 0) {
+		return false;
+	}
+	if (hcan->in_window_held && (hcan->in_window_deadline_us == deadline_us)) {
+		return true; // already armed for this frame
+	}
+
+	hcan->in_window_held = false;
+	hcan->in_window_deadline_us = deadline_us;
+	hcan->in_window_held = true; // the SOF checks from here on
+	if (hcan->in_window_us < 1000) {
+		timer_compare_arm(TIMER_CC_IN_WINDOW, deadline_us);
+		if ((int32_t)(timer_get() - deadline_us) >= 0) {
+			return false; // passed while arming, the compare would not match any more
+		}
+	}
+	return true;
+}
+
+static void USBD_GS_CAN_InWindowRelease(USBD_GS_CAN_HandleTypeDef *hcan)
+{
+	if (hcan->in_window_held) {
+		hcan->in_window_held = false;
+		timer_compare_disarm(TIMER_CC_IN_WINDOW);
+	}
+}
+
+/* TIMER_CC_IN_WINDOW ran out, called from the TIM2 interrupt */
+void USBD_GS_CAN_InWindowIrqHandler(void)
+{
+	if (timer_compare_clear(TIMER_CC_IN_WINDOW)) {
+		timer_compare_disarm(TIMER_CC_IN_WINDOW);
+		event_post(EVENT_TO_HOST);
+	}
+}
+
+uint8_t USBD_GS_CAN_SendFrameBatch(USBD_HandleTypeDef *pdev, ring_t *q_to_host)
+{
+	USBD_GS_CAN_HandleTypeDef *hcan = (USBD_GS_CAN_HandleTypeDef*)pdev->pClassData;
+	struct gs_host_frame *frame;
+	size_t frame_len = sizeof(struct gs_host_frame);
+	size_t stride;
+	size_t len = 0;
+
+	if (hcan->TxState != 0)
+		return USBD_BUSY;
+
+	if (!hcan->timestamps_enabled)
+	  frame_len -= 4;
+
+	// Frames are laid out back to back, or one per max size
+	// packet when padding was requested by the host.
+	stride = hcan->pad_pkts_to_max_pkt_size ? CAN_DATA_MAX_PACKET_SIZE : frame_len;
+
+	if (hcan->in_window_us > 0) {
+		frame = ring_peek(q_to_host);
+		if (!frame)
+			return USBD_FAIL;
+		if (ring_size(q_to_host) < sizeof(hcan->to_host_buf) / stride) {
+			// not enough for a full transfer yet, the oldest frame sets the deadline
+			if (USBD_GS_CAN_InWindowHold(hcan, frame->timestamp_us + hcan->in_window_us))
+				return USBD_BUSY;
+			hcan->in_window_expired++;
+		}
+		USBD_GS_CAN_InWindowRelease(hcan);
+	}
+
+	while (len + stride <= sizeof(hcan->to_host_buf)) {
+		frame = ring_pop(q_to_host);
+		if (!frame)
+			break;
+
+		USBD_GS_CAN_CopyFrame(hcan, hcan->to_host_buf + len, frame, frame_len);
+		memset(hcan->to_host_buf + len + frame_len, 0, stride - frame_len);
+		len += stride;
+
+		queue_push_back(hcan->q_frame_pool, frame);
+	}
+
+	if (len == 0)
+		return USBD_FAIL;
+
+	hcan->in_transfers++;
+	hcan->in_frames += len / stride;
+	hcan->zlp_pending = (len % CAN_DATA_MAX_PACKET_SIZE) == 0;
+	return USBD_GS_CAN_Transmit(pdev, hcan->to_host_buf, len);
 }
 
 #define DFU_INTERFACE_STRING_FS      (uint8_t*) "candleLight firmware upgrade interface"